@@ -1,7 +1,25 @@
-#include <map>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <vector>
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 const int type_string = 0;
 const int type_number = 1;
 const int type_object = 2;
@@ -27,11 +45,140 @@ const char* type_to_string(int type)
     return "bad type";
 }
 
+// Bump allocator owned by a jdocument. Nodes, strings and container storage are carved out of large blocks
+// which are all released together, so tearing down a tree never visits its nodes.
+struct jarena
+{
+    static const size_t block_size = 1 << 20;
+
+    std::vector<char*> blocks;
+    std::vector<char*> large;
+    char* current = nullptr;
+    size_t remaining = 0;
+
+    jarena() = default;
+    jarena(const jarena&) = delete;
+    jarena& operator=(const jarena&) = delete;
+
+    ~jarena()
+    {
+        release();
+    }
+
+    void* allocate(size_t size, size_t align = alignof(std::max_align_t))
+    {
+        size_t pad = (-(uintptr_t) current) & (align - 1);
+        if (pad + size <= remaining)
+        {
+            char* p = current + pad;
+            current = p + size;
+            remaining -= pad + size;
+            return p;
+        }
+
+        // Oversized requests get a block of their own so the current block keeps its free space
+        if (size > block_size / 4)
+        {
+            char* b = new char[size];
+            large.emplace_back(b);
+            return b;
+        }
+
+        current = new char[block_size];
+        blocks.emplace_back(current);
+        remaining = block_size;
+
+        char* p = current;
+        current += size;
+        remaining -= size;
+        return p;
+    }
+
+    template<typename T, typename... Args>
+    T* make(Args&&... args)
+    {
+        return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    void release()
+    {
+        for (char* b: blocks)
+        {
+            delete[] b;
+        }
+
+        for (char* b: large)
+        {
+            delete[] b;
+        }
+
+        blocks.clear();
+        large.clear();
+        current = nullptr;
+        remaining = 0;
+    }
+
+    // Frees everything like release() but keeps one block, for arenas that are emptied and refilled often
+    void reset()
+    {
+        if (blocks.empty())
+        {
+            release();
+            return;
+        }
+
+        char* first = blocks[0];
+        blocks.erase(blocks.begin());
+        release();
+
+        blocks.emplace_back(first);
+        current = first;
+        remaining = block_size;
+    }
+};
+
+// Container allocator which draws from an arena, or from the heap for trees built without one
+template<typename T>
+struct jallocator
+{
+    typedef T value_type;
+
+    jarena* arena = nullptr;
+
+    jallocator() = default;
+    jallocator(jarena* arena) : arena(arena) {}
+
+    template<typename U>
+    jallocator(const jallocator<U>& o) : arena(o.arena) {}
+
+    T* allocate(size_t n)
+    {
+        if (arena != nullptr)
+            return static_cast<T*>(arena->allocate(n * sizeof(T), alignof(T)));
+
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n)
+    {
+        if (arena == nullptr)
+            std::allocator<T>().deallocate(p, n);
+    }
+
+    template<typename U>
+    bool operator==(const jallocator<U>& o) const
+    {
+        return arena == o.arena;
+    }
+};
+
 struct jvalue
 {
     int type;
 };
 
+static void jdestroy(jvalue* v);
+
 void typecheck(jvalue* value, int expected)
 {
     if (value == nullptr)
@@ -44,11 +191,19 @@ void typecheck(jvalue* value, int expected)
     }
 }
 
+// Nodes built into a jdocument live in its arena and must not be deleted individually;
+// only trees from jparse/jparse_array own their children and strings.
 struct jarray : jvalue
 {
-    std::vector<jvalue*> elements;
+    std::vector<jvalue*, jallocator<jvalue*>> elements;
+
+    // Arrays made up only of numbers are stored as one contiguous block when parsed with
+    // jdocument::denseNumbers, without a node per element. elements is empty for those.
+    bool dense = false;
+    const double* numbers = nullptr;
+    size_t numberCount = 0;
 
-    jarray()
+    jarray(jarena* arena = nullptr) : elements(jallocator<jvalue*>(arena))
     {
         this->type = type_array;
     }
@@ -57,18 +212,37 @@ struct jarray : jvalue
     {
         for (auto e: elements)
         {
-            delete e;
+            jdestroy(e);
         }
     }
 
     jvalue* operator[] (int i)
     {
+        if (dense)
+        {
+            printf("Element %d of a dense number array has no node; use number() instead\n", i);
+            abort();
+        }
+
         return (elements[i]);
     }
 
     size_t size()
     {
-        return elements.size();
+        return dense ? numberCount : elements.size();
+    }
+
+    // Works on both dense and regular arrays
+    double number(size_t i);
+
+    template<typename T>
+    std::vector<T> to_vector()
+    {
+        std::vector<T> v (size());
+        for (size_t i = 0; i < v.size(); i++)
+            v[i] = (T) number(i);
+
+        return v;
     }
 
     static jarray* cast(jvalue* v)
@@ -80,14 +254,26 @@ struct jarray : jvalue
 
 struct jstring : jvalue
 {
-    std::string value;
+    std::string_view value;
+    bool owned;
 
-    jstring(std::string s)
+    // Non-zero if the string was interned while parsing (see jatoms)
+    uint32_t atom;
+
+    jstring(std::string_view s, bool owned = false, uint32_t atom = 0)
     {
         this->value = s;
+        this->owned = owned;
+        this->atom = atom;
         this->type = type_string;
     }
 
+    ~jstring()
+    {
+        if (owned)
+            delete[] value.data();
+    }
+
     static jstring* cast(jvalue* v)
     {
         typecheck(v, type_string);
@@ -112,6 +298,14 @@ struct jnumber : jvalue
     }
 };
 
+double jarray::number(size_t i)
+{
+    if (dense)
+        return numbers[i];
+
+    return jnumber::cast(elements[i])->value;
+}
+
 struct jbool : jvalue
 {
     bool value;
@@ -137,10 +331,43 @@ struct jnull : jvalue
     }
 };
 
+// FNV-1a, used for object keys
+static constexpr uint32_t jhash(std::string_view s)
+{
+    uint32_t h = 2166136261u;
+    for (unsigned char c: s)
+    {
+        h ^= c;
+        h *= 16777619u;
+    }
+
+    return h;
+}
+
+struct jmember
+{
+    uint32_t hash;
+    uint32_t atom;
+    std::string_view key;
+    jvalue* value;
+};
+
+// Members are kept in input order along with their key hashes. Small objects are looked up by scanning
+// them; past scan_limit members an open-addressing table of member indices is kept as well.
 struct jobject : jvalue
 {
-    jobject()
+    static const size_t scan_limit = 8;
+
+    std::vector<jmember, jallocator<jmember>> elements;
+    bool owned;
+
+    // Member index + 1 per slot, 0 for empty slots; tableSize is a power of two
+    uint32_t* table = nullptr;
+    uint32_t tableSize = 0;
+
+    jobject(jarena* arena = nullptr) : elements(jallocator<jmember>(arena))
     {
+        this->owned = arena == nullptr;
         this->type = type_object;
     }
 
@@ -148,26 +375,79 @@ struct jobject : jvalue
     {
         for (const auto& e: elements)
         {
-            delete e.second;
+            jdestroy(e.value);
+
+            if (owned)
+                delete[] e.key.data();
+        }
+
+        if (owned)
+            delete[] table;
+    }
+
+    jmember* find(std::string_view key, uint32_t hash)
+    {
+        if (table == nullptr)
+        {
+            for (auto& e: elements)
+            {
+                if (e.hash == hash && e.key == key)
+                    return &e;
+            }
+
+            return nullptr;
+        }
+
+        for (uint32_t i = hash & (tableSize - 1); table[i] != 0; i = (i + 1) & (tableSize - 1))
+        {
+            jmember& e = elements[table[i] - 1];
+            if (e.hash == hash && e.key == key)
+                return &e;
+        }
+
+        return nullptr;
+    }
+
+    // Adds a member and returns null, or returns the member already using this key without changing it
+    jmember* insert(std::string_view key, jvalue* value)
+    {
+        return insert(key, jhash(key), value, 0);
+    }
+
+    // As above, for a key whose hash is already known, with its atom if it was interned
+    jmember* insert(std::string_view key, uint32_t hash, jvalue* value, uint32_t atom)
+    {
+        jmember* e = find(key, hash);
+        if (e != nullptr)
+            return e;
+
+        elements.push_back({hash, atom, key, value});
+
+        if (elements.size() > scan_limit)
+        {
+            if (elements.size() * 2 > tableSize)
+                rehash();
+            else
+                place(elements.size() - 1);
         }
+
+        return nullptr;
     }
 
-    std::map<std::string, jvalue*> elements;
+    jvalue* operator[] (std::string_view s)
+    {
+        jmember* e = find(s, jhash(s));
+        return e == nullptr ? nullptr : e->value;
+    }
 
     jvalue* operator[] (std::string &s)
     {
-        if (elements.contains(s))
-            return (elements.at(s));
-        else
-            return nullptr;
+        return (*this)[std::string_view(s)];
     }
 
     jvalue* operator[] (const char* s)
     {
-        if (elements.contains(s))
-            return (elements.at(s));
-        else
-            return nullptr;
+        return (*this)[std::string_view(s)];
     }
 
     static jobject* cast(jvalue* v)
@@ -175,226 +455,2106 @@ struct jobject : jvalue
         typecheck(v, type_object);
         return static_cast<jobject*>(v);
     }
-};
 
-static jvalue* parse_value(const char* chars, int* index);
-static jobject* parse_object(const char* chars, int* index);
-static jarray* parse_array(const char* chars, int* index);
-static jstring* parse_string(const char* chars, int* index);
-static jnumber* parse_number(const char* chars, int* index);
-static jbool* parse_bool(const char* chars, int* index);
-static jnull* parse_null(const char* chars, int* index);
+private:
+    void place(size_t member)
+    {
+        uint32_t i = elements[member].hash & (tableSize - 1);
+        while (table[i] != 0)
+            i = (i + 1) & (tableSize - 1);
 
-static jvalue* parse_value(const char* chars, int* index)
-{
-    while (true)
+        table[i] = (uint32_t) member + 1;
+    }
+
+    void rehash()
     {
-        int i = *index;
-        (*index)++;
-
-        if (chars[i] == '{')
-            return parse_object(chars, index);
-        else if (chars[i] == '[')
-            return parse_array(chars, index);
-        else if (chars[i] == '"')
-            return parse_string(chars, index);
-        else if ((chars[i] >= '0' && chars[i] <= '9') || chars[i] == '-')
-            return parse_number(chars, index);
-        else if (chars[i] == 't' || chars[i] == 'f')
-            return parse_bool(chars, index);
-        else if (chars[i] == 'n')
-            return parse_null(chars, index);
-        else if (chars[i] != ' ' && chars[i] != '\n' && chars[i] != '\t' && chars[i] != '\r')
+        uint32_t size = tableSize == 0 ? 32 : tableSize * 2;
+        while (size < elements.size() * 2)
+            size *= 2;
+
+        // Superseded tables stay in the arena until the document goes away
+        jarena* arena = elements.get_allocator().arena;
+        if (arena != nullptr)
+            table = static_cast<uint32_t*>(arena->allocate(size * sizeof(uint32_t), alignof(uint32_t)));
+        else
         {
-            printf("unknown character in value at index %d: '%c'\n", i, chars[i]);
-            throw std::runtime_error("parse failed");
+            delete[] table;
+            table = new uint32_t[size];
         }
+
+        tableSize = size;
+        std::memset(table, 0, size * sizeof(uint32_t));
+
+        for (size_t m = 0; m < elements.size(); m++)
+            place(m);
     }
+};
+
+static void jdestroy(jvalue* v)
+{
+    if (v == nullptr)
+        return;
+
+    if (v->type == type_array)
+        delete static_cast<jarray*>(v);
+    else if (v->type == type_object)
+        delete static_cast<jobject*>(v);
+    else if (v->type == type_string)
+        delete static_cast<jstring*>(v);
+    else if (v->type == type_number)
+        delete static_cast<jnumber*>(v);
+    else if (v->type == type_bool)
+        delete static_cast<jbool*>(v);
+    else
+        delete static_cast<jnull*>(v);
 }
 
-static jobject* parse_object(const char* chars, int* index)
+// Allocates a node in the arena, or on the heap when parsing without one
+template<typename T, typename... Args>
+static T* jmake(jarena* arena, Args&&... args)
 {
-    jobject* o = new jobject();
-    int phase = 0;
-    std::string key;
-    while (true)
+    if (arena != nullptr)
+        return arena->make<T>(std::forward<Args>(args)...);
+
+    return new T(std::forward<Args>(args)...);
+}
+
+static std::string_view jstore(jarena* arena, const char* chars, size_t length)
+{
+    char* c;
+    if (arena != nullptr)
+        c = static_cast<char*>(arena->allocate(length, 1));
+    else
+        c = new char[length];
+
+    if (length > 0)
+        std::memcpy(c, chars, length);
+
+    return {c, length};
+}
+
+// Interning table: each distinct string added gets a small integer atom, 0 meaning none, so strings interned in
+// the same table compare as integers. The table keeps its own copy of every string, which stays valid after the
+// input and any documents parsed with it are gone.
+struct jatoms
+{
+    // Parsers only intern keys and values up to this length; longer strings are mostly unique names and paths
+    size_t maxLength = 32;
+
+    jarena arena;
+    std::vector<std::string_view> strings {std::string_view()};
+    std::vector<uint32_t> hashes {0};
+
+    // Atom per slot, 0 for empty slots; the size is a power of two
+    std::vector<uint32_t> table;
+
+    // Safe to call from several threads as long as nothing is being interned at the same time
+    uint32_t find(std::string_view s, uint32_t hash) const
     {
-        int i = *index;
-        (*index)++;
+        if (table.empty())
+            return 0;
 
-        if (chars[i] == '}')
-            return o;
-        else if (chars[i] == '"' && phase == 0)
+        size_t mask = table.size() - 1;
+        for (size_t i = hash & mask; table[i] != 0; i = (i + 1) & mask)
         {
-            jstring* s = parse_string(chars, index);
-            key = s->value;
-            delete s;
-            phase = 1;
-        }
-        else if (chars[i] == ':' && phase == 1)
-        {
-            o->elements[key] = parse_value(chars, index);
-            phase = 2;
-        }
-        else if (phase == 2 && chars[i] == ',')
-            phase = 0;
-        else if (chars[i] != ' ' && chars[i] != '\n' && chars[i] != '\t' && chars[i] != '\r')
-        {
-            printf("unknown character in object at index %d: '%c'\n", i, chars[i]);
-            throw std::runtime_error("parse failed");
+            uint32_t a = table[i];
+            if (hashes[a] == hash && strings[a] == s)
+                return a;
         }
+
+        return 0;
     }
-}
 
-static jarray* parse_array(const char* chars, int* index)
-{
-    auto* a = new jarray();
-    bool expectComma = false;
-    while (true)
+    uint32_t find(std::string_view s) const
     {
-        int i = *index;
-        (*index)++;
+        return find(s, jhash(s));
+    }
 
-        if (chars[i] == ']')
+    uint32_t intern(std::string_view s, uint32_t hash)
+    {
+        uint32_t a = find(s, hash);
+        if (a != 0)
             return a;
-        else if (chars[i] == ' ' || chars[i] == '\n' || chars[i] == '\t' || chars[i] == '\r')
-            {}
-        else if (!expectComma)
-        {
-            (*index)--;
-            a->elements.emplace_back(parse_value(chars, index));
-            expectComma = true;
-        }
-        else if (chars[i] == ',')
-            expectComma = false;
+
+        a = (uint32_t) strings.size();
+        strings.push_back(jstore(&arena, s.data(), s.size()));
+        hashes.push_back(hash);
+
+        if (strings.size() * 2 > table.size())
+            rehash();
         else
-        {
-            printf("expected comma at index %d but got: '%c'\n", i, chars[i]);
-            throw std::runtime_error("parse failed");
-        }
+            place(a);
+
+        return a;
     }
-}
 
-static jnumber* parse_number(const char* chars, int* index)
-{
-    (*index)--;
+    uint32_t intern(std::string_view s)
+    {
+        return intern(s, jhash(s));
+    }
+
+    std::string_view operator[] (uint32_t atom) const
+    {
+        return strings[atom];
+    }
 
-    bool first = true;
-    int startIndex = *index;
+    // Whether s is the string with this atom; a string that was not interned is compared by its characters
+    bool is(const jstring* s, uint32_t atom) const
+    {
+        if (s->atom != 0)
+            return s->atom == atom;
 
-    while (true)
+        return s->value == strings[atom];
+    }
+
+private:
+    void place(uint32_t atom)
     {
-        int i = *index;
-        (*index)++;
+        size_t mask = table.size() - 1;
+        size_t i = hashes[atom] & mask;
+        while (table[i] != 0)
+            i = (i + 1) & mask;
 
-        if ((chars[i] < '0' || chars[i] > '9') && chars[i] != '-' && chars[i] != '+' && chars[i] != '-' && chars[i] != '.' && chars[i] != 'e' && chars[i] != 'E')
-            break;
+        table[i] = atom;
     }
 
-    char num[*index - startIndex + 1];
-    num[*index - startIndex] = '\0';
-    std::memcpy(num, &chars[startIndex], *index - startIndex);
-    (*index)--;
+    void rehash()
+    {
+        table.assign(std::max<size_t>(64, table.size() * 2), 0);
 
-    return new jnumber {std::stod(num)};
-}
+        for (uint32_t a = 1; a < strings.size(); a++)
+            place(a);
+    }
+};
 
-static jstring* parse_string(const char* chars, int* index)
+// Character classes of a 64-byte block of input, one bit per byte (bit i describes byte i)
+struct jblock
 {
-    std::vector<char> str;
+    uint64_t whitespace;
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t structural;
+};
 
-    bool escape = false;
-    while (true)
-    {
-        int i = *index;
-        (*index)++;
+const uint8_t jclass_whitespace = 1;
+const uint8_t jclass_quote = 2;
+const uint8_t jclass_backslash = 4;
+const uint8_t jclass_structural = 8;
 
-        if (escape)
-        {
-            if (chars[i] == '\"')
-                str.emplace_back('\"');
-            else if (chars[i] == '\\')
-                str.emplace_back('\\');
-            else if (chars[i] == 'n')
-                str.emplace_back('\n');
-            else
-            {
-                printf("unknown escape sequence at index %d: '%c'\n", i, chars[i]);
-                throw std::runtime_error("parse failed");
-            }
+struct jclass_table
+{
+    uint8_t classes[256] {};
 
-            escape = false;
-        }
-        else if (chars[i] == '\\')
-            escape = true;
-        else if (chars[i] == '\"')
-        {
-            std::string s (str.begin(), str.end());
-            return new jstring {s};
-        }
-        else
-            str.emplace_back(chars[i]);
+    constexpr jclass_table()
+    {
+        classes[(uint8_t) ' '] = jclass_whitespace;
+        classes[(uint8_t) '\n'] = jclass_whitespace;
+        classes[(uint8_t) '\t'] = jclass_whitespace;
+        classes[(uint8_t) '\r'] = jclass_whitespace;
+        classes[(uint8_t) '"'] = jclass_quote;
+        classes[(uint8_t) '\\'] = jclass_backslash;
+
+        for (char c: {'{', '}', '[', ']', ':', ','})
+            classes[(uint8_t) c] = jclass_structural;
     }
+};
+
+constexpr jclass_table jclasses;
+
+static inline jblock jclassify_byte(char c)
+{
+    uint8_t k = jclasses.classes[(uint8_t) c];
+    return {(uint64_t) ((k & jclass_whitespace) != 0), (uint64_t) ((k & jclass_quote) != 0),
+            (uint64_t) ((k & jclass_backslash) != 0), (uint64_t) ((k & jclass_structural) != 0)};
 }
 
-static jbool* parse_bool(const char* chars, int* index)
+// Classifies the 64 bytes starting at p, which must all be readable
+static inline jblock jclassify(const char* p)
 {
-    (*index)--;
-    if (memcmp(&chars[*index], "true", 4) == 0)
+    jblock b {};
+
+#if defined(__AVX2__)
+    for (int i = 0; i < 2; i++)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*) (p + i * 32));
+        auto eq = [&](char c) { return _mm256_cmpeq_epi8(v, _mm256_set1_epi8(c)); };
+        auto bits = [](__m256i m) { return (uint64_t) (uint32_t) _mm256_movemask_epi8(m); };
+
+        b.whitespace |= bits(_mm256_or_si256(_mm256_or_si256(eq(' '), eq('\n')), _mm256_or_si256(eq('\t'), eq('\r')))) << (i * 32);
+        b.quote |= bits(eq('"')) << (i * 32);
+        b.backslash |= bits(eq('\\')) << (i * 32);
+        b.structural |= bits(_mm256_or_si256(_mm256_or_si256(_mm256_or_si256(eq('{'), eq('}')), _mm256_or_si256(eq('['), eq(']'))),
+                                             _mm256_or_si256(eq(':'), eq(',')))) << (i * 32);
+    }
+#elif defined(__SSE2__)
+    for (int i = 0; i < 4; i++)
     {
-        *index += 4;
-        return new jbool {true};
+        __m128i v = _mm_loadu_si128((const __m128i*) (p + i * 16));
+        auto eq = [&](char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); };
+        auto bits = [](__m128i m) { return (uint64_t) (uint16_t) _mm_movemask_epi8(m); };
+
+        b.whitespace |= bits(_mm_or_si128(_mm_or_si128(eq(' '), eq('\n')), _mm_or_si128(eq('\t'), eq('\r')))) << (i * 16);
+        b.quote |= bits(eq('"')) << (i * 16);
+        b.backslash |= bits(eq('\\')) << (i * 16);
+        b.structural |= bits(_mm_or_si128(_mm_or_si128(_mm_or_si128(eq('{'), eq('}')), _mm_or_si128(eq('['), eq(']'))),
+                                          _mm_or_si128(eq(':'), eq(',')))) << (i * 16);
     }
-    else if (memcmp(&chars[*index], "false", 5) == 0)
+#elif defined(__ARM_NEON)
+    const uint8x16_t weights = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    for (int i = 0; i < 4; i++)
     {
-        *index += 5;
-        return new jbool {false};
+        uint8x16_t v = vld1q_u8((const uint8_t*) (p + i * 16));
+        auto eq = [&](char c) { return vceqq_u8(v, vdupq_n_u8((uint8_t) c)); };
+        auto bits = [&](uint8x16_t m)
+        {
+            uint8x16_t w = vandq_u8(m, weights);
+            return (uint64_t) vaddv_u8(vget_low_u8(w)) | ((uint64_t) vaddv_u8(vget_high_u8(w)) << 8);
+        };
+
+        b.whitespace |= bits(vorrq_u8(vorrq_u8(eq(' '), eq('\n')), vorrq_u8(eq('\t'), eq('\r')))) << (i * 16);
+        b.quote |= bits(eq('"')) << (i * 16);
+        b.backslash |= bits(eq('\\')) << (i * 16);
+        b.structural |= bits(vorrq_u8(vorrq_u8(vorrq_u8(eq('{'), eq('}')), vorrq_u8(eq('['), eq(']'))),
+                                      vorrq_u8(eq(':'), eq(',')))) << (i * 16);
     }
-    else
+#else
+    for (int i = 0; i < 64; i++)
     {
-        printf("unknown value at index %d: '%c'\n", *index, chars[*index]);
-        throw std::runtime_error("parse failed");
+        jblock c = jclassify_byte(p[i]);
+        b.whitespace |= c.whitespace << i;
+        b.quote |= c.quote << i;
+        b.backslash |= c.backslash << i;
+        b.structural |= c.structural << i;
     }
+#endif
+
+    return b;
 }
 
+// Selectors for jreader::scan
+static inline uint64_t jnot_whitespace(const jblock& b)
+{
+    return ~b.whitespace;
+}
+
+static inline uint64_t jstring_end(const jblock& b)
+{
+    return b.quote | b.backslash;
+}
+
+static inline uint64_t jtoken_end(const jblock& b)
+{
+    return b.whitespace | b.structural | b.quote;
+}
 
-static jnull* parse_null(const char* chars, int* index)
+// Input range being parsed. The text need not be null-terminated, so it can be a memory-mapped file.
+struct jreader
 {
-    (*index)--;
-    if (memcmp(&chars[*index], "null", 4) == 0)
+    const char* chars;
+    size_t length;
+    size_t index = 0;
+
+    // Without an arena the tree is heap-allocated and owns copies of its strings; with one, strings are
+    // views into the input wherever no unescaping was needed, so the input must outlive the tree.
+    jarena* arena;
+
+    // Collect all-number arrays densely (arena only), using numbers as scratch space while doing so
+    bool denseNumbers = false;
+    std::vector<double> numbers;
+
+    // Unescaped strings when they have nowhere else to go (jsax)
+    std::string text;
+
+    // Keys and short strings are interned in atoms if set (arena only). With addAtoms off they are only looked
+    // up, so that several readers can share the table.
+    jatoms* atoms = nullptr;
+    bool addAtoms = true;
+
+    // Most recently classified block; consecutive short tokens are usually found in the same one
+    size_t blockStart = SIZE_MAX;
+    jblock block {};
+
+    jreader(const char* chars, size_t length, jarena* arena)
     {
-        *index += 4;
-        return nullptr;
+        this->chars = chars;
+        this->length = length;
+        this->arena = arena;
     }
-    else
+
+    char next()
     {
-        printf("unknown value at index %d: '%c'\n", *index, chars[*index]);
-        throw std::runtime_error("parse failed");
+        if (index >= length)
+        {
+            printf("unexpected end of input at index %zu\n", index);
+            throw std::runtime_error("parse failed");
+        }
+
+        return chars[index++];
     }
-}
 
-static jobject* jparse(std::string str)
-{
-    int i = 0;
-    const char* chars = str.c_str();
+    char peek()
+    {
+        if (index >= length)
+        {
+            printf("unexpected end of input at index %zu\n", index);
+            throw std::runtime_error("parse failed");
+        }
 
-    while (chars[i] != '{')
-        i++;
+        return chars[index];
+    }
 
-    i++;
+    // Index of the first byte at or after i selected by the given mask, or length if there is none
+    size_t scan(size_t i, uint64_t (*select)(const jblock&))
+    {
+        while (i + 64 <= length)
+        {
+            if (i < blockStart || i >= blockStart + 64)
+            {
+                block = jclassify(chars + i);
+                blockStart = i;
+            }
 
-    return parse_object(chars, &i);
-}
+            uint64_t m = select(block) >> (i - blockStart);
+            if (m != 0)
+                return i + __builtin_ctzll(m);
 
-static jarray* jparse_array(std::string str)
-{
-    int i = 0;
-    const char* chars = str.c_str();
+            i = blockStart + 64;
+        }
 
-    while (chars[i] != '[')
-        i++;
+        while (i < length && (select(jclassify_byte(chars[i])) & 1) == 0)
+            i++;
 
-    i++;
+        return i;
+    }
+};
 
-    return parse_array(chars, &i);
-}
\ No newline at end of file
+// Replaces s with its interned copy and returns its atom, if the reader interns strings like it
+static inline uint32_t jintern(jreader& r, std::string_view& s, uint32_t hash)
+{
+    if (r.atoms == nullptr || r.arena == nullptr || s.size() > r.atoms->maxLength)
+        return 0;
+
+    uint32_t atom = r.addAtoms ? r.atoms->intern(s, hash) : r.atoms->find(s, hash);
+    if (atom != 0)
+        s = (*r.atoms)[atom];
+
+    return atom;
+}
+
+static inline void skip_whitespace(jreader& r)
+{
+    if (r.index < r.length && (jclasses.classes[(uint8_t) r.chars[r.index]] & jclass_whitespace) != 0)
+        r.index = r.scan(r.index + 1, jnot_whitespace);
+}
+
+static jvalue* parse_value(jreader& r);
+static jobject* parse_object(jreader& r);
+static jarray* parse_array(jreader& r);
+static jstring* parse_string(jreader& r);
+static std::string_view parse_string_chars(jreader& r);
+static jnumber* parse_number(jreader& r);
+static double parse_number_value(jreader& r);
+static jbool* parse_bool(jreader& r);
+static bool parse_bool_value(jreader& r);
+static jnull* parse_null(jreader& r);
+static void parse_null_value(jreader& r);
+
+static jvalue* parse_value(jreader& r)
+{
+    skip_whitespace(r);
+
+    size_t i = r.index;
+    char c = r.next();
+
+    if (c == '{')
+        return parse_object(r);
+    else if (c == '[')
+        return parse_array(r);
+    else if (c == '"')
+        return parse_string(r);
+    else if ((c >= '0' && c <= '9') || c == '-')
+        return parse_number(r);
+    else if (c == 't' || c == 'f')
+        return parse_bool(r);
+    else if (c == 'n')
+        return parse_null(r);
+    else
+    {
+        printf("unknown character in value at index %zu: '%c'\n", i, c);
+        throw std::runtime_error("parse failed");
+    }
+}
+
+static jobject* parse_object(jreader& r)
+{
+    jobject* o = jmake<jobject>(r.arena, r.arena);
+    while (true)
+    {
+        skip_whitespace(r);
+
+        // Also accepts a trailing comma, as before
+        size_t i = r.index;
+        char c = r.next();
+        if (c == '}')
+            return o;
+        else if (c != '"')
+        {
+            printf("unknown character in object at index %zu: '%c'\n", i, c);
+            throw std::runtime_error("parse failed");
+        }
+
+        std::string_view key = parse_string_chars(r);
+        uint32_t hash = jhash(key);
+        uint32_t atom = jintern(r, key, hash);
+
+        skip_whitespace(r);
+        i = r.index;
+        c = r.next();
+        if (c != ':')
+        {
+            printf("unknown character in object at index %zu: '%c'\n", i, c);
+            throw std::runtime_error("parse failed");
+        }
+
+        jvalue* v = parse_value(r);
+        jmember* e = o->insert(key, hash, v, atom);
+
+        // Duplicate keys keep the last value, as before
+        if (e != nullptr)
+        {
+            if (r.arena == nullptr)
+            {
+                jdestroy(e->value);
+                delete[] key.data();
+            }
+
+            e->value = v;
+        }
+
+        skip_whitespace(r);
+        i = r.index;
+        c = r.next();
+        if (c == '}')
+            return o;
+        else if (c != ',')
+        {
+            printf("unknown character in object at index %zu: '%c'\n", i, c);
+            throw std::runtime_error("parse failed");
+        }
+    }
+}
+
+// Turns an empty array into a dense one holding a copy of the given numbers
+static void jset_numbers(jarray* a, jarena* arena, const double* numbers, size_t count)
+{
+    auto* copy = static_cast<double*>(arena->allocate(count * sizeof(double), alignof(double)));
+    std::memcpy(copy, numbers, count * sizeof(double));
+
+    a->dense = true;
+    a->numbers = copy;
+    a->numberCount = count;
+}
+
+static jarray* parse_array(jreader& r)
+{
+    auto* a = jmake<jarray>(r.arena, r.arena);
+    bool numeric = r.denseNumbers && r.arena != nullptr;
+    size_t base = r.numbers.size();
+
+    while (true)
+    {
+        skip_whitespace(r);
+
+        // Also accepts a trailing comma, as before
+        char c = r.peek();
+        if (c == ']')
+        {
+            r.index++;
+            break;
+        }
+
+        if (numeric && ((c >= '0' && c <= '9') || c == '-'))
+        {
+            r.index++;
+            r.numbers.emplace_back(parse_number_value(r));
+        }
+        else
+        {
+            // Not all numbers after all, so the ones read so far get nodes of their own
+            if (numeric)
+            {
+                for (size_t i = base; i < r.numbers.size(); i++)
+                    a->elements.emplace_back(jmake<jnumber>(r.arena, r.numbers[i]));
+
+                r.numbers.resize(base);
+                numeric = false;
+            }
+
+            a->elements.emplace_back(parse_value(r));
+        }
+
+        skip_whitespace(r);
+        size_t i = r.index;
+        c = r.next();
+        if (c == ']')
+            break;
+        else if (c != ',')
+        {
+            printf("expected comma at index %zu but got: '%c'\n", i, c);
+            throw std::runtime_error("parse failed");
+        }
+    }
+
+    if (numeric && r.numbers.size() > base)
+        jset_numbers(a, r.arena, &r.numbers[base], r.numbers.size() - base);
+
+    r.numbers.resize(base);
+    return a;
+}
+
+// Powers of ten that a double represents exactly
+static const double jpowers_of_ten[] =
+{
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Reads the number whose first character was just consumed. When the significant digits fit a 53-bit
+// mantissa and the power of ten is exact (nearly all scene data), one multiply or divide gives the
+// correctly rounded result; anything else falls back to strtod.
+static double parse_number_value(jreader& r)
+{
+    const char* start = &r.chars[r.index - 1];
+    const char* end = r.chars + r.length;
+    const char* p = start;
+
+    bool negative = *p == '-';
+    if (negative)
+        p++;
+
+    uint64_t mantissa = 0;
+    int significant = 0;
+    int exponent = 0;
+    bool digits = false;
+    bool exact = true;
+
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+    {
+        digits = true;
+        if (significant < 19)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            significant += mantissa != 0;
+        }
+        else
+        {
+            exact &= *p == '0';
+            exponent++;
+        }
+    }
+
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && *p >= '0' && *p <= '9'; p++)
+        {
+            digits = true;
+            if (significant < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                significant += mantissa != 0;
+                exponent--;
+            }
+            else
+                exact &= *p == '0';
+        }
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        p++;
+        bool negativeExponent = p < end && *p == '-';
+        if (p < end && (*p == '-' || *p == '+'))
+            p++;
+
+        int e = 0;
+        bool exponentDigits = false;
+        for (; p < end && *p >= '0' && *p <= '9'; p++)
+        {
+            exponentDigits = true;
+            if (e < 100000)
+                e = e * 10 + (*p - '0');
+        }
+
+        digits &= exponentDigits;
+        exponent += negativeExponent ? -e : e;
+    }
+
+    if (!digits)
+    {
+        printf("malformed number at index %zu\n", r.index - 1);
+        throw std::runtime_error("parse failed");
+    }
+
+    r.index = p - r.chars;
+
+    if (exact && mantissa <= (1ull << 53) && exponent >= -22 && exponent <= 22)
+    {
+        double d = (double) mantissa;
+        d = exponent < 0 ? d / jpowers_of_ten[-exponent] : d * jpowers_of_ten[exponent];
+        return negative ? -d : d;
+    }
+
+    std::string num (start, p);
+    return std::strtod(num.c_str(), nullptr);
+}
+
+static jnumber* parse_number(jreader& r)
+{
+    return jmake<jnumber>(r.arena, parse_number_value(r));
+}
+
+static jstring* parse_string(jreader& r)
+{
+    std::string_view s = parse_string_chars(r);
+
+    uint32_t atom = 0;
+    if (r.atoms != nullptr && s.size() <= r.atoms->maxLength)
+        atom = jintern(r, s, jhash(s));
+
+    return jmake<jstring>(r.arena, s, r.arena == nullptr, atom);
+}
+
+// Moves past the closing quote of a string whose opening quote was just consumed; returns whether it has escapes
+static bool jscan_string(jreader& r)
+{
+    bool escaped = false;
+
+    while (true)
+    {
+        r.index = r.scan(r.index, jstring_end);
+
+        if (r.next() == '\"')
+            return escaped;
+
+        r.next();
+        escaped = true;
+    }
+}
+
+// Writes the unescaped form of length chars (found at index start) to str, returning its length
+static size_t junescape(const char* chars, size_t length, char* str, size_t start)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < length; i++)
+    {
+        if (chars[i] != '\\')
+        {
+            str[n++] = chars[i];
+            continue;
+        }
+
+        i++;
+        if (chars[i] == '\"')
+            str[n++] = '\"';
+        else if (chars[i] == '\\')
+            str[n++] = '\\';
+        else if (chars[i] == 'n')
+            str[n++] = '\n';
+        else
+        {
+            printf("unknown escape sequence at index %zu: '%c'\n", start + i, chars[i]);
+            throw std::runtime_error("parse failed");
+        }
+    }
+
+    return n;
+}
+
+static std::string_view parse_string_chars(jreader& r)
+{
+    size_t start = r.index;
+    bool escaped = jscan_string(r);
+
+    const char* chars = &r.chars[start];
+    size_t length = r.index - 1 - start;
+
+    if (!escaped)
+    {
+        if (r.arena == nullptr)
+            return jstore(nullptr, chars, length);
+
+        return {chars, length};
+    }
+
+    // Only strings which actually contain escape sequences are copied
+    if (r.arena != nullptr)
+    {
+        char* str = static_cast<char*>(r.arena->allocate(length, 1));
+        return {str, junescape(chars, length, str, start)};
+    }
+
+    std::unique_ptr<char[]> str (new char[length]);
+    size_t n = junescape(chars, length, str.get(), start);
+    return {str.release(), n};
+}
+
+static jbool* parse_bool(jreader& r)
+{
+    return jmake<jbool>(r.arena, parse_bool_value(r));
+}
+
+static bool parse_bool_value(jreader& r)
+{
+    r.index--;
+    if (r.length - r.index >= 4 && memcmp(&r.chars[r.index], "true", 4) == 0)
+    {
+        r.index += 4;
+        return true;
+    }
+    else if (r.length - r.index >= 5 && memcmp(&r.chars[r.index], "false", 5) == 0)
+    {
+        r.index += 5;
+        return false;
+    }
+    else
+    {
+        printf("unknown value at index %zu: '%c'\n", r.index, r.chars[r.index]);
+        throw std::runtime_error("parse failed");
+    }
+}
+
+static jnull* parse_null(jreader& r)
+{
+    parse_null_value(r);
+    return nullptr;
+}
+
+static void parse_null_value(jreader& r)
+{
+    r.index--;
+    if (r.length - r.index >= 4 && memcmp(&r.chars[r.index], "null", 4) == 0)
+    {
+        r.index += 4;
+    }
+    else
+    {
+        printf("unknown value at index %zu: '%c'\n", r.index, r.chars[r.index]);
+        throw std::runtime_error("parse failed");
+    }
+}
+
+static inline uint64_t jsplit_stop(const jblock& b)
+{
+    return b.quote | b.backslash | b.structural;
+}
+
+// Finds the top-level elements of the array whose '[' is at chars[start] without parsing them, looking only at
+// quotes, backslashes and structural characters. Returns the index of the '[', of each comma between elements
+// and of the closing ']', so element i lies between separators i and i + 1.
+static std::vector<size_t> jsplit_array(const char* chars, size_t length, size_t start)
+{
+    std::vector<size_t> separators {start};
+
+    jreader r (chars, length, nullptr);
+    r.index = start + 1;
+    int depth = 1;
+
+    while (true)
+    {
+        size_t i = r.scan(r.index, jsplit_stop);
+        if (i >= length)
+        {
+            printf("unexpected end of input at index %zu\n", i);
+            throw std::runtime_error("parse failed");
+        }
+
+        r.index = i + 1;
+        char c = chars[i];
+
+        if (c == '"')
+            jscan_string(r);
+        else if (c == '[' || c == '{')
+            depth++;
+        else if (c == ']' || c == '}')
+        {
+            depth--;
+            if (depth == 0)
+            {
+                if (c != ']')
+                {
+                    printf("unknown character in array at index %zu: '%c'\n", i, c);
+                    throw std::runtime_error("parse failed");
+                }
+
+                separators.emplace_back(i);
+                return separators;
+            }
+        }
+        else if (c == ',' && depth == 1)
+            separators.emplace_back(i);
+    }
+}
+
+// A parsed tree together with the arena holding it. Destroying the document frees every node at once,
+// so pointers obtained from it must not outlive it. Strings may point straight into the parsed text,
+// which therefore has to stay alive (and unmodified) for as long as the document is used.
+struct jdocument
+{
+    jarena arena;
+    jvalue* root = nullptr;
+
+    // Filled by the threads of parse_parallel
+    std::vector<std::unique_ptr<jarena>> arenas;
+
+    // Store arrays made up only of numbers densely (see jarray::number and jarray::to_vector)
+    bool denseNumbers = false;
+
+    // Intern keys and short strings in this table if set. It must outlive the document, and nothing else may
+    // intern in it during parse_parallel, whose threads only look strings up in it.
+    jatoms* atoms = nullptr;
+
+    jvalue* parse(const char* chars, size_t length)
+    {
+        jreader r (chars, length, &arena);
+        r.denseNumbers = denseNumbers;
+        r.atoms = atoms;
+        root = parse_value(r);
+        return root;
+    }
+
+    jvalue* parse(std::string_view str)
+    {
+        return parse(str.data(), str.size());
+    }
+
+    // Like parse, but when the root is an array its elements are shared out between threads (all hardware threads
+    // if 0 is given). Each thread parses a contiguous run of elements with an arena of its own, so the result is
+    // the same tree, with the elements in order.
+    jvalue* parse_parallel(const char* chars, size_t length, unsigned threads = 0)
+    {
+        jreader r (chars, length, &arena);
+        skip_whitespace(r);
+        if (r.peek() != '[')
+            return parse(chars, length);
+
+        std::vector<size_t> separators = jsplit_array(chars, length, r.index);
+        size_t count = separators.size() - 1;
+
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
+
+        if (threads > count)
+            threads = (unsigned) count;
+
+        if (threads <= 1)
+            return parse(chars, length);
+
+        std::vector<jvalue*> values (count);
+        std::vector<char> present (count);
+        std::vector<std::exception_ptr> errors (threads);
+        std::vector<std::thread> workers;
+
+        size_t begin = separators.front();
+        size_t bytes = separators.back() - begin;
+        size_t first = 0;
+
+        for (unsigned t = 0; t < threads; t++)
+        {
+            // Runs of elements with about the same number of bytes each
+            size_t last = first;
+            size_t end = begin + bytes / threads * (t + 1);
+            while (last < count && (separators[last] < end || t == threads - 1))
+                last++;
+
+            jarena* a = arenas.emplace_back(std::make_unique<jarena>()).get();
+
+            workers.emplace_back([&, t, a, first, last]()
+            {
+                try
+                {
+                    jreader r (chars, length, a);
+                    r.denseNumbers = denseNumbers;
+                    r.atoms = atoms;
+                    r.addAtoms = false;
+
+                    for (size_t e = first; e < last; e++)
+                    {
+                        r.index = separators[e] + 1;
+                        skip_whitespace(r);
+
+                        // Only the last element may be empty: "[]", or a trailing comma
+                        if (r.index == separators[e + 1] && e == count - 1)
+                            continue;
+
+                        values[e] = parse_value(r);
+                        present[e] = true;
+
+                        skip_whitespace(r);
+                        if (r.index != separators[e + 1])
+                        {
+                            printf("expected comma at index %zu but got: '%c'\n", r.index, chars[r.index]);
+                            throw std::runtime_error("parse failed");
+                        }
+                    }
+                }
+                catch (...)
+                {
+                    errors[t] = std::current_exception();
+                }
+            });
+
+            first = last;
+        }
+
+        for (auto& w: workers)
+        {
+            w.join();
+        }
+
+        for (auto& e: errors)
+        {
+            if (e)
+                std::rethrow_exception(e);
+        }
+
+        auto* a = jmake<jarray>(&arena, &arena);
+        a->elements.reserve(count);
+
+        for (size_t e = 0; e < count; e++)
+        {
+            if (present[e])
+                a->elements.emplace_back(values[e]);
+        }
+
+        root = a;
+        return root;
+    }
+};
+
+inline jobject* jparse(std::string_view str)
+{
+    size_t i = str.find('{');
+
+    if (i == std::string_view::npos)
+        throw std::runtime_error("parse failed");
+
+    jreader r (str.data(), str.size(), nullptr);
+    r.index = i + 1;
+    return parse_object(r);
+}
+
+inline jarray* jparse_array(std::string_view str)
+{
+    size_t i = str.find('[');
+
+    if (i == std::string_view::npos)
+        throw std::runtime_error("parse failed");
+
+    jreader r (str.data(), str.size(), nullptr);
+    r.index = i + 1;
+    return parse_array(r);
+}
+
+static std::string_view jsax_string_chars(jreader& r)
+{
+    size_t start = r.index;
+    bool escaped = jscan_string(r);
+
+    const char* chars = &r.chars[start];
+    size_t length = r.index - 1 - start;
+
+    if (!escaped)
+        return {chars, length};
+
+    r.text.resize(length);
+    return {r.text.data(), junescape(chars, length, r.text.data(), start)};
+}
+
+template<typename H>
+static void jsax_value(jreader& r, H& handler);
+
+template<typename H>
+static void jsax_object(jreader& r, H& handler)
+{
+    handler.start_object();
+
+    while (true)
+    {
+        skip_whitespace(r);
+
+        // Also accepts a trailing comma, as before
+        size_t i = r.index;
+        char c = r.next();
+        if (c == '}')
+            break;
+        else if (c != '"')
+        {
+            printf("unknown character in object at index %zu: '%c'\n", i, c);
+            throw std::runtime_error("parse failed");
+        }
+
+        handler.key(jsax_string_chars(r));
+
+        skip_whitespace(r);
+        i = r.index;
+        c = r.next();
+        if (c != ':')
+        {
+            printf("unknown character in object at index %zu: '%c'\n", i, c);
+            throw std::runtime_error("parse failed");
+        }
+
+        jsax_value(r, handler);
+
+        skip_whitespace(r);
+        i = r.index;
+        c = r.next();
+        if (c == '}')
+            break;
+        else if (c != ',')
+        {
+            printf("unknown character in object at index %zu: '%c'\n", i, c);
+            throw std::runtime_error("parse failed");
+        }
+    }
+
+    handler.end_object();
+}
+
+template<typename H>
+static void jsax_array(jreader& r, H& handler)
+{
+    handler.start_array();
+
+    while (true)
+    {
+        skip_whitespace(r);
+
+        // Also accepts a trailing comma, as before
+        if (r.peek() == ']')
+        {
+            r.index++;
+            break;
+        }
+
+        jsax_value(r, handler);
+
+        skip_whitespace(r);
+        size_t i = r.index;
+        char c = r.next();
+        if (c == ']')
+            break;
+        else if (c != ',')
+        {
+            printf("expected comma at index %zu but got: '%c'\n", i, c);
+            throw std::runtime_error("parse failed");
+        }
+    }
+
+    handler.end_array();
+}
+
+template<typename H>
+static void jsax_value(jreader& r, H& handler)
+{
+    skip_whitespace(r);
+
+    size_t i = r.index;
+    char c = r.next();
+
+    if (c == '{')
+        jsax_object(r, handler);
+    else if (c == '[')
+        jsax_array(r, handler);
+    else if (c == '"')
+        handler.string(jsax_string_chars(r));
+    else if ((c >= '0' && c <= '9') || c == '-')
+        handler.number(parse_number_value(r));
+    else if (c == 't' || c == 'f')
+        handler.boolean(parse_bool_value(r));
+    else if (c == 'n')
+    {
+        parse_null_value(r);
+        handler.null_value();
+    }
+    else
+    {
+        printf("unknown character in value at index %zu: '%c'\n", i, c);
+        throw std::runtime_error("parse failed");
+    }
+}
+
+// Event-driven parsing, for callers that build their own structures and have no use for a tree. The handler
+// receives start_object(), key(std::string_view), end_object(), start_array(), end_array(),
+// string(std::string_view), number(double), boolean(bool) and null_value() in document order.
+// Views passed to the handler are only valid until it returns.
+template<typename H>
+static void jsax(const char* chars, size_t length, H& handler)
+{
+    jreader r (chars, length, nullptr);
+    jsax_value(r, handler);
+}
+
+// A jsax handler that assembles the events back into a tree in the given arena, copying all strings.
+// Feeding it part of a document (one element of a large array, say) gives a tree of just that part.
+struct jbuilder
+{
+    jarena* arena;
+    bool denseNumbers = false;
+
+    // Keys and short strings are interned here if set (arena only), instead of being copied into the arena
+    jatoms* atoms = nullptr;
+
+    // The most recently completed value that has no parent
+    jvalue* root = nullptr;
+
+    struct frame
+    {
+        jvalue* container;
+        std::string_view key;
+        uint32_t keyAtom;
+        size_t numberBase;
+        bool numeric;
+    };
+
+    std::vector<frame> stack;
+    std::vector<double> numbers;
+
+    jbuilder(jarena* arena)
+    {
+        this->arena = arena;
+    }
+
+    bool complete()
+    {
+        return stack.empty();
+    }
+
+    void add(jvalue* v)
+    {
+        if (stack.empty())
+        {
+            root = v;
+            return;
+        }
+
+        frame& f = stack.back();
+        if (f.container->type == type_object)
+        {
+            // Duplicate keys keep the last value, as before
+            uint32_t hash = f.keyAtom != 0 ? atoms->hashes[f.keyAtom] : jhash(f.key);
+            jmember* e = static_cast<jobject*>(f.container)->insert(f.key, hash, v, f.keyAtom);
+            if (e != nullptr)
+                e->value = v;
+
+            return;
+        }
+
+        auto* a = static_cast<jarray*>(f.container);
+        if (f.numeric)
+        {
+            for (size_t i = f.numberBase; i < numbers.size(); i++)
+                a->elements.emplace_back(jmake<jnumber>(arena, numbers[i]));
+
+            numbers.resize(f.numberBase);
+            f.numeric = false;
+        }
+
+        a->elements.emplace_back(v);
+    }
+
+    void start_object()
+    {
+        stack.push_back({jmake<jobject>(arena, arena), {}, 0, 0, false});
+    }
+
+    void key(std::string_view k)
+    {
+        frame& f = stack.back();
+        f.key = store(k, f.keyAtom);
+    }
+
+    void end_object()
+    {
+        jvalue* o = stack.back().container;
+        stack.pop_back();
+        add(o);
+    }
+
+    void start_array()
+    {
+        stack.push_back({jmake<jarray>(arena, arena), {}, 0, numbers.size(), denseNumbers});
+    }
+
+    void end_array()
+    {
+        frame f = stack.back();
+        stack.pop_back();
+
+        auto* a = static_cast<jarray*>(f.container);
+        if (f.numeric && numbers.size() > f.numberBase)
+            jset_numbers(a, arena, &numbers[f.numberBase], numbers.size() - f.numberBase);
+
+        numbers.resize(f.numberBase);
+        add(a);
+    }
+
+    void string(std::string_view s)
+    {
+        uint32_t atom;
+        std::string_view stored = store(s, atom);
+        add(jmake<jstring>(arena, stored, false, atom));
+    }
+
+    void number(double d)
+    {
+        if (!stack.empty() && stack.back().numeric)
+            numbers.emplace_back(d);
+        else
+            add(jmake<jnumber>(arena, d));
+    }
+
+    void boolean(bool b)
+    {
+        add(jmake<jbool>(arena, b));
+    }
+
+    void null_value()
+    {
+        add(nullptr);
+    }
+
+    // The interned copy of s if it can be interned, otherwise a copy in the arena
+    std::string_view store(std::string_view s, uint32_t& atom)
+    {
+        atom = 0;
+        if (atoms != nullptr && arena != nullptr && s.size() <= atoms->maxLength)
+        {
+            atom = atoms->intern(s);
+            return (*atoms)[atom];
+        }
+
+        return jstore(arena, s.data(), s.size());
+    }
+};
+
+// Resumable parser for input that arrives in pieces: feed() each chunk as it comes in, then call finish().
+// The handler receives the same events as with jsax. A token cut off by the end of a chunk is carried over in
+// pending until the rest of it arrives, so only that token is ever copied.
+template<typename H>
+struct jstream
+{
+    static const int expect_value = 0;
+    static const int expect_key = 1;
+    static const int expect_colon = 2;
+    static const int expect_comma = 3;
+    static const int expect_end = 4;
+
+    H& handler;
+    int state = expect_value;
+
+    // '{' or '[' for each open container
+    std::vector<char> stack;
+
+    // Raw text of an unfinished string (with its opening quote), number or literal
+    std::string pending;
+    bool pendingEscape = false;
+
+    // Unescaped strings
+    std::string text;
+
+    // Bytes in the chunks before the current one, for error messages
+    size_t offset = 0;
+
+    jstream(H& handler) : handler(handler) {}
+
+    void feed(const char* chars, size_t length)
+    {
+        jreader r (chars, length, nullptr);
+
+        if (!pending.empty())
+            resume(r);
+
+        while (r.index < r.length)
+            step(r);
+
+        offset += length;
+    }
+
+    void finish()
+    {
+        if (!pending.empty())
+        {
+            if (pending[0] == '\"')
+                fail("unexpected end of input in string", offset);
+
+            // Numbers and literals have no terminator of their own
+            std::string token = std::move(pending);
+            pending.clear();
+            scalar(token.data(), token.size(), offset - token.size());
+        }
+
+        if (state != expect_end)
+            fail("unexpected end of input", offset);
+    }
+
+    void step(jreader& r)
+    {
+        r.index = r.scan(r.index, jnot_whitespace);
+        if (r.index >= r.length)
+            return;
+
+        size_t i = r.index;
+        char c = r.chars[i];
+
+        if (state == expect_value)
+        {
+            if (c == '{')
+            {
+                r.index++;
+                stack.emplace_back('{');
+                handler.start_object();
+                state = expect_key;
+            }
+            else if (c == '[')
+            {
+                r.index++;
+                stack.emplace_back('[');
+                handler.start_array();
+            }
+            else if (c == ']' && !stack.empty() && stack.back() == '[')
+            {
+                // Also accepts a trailing comma, as before
+                r.index++;
+                close();
+            }
+            else if (c == '"')
+            {
+                r.index++;
+                string_start(r);
+            }
+            else if ((c >= '0' && c <= '9') || c == '-' || c == 't' || c == 'f' || c == 'n')
+                scalar_start(r);
+            else
+                fail("unknown character in value", offset + i, c);
+        }
+        else if (state == expect_key)
+        {
+            r.index++;
+            if (c == '}')
+                close();
+            else if (c == '"')
+                string_start(r);
+            else
+                fail("unknown character in object", offset + i, c);
+        }
+        else if (state == expect_colon)
+        {
+            r.index++;
+            if (c != ':')
+                fail("unknown character in object", offset + i, c);
+
+            state = expect_value;
+        }
+        else if (state == expect_comma)
+        {
+            r.index++;
+            if (c == ',')
+                state = stack.back() == '{' ? expect_key : expect_value;
+            else if (c == (stack.back() == '{' ? '}' : ']'))
+                close();
+            else
+                fail("expected comma", offset + i, c);
+        }
+        else
+        {
+            // Anything after the root value is ignored, as before
+            r.index = r.length;
+        }
+    }
+
+    void string_start(jreader& r)
+    {
+        size_t start = r.index;
+        bool escaped = false;
+
+        while (true)
+        {
+            size_t i = r.scan(r.index, jstring_end);
+            if (i + 1 >= r.length && (i >= r.length || r.chars[i] == '\\'))
+            {
+                // Cut off, possibly right after a backslash
+                pending = "\"";
+                pending.append(&r.chars[start], r.length - start);
+                pendingEscape = i < r.length;
+                r.index = r.length;
+                return;
+            }
+
+            if (r.chars[i] == '\"')
+            {
+                r.index = i + 1;
+                string(&r.chars[start], i - start, escaped, offset + start);
+                return;
+            }
+
+            r.index = i + 2;
+            escaped = true;
+        }
+    }
+
+    void scalar_start(jreader& r)
+    {
+        size_t start = r.index;
+        r.index = r.scan(r.index, jtoken_end);
+
+        if (r.index >= r.length)
+            pending.assign(&r.chars[start], r.length - start);
+        else
+            scalar(&r.chars[start], r.index - start, offset + start);
+    }
+
+    // Completes the pending token with the start of the next chunk, if it ends there
+    void resume(jreader& r)
+    {
+        if (pending[0] != '\"')
+        {
+            r.index = r.scan(0, jtoken_end);
+            pending.append(r.chars, r.index);
+
+            if (r.index < r.length)
+                finish_pending();
+
+            return;
+        }
+
+        // An empty chunk, which feeding the end of a file can give, has no character to complete the escape with
+        if (pendingEscape && r.index < r.length)
+        {
+            pending += r.chars[r.index++];
+            pendingEscape = false;
+        }
+
+        while (r.index < r.length)
+        {
+            size_t i = r.scan(r.index, jstring_end);
+            pending.append(&r.chars[r.index], i - r.index);
+
+            if (i >= r.length)
+            {
+                r.index = r.length;
+                return;
+            }
+
+            if (r.chars[i] == '\"')
+            {
+                r.index = i + 1;
+                finish_pending();
+                return;
+            }
+
+            pending += '\\';
+            if (i + 1 >= r.length)
+            {
+                pendingEscape = true;
+                r.index = r.length;
+                return;
+            }
+
+            pending += r.chars[i + 1];
+            r.index = i + 2;
+        }
+    }
+
+    void finish_pending()
+    {
+        bool quoted = pending[0] == '\"';
+        std::string token = std::move(pending);
+        pending.clear();
+
+        size_t at = offset - token.size();
+        if (quoted)
+        {
+            bool escaped = token.find('\\') != std::string::npos;
+            string(token.data() + 1, token.size() - 1, escaped, at + 1);
+        }
+        else
+            scalar(token.data(), token.size(), at);
+    }
+
+    void string(const char* chars, size_t length, bool escaped, size_t at)
+    {
+        std::string_view s (chars, length);
+        if (escaped)
+        {
+            text.resize(length);
+            s = {text.data(), junescape(chars, length, text.data(), at)};
+        }
+
+        if (state == expect_key)
+        {
+            handler.key(s);
+            state = expect_colon;
+        }
+        else
+        {
+            handler.string(s);
+            value_done();
+        }
+    }
+
+    void scalar(const char* chars, size_t length, size_t at)
+    {
+        jreader t (chars, length, nullptr);
+        t.index = 1;
+
+        char c = chars[0];
+        if (c == 't' || c == 'f')
+        {
+            bool b = parse_bool_value(t);
+            if (t.index == length)
+                handler.boolean(b);
+        }
+        else if (c == 'n')
+        {
+            parse_null_value(t);
+            if (t.index == length)
+                handler.null_value();
+        }
+        else
+        {
+            double d = parse_number_value(t);
+            if (t.index == length)
+                handler.number(d);
+        }
+
+        if (t.index != length)
+            fail("unknown value", at + t.index, chars[t.index]);
+
+        value_done();
+    }
+
+    void close()
+    {
+        char c = stack.back();
+        stack.pop_back();
+
+        if (c == '{')
+            handler.end_object();
+        else
+            handler.end_array();
+
+        value_done();
+    }
+
+    void value_done()
+    {
+        state = stack.empty() ? expect_end : expect_comma;
+    }
+
+    void fail(const char* message, size_t index, char c = 0)
+    {
+        if (c != 0)
+            printf("%s at index %zu: '%c'\n", message, index, c);
+        else
+            printf("%s at index %zu\n", message, index);
+
+        throw std::runtime_error("parse failed");
+    }
+};
+
+struct jcursor;
+
+// Read-only form of a document as one contiguous array of 64-bit words, read through jcursor. Each value
+// starts with a word whose top byte is a tag:
+//   '{' '[':     the low 32 bits hold the index of the matching '}' or ']' word, which holds the index of the
+//                opening one, and the 24 bits above them the number of members or elements (saturated)
+//   '"':         the offset of the characters in strings, followed by a word holding the length
+//   'd':         followed by a word holding the bits of the double
+//   't' 'f' 'n': true, false and null
+// Object members are a key string followed by the value. Strings are copied, so the input can go once parsed.
+struct jtape
+{
+    static constexpr uint64_t count_limit = 0xFFFFFF;
+
+    std::vector<uint64_t> words;
+    std::vector<char> strings;
+
+    static uint64_t word(char tag, uint64_t payload)
+    {
+        return ((uint64_t) (uint8_t) tag << 56) | payload;
+    }
+
+    char tag(size_t i) const
+    {
+        return (char) (words[i] >> 56);
+    }
+
+    uint64_t payload(size_t i) const
+    {
+        return words[i] & 0x00FFFFFFFFFFFFFFull;
+    }
+
+    void parse(const char* chars, size_t length);
+
+    void parse(std::string_view str)
+    {
+        parse(str.data(), str.size());
+    }
+
+    jcursor root() const;
+};
+
+// Handler for jsax that appends to a tape
+struct jtape_writer
+{
+    jtape& tape;
+
+    // Opening word and member or element count of each container being written
+    std::vector<size_t> open;
+    std::vector<uint64_t> counts;
+
+    explicit jtape_writer(jtape& tape) : tape(tape)
+    {
+    }
+
+    void start_object()
+    {
+        start('{');
+    }
+
+    void key(std::string_view k)
+    {
+        counts.back()++;
+        text(k);
+    }
+
+    void end_object()
+    {
+        end('}');
+    }
+
+    void start_array()
+    {
+        start('[');
+    }
+
+    void end_array()
+    {
+        end(']');
+    }
+
+    void string(std::string_view s)
+    {
+        element();
+        text(s);
+    }
+
+    void number(double d)
+    {
+        element();
+
+        uint64_t bits;
+        std::memcpy(&bits, &d, sizeof(bits));
+        tape.words.push_back(jtape::word('d', 0));
+        tape.words.push_back(bits);
+    }
+
+    void boolean(bool b)
+    {
+        element();
+        tape.words.push_back(jtape::word(b ? 't' : 'f', 0));
+    }
+
+    void null_value()
+    {
+        element();
+        tape.words.push_back(jtape::word('n', 0));
+    }
+
+    // Members are counted by their keys instead
+    void element()
+    {
+        if (!open.empty() && tape.tag(open.back()) == '[')
+            counts.back()++;
+    }
+
+    void start(char tag)
+    {
+        element();
+        open.push_back(tape.words.size());
+        counts.push_back(0);
+        tape.words.push_back(jtape::word(tag, 0));
+    }
+
+    void end(char tag)
+    {
+        size_t start = open.back();
+        uint64_t count = std::min(counts.back(), jtape::count_limit);
+        open.pop_back();
+        counts.pop_back();
+
+        tape.words[start] = jtape::word(tape.tag(start), count << 32 | tape.words.size());
+        tape.words.push_back(jtape::word(tag, start));
+    }
+
+    void text(std::string_view s)
+    {
+        tape.words.push_back(jtape::word('"', tape.strings.size()));
+        tape.words.push_back(s.size());
+        tape.strings.insert(tape.strings.end(), s.begin(), s.end());
+    }
+};
+
+void jtape::parse(const char* chars, size_t length)
+{
+    words.clear();
+    strings.clear();
+
+    // A guess that avoids most regrowth: about a word for every four characters of number-heavy input
+    words.reserve(length / 4);
+
+    jtape_writer writer (*this);
+    jsax(chars, length, writer);
+}
+
+struct jtape_member;
+
+template<typename T>
+struct jtape_range;
+
+// A value on a jtape, as the index of its first word. Cursors are plain values and stay valid as long as
+// the tape is unchanged. A default-constructed cursor stands for a missing value and tests false.
+struct jcursor
+{
+    const jtape* tape = nullptr;
+    size_t index = 0;
+
+    explicit operator bool() const
+    {
+        return tape != nullptr;
+    }
+
+    int type() const
+    {
+        char t = tape->tag(index);
+        if (t == '{')
+            return type_object;
+        else if (t == '[')
+            return type_array;
+        else if (t == '"')
+            return type_string;
+        else if (t == 'd')
+            return type_number;
+        else if (t == 't' || t == 'f')
+            return type_bool;
+
+        return type_null;
+    }
+
+    // Index of the word after this value, which is where the next value in the same container starts
+    size_t after() const
+    {
+        char t = tape->tag(index);
+        if (t == '{' || t == '[')
+            return (tape->payload(index) & 0xFFFFFFFF) + 1;
+        else if (t == '"' || t == 'd')
+            return index + 2;
+
+        return index + 1;
+    }
+
+    std::string_view string() const
+    {
+        check(type_string);
+        return {tape->strings.data() + tape->payload(index), (size_t) tape->words[index + 1]};
+    }
+
+    double number() const
+    {
+        check(type_number);
+
+        double d;
+        std::memcpy(&d, &tape->words[index + 1], sizeof(d));
+        return d;
+    }
+
+    bool boolean() const
+    {
+        check(type_bool);
+        return tape->tag(index) == 't';
+    }
+
+    // Number of members or elements
+    size_t size() const;
+
+    // The value of a member, or a missing cursor; members are found by scanning
+    jcursor operator[] (std::string_view key) const;
+
+    jcursor operator[] (const char* key) const
+    {
+        return (*this)[std::string_view(key)];
+    }
+
+    // Array elements are found by skipping the ones before them
+    jcursor at(size_t i) const;
+
+    jtape_range<jcursor> elements() const;
+    jtape_range<jtape_member> members() const;
+
+    template<typename T>
+    std::vector<T> to_vector() const;
+
+    void check(int expected) const
+    {
+        if (tape == nullptr)
+        {
+            printf("Missing %s value\n", type_to_string(expected));
+            abort();
+        }
+
+        if (type() != expected)
+        {
+            printf("Type mismatch: expected %s but got %s\n", type_to_string(expected), type_to_string(type()));
+            abort();
+        }
+    }
+};
+
+struct jtape_member
+{
+    std::string_view key;
+    jcursor value;
+};
+
+// Walks the elements of an array (T = jcursor) or the members of an object (T = jtape_member) in order
+template<typename T>
+struct jtape_iterator
+{
+    jcursor at;
+
+    T operator*() const
+    {
+        if constexpr (std::is_same_v<T, jtape_member>)
+            return {at.string(), jcursor {at.tape, at.index + 2}};
+        else
+            return at;
+    }
+
+    jtape_iterator& operator++()
+    {
+        if constexpr (std::is_same_v<T, jtape_member>)
+            at.index = jcursor {at.tape, at.index + 2}.after();
+        else
+            at.index = at.after();
+
+        return *this;
+    }
+
+    bool operator!=(const jtape_iterator& other) const
+    {
+        return at.index != other.at.index;
+    }
+};
+
+template<typename T>
+struct jtape_range
+{
+    jtape_iterator<T> first;
+    jtape_iterator<T> last;
+
+    jtape_iterator<T> begin() const
+    {
+        return first;
+    }
+
+    jtape_iterator<T> end() const
+    {
+        return last;
+    }
+};
+
+jcursor jtape::root() const
+{
+    return {this, 0};
+}
+
+jtape_range<jcursor> jcursor::elements() const
+{
+    check(type_array);
+    size_t close = tape->payload(index) & 0xFFFFFFFF;
+    return {{{tape, index + 1}}, {{tape, close}}};
+}
+
+jtape_range<jtape_member> jcursor::members() const
+{
+    check(type_object);
+    size_t close = tape->payload(index) & 0xFFFFFFFF;
+    return {{{tape, index + 1}}, {{tape, close}}};
+}
+
+size_t jcursor::size() const
+{
+    if (type() != type_object)
+        check(type_array);
+
+    uint64_t count = tape->payload(index) >> 32;
+    if (count < jtape::count_limit)
+        return count;
+
+    // Only counted up to the limit while parsing
+    count = 0;
+    if (type() == type_object)
+    {
+        auto r = members();
+        for (auto i = r.begin(); i != r.end(); ++i)
+            count++;
+    }
+    else
+    {
+        auto r = elements();
+        for (auto i = r.begin(); i != r.end(); ++i)
+            count++;
+    }
+
+    return count;
+}
+
+jcursor jcursor::operator[] (std::string_view key) const
+{
+    for (auto m: members())
+    {
+        if (m.key == key)
+            return m.value;
+    }
+
+    return {};
+}
+
+jcursor jcursor::at(size_t i) const
+{
+    for (auto e: elements())
+    {
+        if (i-- == 0)
+            return e;
+    }
+
+    return {};
+}
+
+template<typename T>
+std::vector<T> jcursor::to_vector() const
+{
+    std::vector<T> v;
+    v.reserve(size());
+
+    for (auto e: elements())
+        v.emplace_back((T) e.number());
+
+    return v;
+}
+
+// One member of a struct filled in by jdecode: the key it is read from, with the key's hash worked out at compile
+// time, and the member it is stored in
+template<typename S, typename T>
+struct jfield
+{
+    std::string_view key;
+    uint32_t hash;
+    T S::* member;
+};
+
+template<typename S, typename T>
+static constexpr jfield<S, T> jbind(std::string_view key, T S::* member)
+{
+    return {key, jhash(key), member};
+}
+
+template<typename S>
+static void jdecode(jvalue* v, S& out);
+
+// Conversions for the member types jdecode supports. Wrong types fail like the casts do.
+inline void jread(jvalue* v, double& out)
+{
+    out = jnumber::cast(v)->value;
+}
+
+inline void jread(jvalue* v, float& out)
+{
+    out = (float) jnumber::cast(v)->value;
+}
+
+inline void jread(jvalue* v, int32_t& out)
+{
+    out = (int32_t) jnumber::cast(v)->value;
+}
+
+inline void jread(jvalue* v, uint64_t& out)
+{
+    out = (uint64_t) jnumber::cast(v)->value;
+}
+
+inline void jread(jvalue* v, bool& out)
+{
+    out = jbool::cast(v)->value;
+}
+
+inline void jread(jvalue* v, std::string_view& out)
+{
+    out = jstring::cast(v)->value;
+}
+
+inline void jread(jvalue* v, jvalue*& out)
+{
+    out = v;
+}
+
+inline void jread(jvalue* v, jstring*& out)
+{
+    out = jstring::cast(v);
+}
+
+inline void jread(jvalue* v, jarray*& out)
+{
+    out = jarray::cast(v);
+}
+
+inline void jread(jvalue* v, jobject*& out)
+{
+    out = jobject::cast(v);
+}
+
+template<typename T>
+inline void jread(jvalue* v, std::optional<T>& out)
+{
+    jread(v, out.emplace());
+}
+
+// Nested objects decode into structs of their own
+template<typename S>
+static auto jread(jvalue* v, S& out) -> decltype(S::fields(), void())
+{
+    jdecode(v, out);
+}
+
+// Fills in a struct from an object in one pass over the object's members. S lists the members it reads with
+//     static constexpr auto fields() { return std::make_tuple(jbind("key", &S::member), ...); }
+// Each member of the object is matched against the keys by hash first, so lookups never search the object.
+// Keys that are missing or null leave the struct's members as they were, and other keys are ignored.
+template<typename S>
+static void jdecode(jvalue* v, S& out)
+{
+    constexpr auto fields = S::fields();
+    jobject* o = jobject::cast(v);
+
+    for (const jmember& m: o->elements)
+    {
+        if (m.value == nullptr)
+            continue;
+
+        std::apply([&](const auto&... f)
+        {
+            (void) ((m.hash == f.hash && m.key == f.key && (jread(m.value, out.*f.member), true)) || ...);
+        }, fields);
+    }
+}
@@ -10,8 +10,17 @@
 #include <set>
 #include <fstream>
 #include <array>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
 #include <map>
+#include <unordered_map>
 #include <random>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "vecmath.hpp"
 #include "json.hpp"
 
@@ -102,33 +111,332 @@ static std::vector<char> readFile(const std::string& filename)
     return buffer;
 }
 
-std::map<const std::string, std::vector<char>> cachedFileData;
-static std::vector<char>* readFileWithCache(const std::string& filename)
+// Read-only mapping of a whole file, so large inputs can be used in place without reading them into memory
+struct MappedFile
 {
-    bool present = cachedFileData.contains(filename);
+    const char* data = null;
+    size_t size = 0;
 
-    if (!present)
+    explicit MappedFile(const std::string& filename, int advice = MADV_SEQUENTIAL)
     {
-        std::ifstream file(filename, std::ios::ate | std::ios::binary);
-
-        if (!file.is_open())
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
             throw std::runtime_error("opening file " + filename + " failed!");
 
-        size_t fileSize = (size_t) file.tellg();
+        struct stat st {};
+        fstat(fd, &st);
+        size = (size_t) st.st_size;
+
+        if (size > 0)
+        {
+            void* mapped = mmap(null, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED)
+            {
+                close(fd);
+                throw std::runtime_error("mapping file " + filename + " failed!");
+            }
+
+            madvise(mapped, size, advice);
+            data = (const char*) mapped;
+        }
+
+        close(fd);
+    }
 
-        cachedFileData.insert(std::pair(filename, std::vector<char>(fileSize)));
+    // Hints how a range of the file is used next: MADV_WILLNEED before reading it, or MADV_DONTNEED once done with
+    // it, which lets the pages go since they can always be read from the file again
+    void advise(size_t offset, size_t length, int advice) const
+    {
+        if (data == null || offset >= size)
+            return;
 
-        std::vector<char>* buffer = &(cachedFileData[filename]);
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        size_t begin = offset / page * page;
+        size_t end = std::min(size, offset + length);
+        madvise((void*) (data + begin), end - begin, advice);
+    }
 
-        file.seekg(0);
-        file.read(buffer->data(), (long) fileSize);
-        file.close();
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
 
-        return buffer;
+    ~MappedFile()
+    {
+        if (data != null)
+            munmap((void*) data, size);
     }
+};
 
-    std::vector<char>* buffer = &(cachedFileData[filename]);
-    return buffer;
+// Files that mesh attributes are read from, mapped once and shared by every mesh that uses them. Their pages are
+// only read in while a mesh is being uploaded, rather than being held in memory alongside the GPU copy.
+std::map<const std::string, std::unique_ptr<MappedFile>> mappedFiles;
+static const MappedFile* mapFileWithCache(const std::string& filename)
+{
+    std::unique_ptr<MappedFile>& file = mappedFiles[filename];
+    if (file == null)
+        file = std::make_unique<MappedFile>(filename, MADV_NORMAL);
+
+    return file.get();
+}
+
+// Content hash used to tell whether a derived file is still up to date, taking 8 bytes at a time
+static uint64_t hashBytes(const char* data, size_t size)
+{
+    uint64_t h = 14695981039346656037ull ^ size;
+    size_t i = 0;
+
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        h = (h ^ word) * 1099511628211ull;
+        h ^= h >> 32;
+    }
+
+    for (; i < size; i++)
+        h = (h ^ (unsigned char) data[i]) * 1099511628211ull;
+
+    return h;
+}
+
+// hashBytes over data that arrives in pieces, such as the chunks a file is read in. The total size must be known up
+// front; once all of it has been fed, finish() returns what hashBytes would have for the whole.
+struct StreamHash
+{
+    uint64_t h;
+    char word[8];
+    size_t wordSize = 0;
+
+    explicit StreamHash(uint64_t size) : h(14695981039346656037ull ^ size) {}
+
+    void feed(const char* data, size_t size)
+    {
+        size_t i = 0;
+
+        // Completes the word left over from the last piece
+        if (wordSize > 0)
+        {
+            size_t n = std::min(size, 8 - wordSize);
+            memcpy(word + wordSize, data, n);
+            wordSize += n;
+            i = n;
+
+            if (wordSize < 8)
+                return;
+
+            step(word);
+            wordSize = 0;
+        }
+
+        for (; i + 8 <= size; i += 8)
+            step(data + i);
+
+        memcpy(word, data + i, size - i);
+        wordSize = size - i;
+    }
+
+    uint64_t finish()
+    {
+        for (size_t i = 0; i < wordSize; i++)
+            h = (h ^ (unsigned char) word[i]) * 1099511628211ull;
+
+        wordSize = 0;
+        return h;
+    }
+
+    void step(const char* p)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 1099511628211ull;
+        h ^= h >> 32;
+    }
+};
+
+// Size and modification time of a file, which tell whether it may have changed without reading it
+struct FileStamp
+{
+    uint64_t size = 0;
+    int64_t modified = 0;
+
+    bool operator==(const FileStamp&) const = default;
+};
+
+static FileStamp fileStamp(const std::string& filename)
+{
+    std::error_code error;
+    FileStamp stamp;
+    stamp.size = (uint64_t) std::filesystem::file_size(filename, error);
+    stamp.modified = (int64_t) std::filesystem::last_write_time(filename, error).time_since_epoch().count();
+
+    if (error)
+        return {};
+
+    return stamp;
+}
+
+// Index buffer generation for triangle lists, run on each mesh as it is loaded. Finds the distinct records among
+// count records of stride bytes: each record's index among them goes in indices, and for each distinct record, the
+// first record equal to it goes in sources.
+static u32 deduplicateVertices(const char* data, size_t stride, size_t count, std::vector<u32>& indices, std::vector<u32>& sources)
+{
+    size_t capacity = 1;
+    while (capacity < count * 2)
+        capacity <<= 1;
+
+    std::vector<u32> table (capacity, UINT32_MAX);
+    indices.resize(count);
+    sources.clear();
+
+    for (size_t v = 0; v < count; v++)
+    {
+        const char* record = data + v * stride;
+        uint64_t h = hashBytes(record, stride);
+        size_t slot = (size_t) (h ^ (h >> 32)) & (capacity - 1);
+
+        while (table[slot] != UINT32_MAX && memcmp(data + (size_t) sources[table[slot]] * stride, record, stride) != 0)
+            slot = (slot + 1) & (capacity - 1);
+
+        if (table[slot] == UINT32_MAX)
+        {
+            table[slot] = (u32) sources.size();
+            sources.emplace_back((u32) v);
+        }
+
+        indices[v] = table[slot];
+    }
+
+    return (u32) sources.size();
+}
+
+// Reorders the triangles so that vertices are reused while they are still in a post-transform cache of cacheSize
+// entries. This is Tipsify (Sander, Nehab and Barczak, "Fast Triangle Reordering for Vertex Locality and Reduced
+// Overdraw", 2007): it fans out around one vertex at a time, moving next to the vertex of those just emitted that
+// stays in the cache longest, and falls back to recently used vertices when there is none.
+static void optimizeVertexCache(std::vector<u32>& indices, u32 vertexCount, u32 cacheSize = 16)
+{
+    const u32 none = UINT32_MAX;
+    size_t triangleCount = indices.size() / 3;
+
+    if (vertexCount == 0)
+        return;
+
+    // The triangles using each vertex
+    std::vector<u32> offsets (vertexCount + 1);
+    for (u32 i: indices)
+        offsets[i + 1]++;
+
+    for (u32 v = 0; v < vertexCount; v++)
+        offsets[v + 1] += offsets[v];
+
+    std::vector<u32> adjacency (indices.size());
+    std::vector<u32> fill (offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < indices.size(); i++)
+        adjacency[fill[indices[i]]++] = (u32) (i / 3);
+
+    // Uses of each vertex by triangles not emitted yet
+    std::vector<u32> live (vertexCount);
+    for (u32 v = 0; v < vertexCount; v++)
+        live[v] = offsets[v + 1] - offsets[v];
+
+    std::vector<u32> cacheTime (vertexCount);
+    std::vector<char> emitted (triangleCount);
+    std::vector<u32> deadEnds;
+    std::vector<u32> candidates;
+    std::vector<u32> output;
+    output.reserve(indices.size());
+
+    u32 time = cacheSize + 1;
+    u32 cursor = 0;
+    u32 fanning = 0;
+
+    while (fanning != none)
+    {
+        candidates.clear();
+
+        for (u32 a = offsets[fanning]; a < offsets[fanning + 1]; a++)
+        {
+            u32 t = adjacency[a];
+            if (emitted[t])
+                continue;
+
+            emitted[t] = true;
+            for (int c = 0; c < 3; c++)
+            {
+                u32 v = indices[3 * t + c];
+                output.emplace_back(v);
+                deadEnds.emplace_back(v);
+                candidates.emplace_back(v);
+                live[v]--;
+
+                if (time - cacheTime[v] > cacheSize)
+                {
+                    cacheTime[v] = time;
+                    time++;
+                }
+            }
+        }
+
+        // The vertex whose remaining triangles can be emitted while it is still in the cache, and which has been
+        // there longest
+        fanning = none;
+        int64_t best = -1;
+        for (u32 v: candidates)
+        {
+            if (live[v] == 0)
+                continue;
+
+            int64_t priority = 0;
+            if (time - cacheTime[v] + 2 * live[v] <= cacheSize)
+                priority = time - cacheTime[v];
+
+            if (priority > best)
+            {
+                best = priority;
+                fanning = v;
+            }
+        }
+
+        while (fanning == none && !deadEnds.empty())
+        {
+            u32 v = deadEnds.back();
+            deadEnds.pop_back();
+
+            if (live[v] > 0)
+                fanning = v;
+        }
+
+        while (fanning == none && cursor < vertexCount)
+        {
+            if (live[cursor] > 0)
+                fanning = cursor;
+
+            cursor++;
+        }
+    }
+
+    indices.swap(output);
+}
+
+// Renumbers the vertices in the order the triangles first use them, so that vertex fetches move forward through
+// memory
+static void optimizeVertexFetch(std::vector<u32>& indices, std::vector<u32>& sources)
+{
+    std::vector<u32> remap (sources.size(), UINT32_MAX);
+    std::vector<u32> ordered;
+    ordered.reserve(sources.size());
+
+    for (u32& i: indices)
+    {
+        if (remap[i] == UINT32_MAX)
+        {
+            remap[i] = (u32) ordered.size();
+            ordered.emplace_back(sources[i]);
+        }
+
+        i = remap[i];
+    }
+
+    sources.swap(ordered);
 }
 
 struct SimpleVertex
@@ -216,6 +524,149 @@ struct ComplexVertex
     }
 };
 
+// Encodings used by PackedVertex, each decoded by the vertex input format named beside it or by complex.vert
+
+// VK_FORMAT_R16_UNORM
+static uint16_t unorm16(float f)
+{
+    return (uint16_t) std::lround(std::clamp(f, 0.0f, 1.0f) * 65535);
+}
+
+// VK_FORMAT_R16_SNORM
+static int16_t snorm16(float f)
+{
+    return (int16_t) std::lround(std::clamp(f, -1.0f, 1.0f) * 32767);
+}
+
+// VK_FORMAT_R16_SFLOAT, rounding to nearest even
+static uint16_t halfFloat(float f)
+{
+    uint32_t x;
+    memcpy(&x, &f, sizeof(x));
+
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mantissa = x & 0x7fffff;
+    int32_t exponent = (int32_t) ((x >> 23) & 0xff) - 127 + 15;
+
+    if (((x >> 23) & 0xff) == 0xff)
+        return sign | 0x7c00 | (mantissa != 0 ? 0x200 : 0);
+
+    if (exponent >= 31)
+        return sign | 0x7c00;
+
+    uint32_t h;
+    uint32_t rest;
+    uint32_t halfway;
+    if (exponent <= 0)
+    {
+        // Subnormal, or zero if even rounding up cannot reach the smallest subnormal
+        if (exponent < -10)
+            return sign;
+
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        h = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    }
+    else
+    {
+        h = ((uint32_t) exponent << 10) | (mantissa >> 13);
+        rest = mantissa & 0x1fff;
+        halfway = 0x1000;
+    }
+
+    // A carry out of the mantissa correctly rounds up to the next exponent, or to infinity
+    if (rest > halfway || (rest == halfway && (h & 1)))
+        h++;
+
+    return sign | h;
+}
+
+// A unit vector as the point on an octahedron it projects to, unfolded onto a square (Cigolle et al., "A Survey of
+// Efficient Representations for Independent Unit Vectors", 2014). Zero vectors decode to +z.
+static i16vec2 octahedral(vec3 n)
+{
+    float l = fabs(n.x) + fabs(n.y) + fabs(n.z);
+    if (l == 0)
+        return i16vec2(0, 0);
+
+    float x = n.x / l;
+    float y = n.y / l;
+    if (n.z < 0)
+    {
+        float foldedX = (1 - fabs(y)) * (x >= 0 ? 1 : -1);
+        float foldedY = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+        x = foldedX;
+        y = foldedY;
+    }
+
+    return i16vec2(snorm16(x), snorm16(y));
+}
+
+// ComplexVertex in 24 bytes instead of 52, selected with --packed-vertices. Positions are normalized to the bounds of
+// their mesh, which the mesh passes to complex.vert to undo, and the tangent's handedness is kept in position.w.
+struct PackedVertex
+{
+    u16vec4 pos;
+    i16vec2 normal;
+    i16vec2 tangent;
+    u16vec2 texCoord;
+    u8vec4 color;
+
+    PackedVertex(const ComplexVertex& v, vec3 offset, vec3 scale)
+    {
+        this->pos = u16vec4(unorm16((v.pos.x - offset.x) / scale.x),
+                            unorm16((v.pos.y - offset.y) / scale.y),
+                            unorm16((v.pos.z - offset.z) / scale.z),
+                            v.tangent.w < 0 ? 0 : 65535);
+        this->normal = octahedral(v.normal);
+        this->tangent = octahedral(vec3(v.tangent.x, v.tangent.y, v.tangent.z));
+        this->texCoord = u16vec2(halfFloat(v.texCoord.x), halfFloat(v.texCoord.y));
+        this->color = v.color;
+    }
+
+    static VkVertexInputBindingDescription getBindDesc()
+    {
+        VkVertexInputBindingDescription desc {};
+        desc.binding = 0;
+        desc.stride = sizeof(PackedVertex);
+        desc.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+        return desc;
+    }
+
+    static std::array<VkVertexInputAttributeDescription, 5> getAttributeDesc()
+    {
+        std::array<VkVertexInputAttributeDescription, 5> descs {};
+        descs[0].binding = 0;
+        descs[0].location = 0;
+        descs[0].format = VK_FORMAT_R16G16B16A16_UNORM;
+        descs[0].offset = offsetof(PackedVertex, pos);
+
+        descs[1].binding = 0;
+        descs[1].location = 1;
+        descs[1].format = VK_FORMAT_R16G16_SNORM;
+        descs[1].offset = offsetof(PackedVertex, normal);
+
+        descs[2].binding = 0;
+        descs[2].location = 2;
+        descs[2].format = VK_FORMAT_R16G16_SNORM;
+        descs[2].offset = offsetof(PackedVertex, tangent);
+
+        descs[3].binding = 0;
+        descs[3].location = 3;
+        descs[3].format = VK_FORMAT_R16G16_SFLOAT;
+        descs[3].offset = offsetof(PackedVertex, texCoord);
+
+        descs[4].binding = 0;
+        descs[4].location = 4;
+        descs[4].format = VK_FORMAT_R8G8B8A8_UNORM;
+        descs[4].offset = offsetof(PackedVertex, color);
+
+        return descs;
+    }
+};
+
 struct PostVertex
 {
     vec3 pos;
@@ -287,6 +738,9 @@ struct PushConstant
 {
     alignas(16) mat4 modelView;
     int shadowMap;
+    // Positions of packed vertices are offset + scale * position
+    alignas(16) vec4 positionScale;
+    alignas(16) vec4 positionOffset;
 };
 
 // A good portion of this code is adapted from the official Vulkan tutorial: https://docs.vulkan.org/tutorial/latest/
@@ -313,14 +767,16 @@ public:
 
     struct Attribute
     {
-        void* data;
+        const MappedFile* file;
+        const void* data;
         size_t offset;
         size_t stride;
         VkFormat format;
 
         Attribute(std::string dataPath, size_t offset, size_t stride, std::string format)
         {
-            this->data = readFileWithCache(dataPath)->data();
+            this->file = mapFileWithCache(dataPath);
+            this->data = file->data;
             this->offset = offset;
             this->stride = stride;
 
@@ -331,1723 +787,3713 @@ public:
         }
     };
 
-    struct Material;
+    // Kinds of resources, which are kept in blocks of their own. Staging buffers are short-lived and are allocated
+    // linearly; buffers and images are long-lived and are kept apart so that they never share a page
+    // (bufferImageGranularity).
+    static const int memoryStaging = 0;
+    static const int memoryBuffer = 1;
+    static const int memoryImage = 2;
 
-    struct Mesh
+    // One vkAllocateMemory, which a MemoryAllocator hands out in pieces
+    struct MemoryBlock
     {
-        Renderer* renderer;
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize size = 0;
+        u32 memoryType = 0;
+        int kind = memoryBuffer;
+        char* mapped = null;
 
-        std::string name;
-        size_t count;
-        VkPrimitiveTopology topology;
-        std::map<std::string, Attribute> attributes;
-        Material* material;
+        // A block of its own for an allocation too large to share one
+        bool dedicated = false;
 
-        vec3 corners[2][2][2];
+        int live = 0;
+        VkDeviceSize used = 0;
+        VkDeviceSize requested = 0;
 
-        VkBuffer buffer;
-        VkDeviceMemory bufferMemory;
+        // Staging blocks allocate from head onward, and start over once everything in them has been freed
+        VkDeviceSize head = 0;
 
-        Mesh(Renderer* t, std::string name, size_t count, const std::string& topology)
+        // Other blocks are buddy allocators: the offsets of free chunks of 2^order bytes, by order
+        std::vector<std::set<VkDeviceSize>> freeChunks;
+
+        VkDeviceSize largestFree() const
         {
-            this->material = &(t->defaultMaterial);
-            this->name = name;
-            this->count = count;
+            if (dedicated)
+                return 0;
 
-            if (topology == "POINT_LIST")
-                this->topology = VK_PRIMITIVE_TOPOLOGY_POINT_LIST;
-            else if (topology == "LINE_LIST")
-                this->topology = VK_PRIMITIVE_TOPOLOGY_LINE_LIST;
-            else if (topology == "LINE_STRIP")
-                this->topology = VK_PRIMITIVE_TOPOLOGY_LINE_STRIP;
-            else if (topology == "TRIANGLE_LIST")
-                this->topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-            else if (topology == "TRIANGLE_STRIP")
-                this->topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP;
-            else if (topology == "TRIANGLE_FAN")
-                this->topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_FAN;
-            else if (topology == "LINE_LIST_WITH_ADJACENCY")
-                this->topology = VK_PRIMITIVE_TOPOLOGY_LINE_LIST_WITH_ADJACENCY;
-            else if (topology == "LINE_STRIP_WITH_ADJACENCY")
-                this->topology = VK_PRIMITIVE_TOPOLOGY_LINE_STRIP_WITH_ADJACENCY;
-            else if (topology == "TRIANGLE_LIST_WITH_ADJACENCY")
-                this->topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST_WITH_ADJACENCY;
-            else if (topology == "TRIANGLE_STRIP_WITH_ADJACENCY")
-                this->topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP_WITH_ADJACENCY;
-            else if (topology == "PATCH_LIST")
-                this->topology = VK_PRIMITIVE_TOPOLOGY_PATCH_LIST;
+            if (kind == memoryStaging)
+                return size - head;
 
-            renderer = t;
+            for (int o = (int) freeChunks.size() - 1; o >= 0; o--)
+            {
+                if (!freeChunks[o].empty())
+                    return (VkDeviceSize) 1 << o;
+            }
+
+            return 0;
         }
+    };
 
-        void initialize()
-        {
-            VkBuffer stagingBuffer;
-            VkDeviceMemory stagingBufferMemory;
+    // A piece of device memory, to bind a resource to at offset
+    struct DeviceAllocation
+    {
+        VkDeviceMemory memory = VK_NULL_HANDLE;
+        VkDeviceSize offset = 0;
+        VkDeviceSize size = 0;
+        int order = 0;
+        MemoryBlock* block = null;
+
+        // The allocation's host address, if it was made with VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+        void* mapped = null;
+    };
 
-            VkDeviceSize size = this->material->type->stride * count;
-            renderer->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer, stagingBufferMemory);
+    // Sub-allocates device memory from large blocks per memory type and kind, so that the number of
+    // vkAllocateMemory calls depends on the bytes in use rather than on the number of resources. Host-visible blocks
+    // stay mapped for their whole life.
+    struct MemoryAllocator
+    {
+        static constexpr VkDeviceSize blockSize = 64 << 20;
+        static const int blockOrder = 26;
+        static const int minOrder = 8;
 
-            Attribute pos = attributes.at("POSITION");
-//            Attribute col = attributes.at("COLOR");
-//
-//            for (int i = 0; i < count; i++)
-//            {
-//                *(float*) &(((char*) (pos.data))[col.offset + col.stride * i + 0 * sizeof(float)]) *= 2;
-//                *(float*) &(((char*) (pos.data))[col.offset + col.stride * i + 1 * sizeof(float)]) *= 2;
-//                *(float*) &(((char*) (pos.data))[col.offset + col.stride * i + 2 * sizeof(float)]) *= 2;
-//            }
-
-            void* data;
-            vkMapMemory(renderer->device, stagingBufferMemory, 0, size, 0, &data);
-            memcpy(data, pos.data, size);
-            vkUnmapMemory(renderer->device, stagingBufferMemory);
-
-            char* datac = (char*) data;
-            float minX = std::numeric_limits<float>::infinity();
-            float minY = std::numeric_limits<float>::infinity();;
-            float minZ = std::numeric_limits<float>::infinity();;
+        Renderer* renderer;
+        std::vector<std::unique_ptr<MemoryBlock>> blocks;
 
-            float maxX = -std::numeric_limits<float>::infinity();;
-            float maxY = -std::numeric_limits<float>::infinity();;
-            float maxZ = -std::numeric_limits<float>::infinity();;
-            for (size_t i = pos.offset; i < size; i += pos.stride)
-            {
-                float x = *((float*) (&(datac[i])));
-                float y = *((float*) (&(datac[i + sizeof(float)])));
-                float z = *((float*) (&(datac[i + sizeof(float) * 2])));
+        MemoryAllocator(Renderer* r)
+        {
+            this->renderer = r;
+        }
 
-                if (x < minX)
-                    minX = x;
+        DeviceAllocation allocate(const VkMemoryRequirements& req, VkMemoryPropertyFlags props, int kind)
+        {
+            u32 type = renderer->findMemoryType(req.memoryTypeBits, props);
+            bool hostVisible = (props & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+            DeviceAllocation a;
 
-                if (y < minY)
-                    minY = y;
+            if (req.size > blockSize / 2)
+            {
+                MemoryBlock* b = createBlock(type, kind, req.size, hostVisible);
+                b->dedicated = true;
+                b->live = 1;
+                b->used = req.size;
+                b->requested = req.size;
+                place(a, b, 0, req.size);
+                return a;
+            }
 
-                if (z < minZ)
-                    minZ = z;
+            for (auto& b: blocks)
+            {
+                if (b->memoryType == type && b->kind == kind && !b->dedicated && allocateFrom(*b, req, a))
+                    return a;
+            }
 
-                if (x > maxX)
-                    maxX = x;
+            MemoryBlock* b = createBlock(type, kind, blockSize, hostVisible);
+            bool placed = allocateFrom(*b, req, a);
+            assert(placed);
+            return a;
+        }
 
-                if (y > maxY)
-                    maxY = y;
+        void free(DeviceAllocation& a)
+        {
+            MemoryBlock* b = a.block;
+            if (b == null)
+                return;
 
-                if (z > maxZ)
-                    maxZ = z;
-            }
+            b->live--;
+            b->requested -= a.size;
 
-            if (renderer->enableCulling)
+            if (b->dedicated)
             {
-                for (int i = 0; i < 2; i++)
+                vkFreeMemory(renderer->device, b->memory, null);
+                std::erase_if(blocks, [b](const std::unique_ptr<MemoryBlock>& p) { return p.get() == b; });
+            }
+            else if (b->kind == memoryStaging)
+            {
+                if (b->live == 0)
                 {
-                    for (int j = 0; j < 2; j++)
-                    {
-                        for (int k = 0; k < 2; k++)
-                        {
-                            this->corners[i][j][k] = vec3(i == 0 ? minX : maxX,
-                                                          j == 0 ? minY : maxY,
-                                                          k == 0 ? minZ : maxZ);
-                        }
-                    }
+                    b->head = 0;
+                    b->used = 0;
                 }
             }
-
-            renderer->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, bufferMemory);
-            renderer->copyBuffer(stagingBuffer, buffer, size);
-
-            vkDestroyBuffer(renderer->device, stagingBuffer, null);
-            vkFreeMemory(renderer->device, stagingBufferMemory, null);
-        }
-
-        void draw(VkCommandBuffer commandBuffer, mat4 m)
-        {
-            GraphicsPipeline* pipeline = this->material->type->getPipeline(renderer->scene);
-
-            if (renderer->currentMaterialType != this->material->type)
+            else
             {
-                renderer->currentMaterialType = this->material->type;
-                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->pipeline);
-            }
+                b->used -= (VkDeviceSize) 1 << a.order;
 
-            VkBuffer vertexBuffers[] = { buffer };
-            VkDeviceSize offsets[] = { 0 };
-            vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
-            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->layout,
-                                    0, 1, &(renderer->globalDescriptorSets[renderer->currentFrame]), 0, null);
-            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->layout,
-                                    1, 1, &(material->descriptorSets[renderer->currentFrame]), 0, null);
+                // Merges the chunk with its buddy for as long as the buddy is free too
+                VkDeviceSize offset = a.offset;
+                int order = a.order;
+                while (order < blockOrder && b->freeChunks[order].erase(offset ^ ((VkDeviceSize) 1 << order)) > 0)
+                {
+                    offset &= ~((VkDeviceSize) 1 << order);
+                    order++;
+                }
 
-            renderer->updatePushConstants(m, renderer->currentFrame);
+                b->freeChunks[order].insert(offset);
+            }
 
-            vkCmdDraw(commandBuffer, count, 1, 0, 0);
+            a = DeviceAllocation();
         }
 
-        ~Mesh()
+        void printStats()
         {
-            vkDestroyBuffer(renderer->device, buffer, null);
-            vkFreeMemory(renderer->device, bufferMemory, null);
-        }
-    };
+            VkDeviceSize total = 0;
+            VkDeviceSize used = 0;
+            int live = 0;
 
-    struct Camera
-    {
-        std::string name;
+            const char* kinds[] = {"staging", "buffer", "image"};
+            for (auto& b: blocks)
+            {
+                VkDeviceSize unused = b->size - b->used;
+                VkDeviceSize largest = b->largestFree();
 
-        // Frustum projection
-        mat4 perspectiveTransform = mat4::I();
-        // Derived from node scene graph transform
-        mat4 worldToCameraBaseTransform = mat4::I();
-        mat4 cameraBaseToWorldTransform = mat4::I();
-        // Controlled by the user
-        mat4 cameraUserOffsetTransform = mat4::I();
-        mat4 cameraPosTransform = mat4::I();
-        // Everything
-        mat4 fullTransform;
+                // External fragmentation: how much of the free space cannot be used for one allocation
+                double fragmentation = unused > 0 ? 1 - (double) largest / (double) unused : 0;
 
-        float aspectRatio;
-        float verticalFOV;
-        float verticalFOVScaled;
-        float verticalFOVTan;
-        float nearPlane;
-        float farPlane;
+                printf("memory block: type %u, %s%s, %llu KB, %d allocations, %llu KB used (%llu KB requested), largest free %llu KB, %.1f%% fragmented\n",
+                       b->memoryType, kinds[b->kind], b->dedicated ? " (dedicated)" : "", (unsigned long long) b->size / 1024, b->live,
+                       (unsigned long long) b->used / 1024, (unsigned long long) b->requested / 1024, (unsigned long long) largest / 1024,
+                       fragmentation * 100);
 
-        vec3 position = vec3(0, 0, 0);
-        mat4 rotation = mat4::I();
-        mat4 rotationInverse = mat4::I();
-        float speed = 10.0f;
-        float zoom = 0.0f;
+                total += b->size;
+                used += b->used;
+                live += b->live;
+            }
 
-        explicit Camera(const std::string &name,
-                        float aspectRatio,
-                        float verticalFOV,
-                        float nearPlane,
-                        float farPlane = std::numeric_limits<float>::infinity())
-        {
-            this->name = name;
-            this->aspectRatio = aspectRatio;
-            this->verticalFOV = verticalFOV;
-            this->nearPlane = nearPlane;
-            this->farPlane = farPlane;
-            this->computeTransform();
+            printf("device memory: %zu blocks, %d allocations, %llu of %llu KB used\n", blocks.size(), live,
+                   (unsigned long long) used / 1024, (unsigned long long) total / 1024);
         }
 
-        void computeTransform()
+        void destroy()
         {
-            if (farPlane == std::numeric_limits<float>::infinity())
-                this->perspectiveTransform = mat4::infinitePerspective(aspectRatio, verticalFOV + zoom, nearPlane);
-            else
-                this->perspectiveTransform = mat4::perspective(aspectRatio, verticalFOV + zoom, nearPlane, farPlane);
+            for (auto& b: blocks)
+            {
+                vkFreeMemory(renderer->device, b->memory, null);
+            }
 
-            this->verticalFOVScaled = verticalFOV + zoom;
-            this->verticalFOVTan = tan(verticalFOVScaled / 2);
+            blocks.clear();
         }
 
-        void updateTransform()
+        MemoryBlock* createBlock(u32 type, int kind, VkDeviceSize size, bool hostVisible)
         {
-            cameraUserOffsetTransform = rotation * mat4::translation(position * -1) * worldToCameraBaseTransform;
-            cameraPosTransform = cameraBaseToWorldTransform * mat4::translation(position) * rotationInverse;
-            fullTransform = perspectiveTransform * cameraUserOffsetTransform;
-        }
-    };
+            auto* b = blocks.emplace_back(std::make_unique<MemoryBlock>()).get();
+            b->size = size;
+            b->memoryType = type;
+            b->kind = kind;
 
-    static const int step = 0;
-    static const int linear = 1;
-    static const int slerp = 2;
+            VkMemoryAllocateInfo allocInfo {};
+            allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+            allocInfo.allocationSize = size;
+            allocInfo.memoryTypeIndex = type;
 
-    template<typename V>
-    struct Driver
-    {
-        std::string name;
-        std::vector<double> times;
-        std::vector<V> values;
-        int interpolation;
+            auto result = vkAllocateMemory(renderer->device, &allocInfo, null, &b->memory);
+            if (result != VK_SUCCESS)
+            {
+                printf("failed: %d\n", result);
+                blocks.pop_back();
+                throw std::runtime_error("memory allocation failed!");
+            }
 
-        Driver(const std::string &name, const std::vector<double> &times, const std::vector<V> &values, const std::string& interpolation)
-        {
-            this->name = name;
-            this->times = times;
-            this->values = values;
-            if (interpolation == "STEP")
-                this->interpolation = step;
-            else if (interpolation == "LINEAR")
-                this->interpolation = linear;
-            else if (interpolation == "SLERP")
-                this->interpolation = slerp;
+            if (hostVisible)
+            {
+                void* data;
+                vkMapMemory(renderer->device, b->memory, 0, VK_WHOLE_SIZE, 0, &data);
+                b->mapped = (char*) data;
+            }
+
+            if (size == blockSize && kind != memoryStaging)
+            {
+                b->freeChunks.resize(blockOrder + 1);
+                b->freeChunks[blockOrder].insert(0);
+            }
+
+            return b;
         }
 
-        V get(float time)
+        bool allocateFrom(MemoryBlock& b, const VkMemoryRequirements& req, DeviceAllocation& a)
         {
-            float beforeTime = -1;
-            V* before = null;
-            float afterTime = -1;
-            V* after = null;
-
-            for (int i = 0; i < times.size(); i++)
+            if (b.kind == memoryStaging)
             {
-                if (times[i] <= time)
-                {
-                    before = &(values[i]);
-                    beforeTime = times[i];
-                }
-                else
-                {
-                    after = &(values[i]);
-                    afterTime = times[i];
-                    break;
-                }
+                VkDeviceSize offset = (b.head + req.alignment - 1) / req.alignment * req.alignment;
+                if (offset + req.size > b.size)
+                    return false;
+
+                b.head = offset + req.size;
+                b.used = b.head;
+                b.live++;
+                b.requested += req.size;
+                place(a, &b, offset, req.size);
+                return true;
             }
 
-            if (after == null)
-                return *before;
-            else if (before == null)
-                return *after;
+            // Chunks are aligned to their own size, which covers the alignment required
+            int order = minOrder;
+            while (((VkDeviceSize) 1 << order) < std::max(req.size, req.alignment))
+                order++;
 
-            float frac = (time - beforeTime) / (afterTime - beforeTime);
+            int o = order;
+            while (o <= blockOrder && b.freeChunks[o].empty())
+                o++;
 
-            if (interpolation == step)
-                return *before;
-            else if (interpolation == linear)
-                return *before * (1 - frac) + *after * frac;
-            else
-            {
-                // adapted from glm: https://github.com/g-truc/glm/blob/master/glm/ext/quaternion_common.inl
-                double cosTheta = before->dot(*after);
-                V after2 = *after;
-                if (cosTheta < 0)
-                {
-                    cosTheta = -cosTheta;
-                    after2 = after2 * -1.0;
-                }
+            if (o > blockOrder)
+                return false;
 
-                if (cosTheta > 0.99999)
-                    return *before * (1 - frac) + after2 * frac;
-                else
-                {
-                    double angle = std::acos(cosTheta);
-                    return ((*before) * sin((1 - frac) * angle) + after2 * sin(frac * angle)) / sin(angle);
-                }
+            VkDeviceSize offset = *b.freeChunks[o].begin();
+            b.freeChunks[o].erase(b.freeChunks[o].begin());
+
+            // Splits off the upper halves until the chunk is the size needed
+            while (o > order)
+            {
+                o--;
+                b.freeChunks[o].insert(offset + ((VkDeviceSize) 1 << o));
             }
+
+            b.used += (VkDeviceSize) 1 << order;
+            b.live++;
+            b.requested += req.size;
+            place(a, &b, offset, req.size);
+            a.order = order;
+            return true;
+        }
+
+        static void place(DeviceAllocation& a, MemoryBlock* b, VkDeviceSize offset, VkDeviceSize size)
+        {
+            a.memory = b->memory;
+            a.offset = offset;
+            a.size = size;
+            a.block = b;
+            a.mapped = b->mapped != null ? b->mapped + offset : null;
         }
     };
 
-    struct Texture
+    // Uploads data to many device-local buffers with one staging buffer and one submission. Data is copied into
+    // the staging buffer as it is added, and the copies into the destination buffers are all recorded into one
+    // command buffer, which is submitted and waited for only when the staging buffer is full or on submit().
+    struct UploadBatch
     {
+        static const VkDeviceSize alignment = 16;
+
         Renderer* renderer;
+        VkDeviceSize capacity;
+        VkDeviceSize used = 0;
 
-        bool isCube = false;
-        bool exponential = false;
-        std::vector<unsigned char*> data;
-        std::vector<float*> dataFloat;
-        int width;
-        int height;
-        int channels;
+        VkBuffer staging = VK_NULL_HANDLE;
+        DeviceAllocation stagingMemory;
+        char* mapped = null;
 
-        bool initialized = false;
-        VkImage image;
-        VkDeviceMemory imageMemory;
-        VkImageView imageView;
-        VkSampler sampler;
+        std::vector<std::pair<VkBuffer, VkBufferCopy>> copies;
 
-        Texture(Renderer* r, vec3 data, bool cube = false, unsigned char alpha = 255)
+        // The staging buffer holds capacity bytes, so no single add() can be larger than that
+        UploadBatch(Renderer* r, VkDeviceSize capacity)
         {
             this->renderer = r;
-            this->isCube = cube;
-            this->exponential = false;
-
-            int q = cube ? 6 : 1;
-            this->data.emplace_back(new unsigned char[4 * q]);
+            this->capacity = capacity;
 
-            for (int i = 0; i < q; i++)
+            if (capacity > 0)
             {
-                this->data[0][i * 4 + 0] = (unsigned char) (255 * data.x);
-                this->data[0][i * 4 + 1] = (unsigned char) (255 * data.y);
-                this->data[0][i * 4 + 2] = (unsigned char) (255 * data.z);
-                this->data[0][i * 4 + 3] = alpha;
+                renderer->createBuffer(capacity, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, staging, stagingMemory);
+
+                mapped = (char*) stagingMemory.mapped;
             }
+        }
 
-            this->width = 1;
-            this->height = q;
+        UploadBatch(const UploadBatch&) = delete;
+        UploadBatch& operator=(const UploadBatch&) = delete;
 
-            initTexture();
+        void add(VkBuffer destination, const void* data, VkDeviceSize size, VkDeviceSize destinationOffset = 0)
+        {
+            memcpy(reserve(destination, size, destinationOffset), data, size);
         }
 
-        Texture(Renderer* r, jobject* o, int mipmapCount = 1, std::string suffix = "")
+        // Like add(), but returns the staging memory for the caller to fill in before the next add() or reserve()
+        void* reserve(VkBuffer destination, VkDeviceSize size, VkDeviceSize destinationOffset = 0)
         {
-            assert(o);
-            this->renderer = r;
-            std::string src = jstring::cast((*o)["src"])->value + suffix;
-            if ((*o)["type"] != null)
-                isCube = jstring::cast((*o)["type"])->value == "cube";
-            if ((*o)["format"] != null)
-                exponential = jstring::cast((*o)["format"])->value == "rgbe";
+            assert(size <= capacity);
 
-            data.emplace_back(stbi_load(src.c_str(), &width, &height, &channels, STBI_rgb_alpha));
-            if (!data[0])
-            {
-                printf("source: %s\n", src.c_str());
-                throw std::runtime_error("failed to create image!");
-            }
+            if (used + size > capacity)
+                submit();
 
-            for (int i = 0; i < mipmapCount - 1; i++)
-            {
-                int w;
-                int h;
-                data.emplace_back(stbi_load((src + "." + std::to_string(i) + ".png").c_str(), &w, &h, &channels, STBI_rgb_alpha));
-                if (!data[i + 1])
-                    throw std::runtime_error("failed to create image mipmap!");
-            }
+            VkBufferCopy region {};
+            region.srcOffset = used;
+            region.dstOffset = destinationOffset;
+            region.size = size;
+            copies.emplace_back(destination, region);
 
-            initTexture();
+            void* p = mapped + used;
+            used = (used + size + alignment - 1) / alignment * alignment;
+            return p;
         }
 
-        void createTextureImage()
+        void submit()
         {
-            VkDeviceSize imageSize = this->width * this->height * 4 * sizeof(float);
+            if (copies.empty())
+                return;
 
-            renderer->createImage(this->width, this->height, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, this->image, this->imageMemory, this->dataFloat.size(), isCube);
-            renderer->transitionImageLayout(this->image, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, this->dataFloat.size(), isCube);
+            VkCommandBuffer commandBuffer = renderer->beginSingleTimeCommands();
 
-            u32 w = this->width;
-            u32 h = this->height;
-            for (int i = 0; i < this->dataFloat.size(); i++)
+            for (auto& [destination, region]: copies)
             {
-                VkBuffer stagingBuffer;
-                VkDeviceMemory stagingBufferMemory;
-                renderer->createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                                       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                                       stagingBuffer, stagingBufferMemory);
+                vkCmdCopyBuffer(commandBuffer, staging, destination, 1, &region);
+            }
 
-                void *data;
-                vkMapMemory(renderer->device, stagingBufferMemory, 0, imageSize, 0, &data);
-                memcpy(data, this->dataFloat[i], static_cast<size_t>(imageSize));
-                vkUnmapMemory(renderer->device, stagingBufferMemory);
+            renderer->endSingleTimeCommands(commandBuffer);
 
-                renderer->copyBufferToImage(stagingBuffer, this->image, w, h, i, isCube);
-                vkDestroyBuffer(renderer->device, stagingBuffer, null);
-                vkFreeMemory(renderer->device, stagingBufferMemory, null);
+            copies.clear();
+            used = 0;
+        }
 
-                w /= 2;
-                h /= 2;
-            }
+        ~UploadBatch()
+        {
+            vkDestroyBuffer(renderer->device, staging, null);
+            renderer->freeMemory(stagingMemory);
+        }
+    };
 
-            renderer->transitionImageLayout(this->image, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, this->dataFloat.size(), isCube);
+    // One device-local buffer holding the vertices of every mesh with the same vertex layout, so that drawing them
+    // never rebinds vertex buffers. Each mesh draws from its firstVertex within the buffer, and indexed meshes from
+    // their firstIndex within the pool's index buffer.
+    struct VertexPool
+    {
+        Renderer* renderer;
+        u32 stride;
+        VkDeviceSize size = 0;
+        VkDeviceSize used = 0;
+        VkDeviceSize indexSize = 0;
+        VkDeviceSize indexUsed = 0;
+
+        VkBuffer buffer = VK_NULL_HANDLE;
+        DeviceAllocation memory;
+        VkBuffer indexBuffer = VK_NULL_HANDLE;
+        DeviceAllocation indexMemory;
+
+        VertexPool(Renderer* r, u32 stride, VkDeviceSize size, VkDeviceSize indexSize)
+        {
+            this->renderer = r;
+            this->stride = stride;
+            this->size = size;
+            this->indexSize = indexSize;
+
+            renderer->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, memory);
+
+            if (indexSize > 0)
+                renderer->createBuffer(indexSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexMemory);
         }
 
-        void createTextureImageView()
+        VertexPool(const VertexPool&) = delete;
+        VertexPool& operator=(const VertexPool&) = delete;
+
+        // Returns the offset of the bytes taken, which is always a whole number of vertices
+        VkDeviceSize take(VkDeviceSize bytes)
         {
-            this->imageView = renderer->createImageView(this->image, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT, this->dataFloat.size(), isCube);
+            assert(used + bytes <= size && bytes % stride == 0);
+
+            VkDeviceSize offset = used;
+            used += bytes;
+            return offset;
         }
 
-        void createTextureSampler()
+        VkDeviceSize takeIndices(VkDeviceSize bytes)
         {
-            VkPhysicalDeviceProperties properties {};
-            vkGetPhysicalDeviceProperties(renderer->physicalDevice, &properties);
+            assert(indexUsed + bytes <= indexSize && bytes % sizeof(u32) == 0);
 
-            VkSamplerCreateInfo samplerInfo {};
-            samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-            samplerInfo.magFilter = VK_FILTER_LINEAR;
-            samplerInfo.minFilter = VK_FILTER_LINEAR;
-            samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-            samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-            samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
-            samplerInfo.anisotropyEnable = VK_TRUE;
-            samplerInfo.maxAnisotropy = properties.limits.maxSamplerAnisotropy;
-            samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
-            samplerInfo.unnormalizedCoordinates = VK_FALSE;
-            samplerInfo.compareEnable = VK_FALSE;
-            samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
-            samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
-            samplerInfo.minLod = 0.0f;
-            samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+            VkDeviceSize offset = indexUsed;
+            indexUsed += bytes;
+            return offset;
+        }
 
-            auto result = vkCreateSampler(renderer->device, &samplerInfo, null, &(this->sampler));
+        ~VertexPool()
+        {
+            vkDestroyBuffer(renderer->device, buffer, null);
+            renderer->freeMemory(memory);
 
-            if (result != VK_SUCCESS)
+            if (indexSize > 0)
             {
-                printf("failed: %d\n", result);
-                throw std::runtime_error("texture sampler creation failed!");
+                vkDestroyBuffer(renderer->device, indexBuffer, null);
+                renderer->freeMemory(indexMemory);
             }
         }
+    };
 
-        void convertTexture()
-        {
-            for (int m = 0; m < data.size(); m++)
-            {
-                this->dataFloat.emplace_back(new float[this->width * this->height * 4]);
-                for (int i = 0; i < this->width * this->height; i++)
-                {
-                    unsigned char r = this->data[m][i * 4];
-                    unsigned char g = this->data[m][i * 4 + 1];
-                    unsigned char b = this->data[m][i * 4 + 2];
+    // Scenes with more geometry than this are uploaded in several submissions
+    static constexpr VkDeviceSize maxUploadBatchSize = 256 << 20;
+
+    struct Material;
+
+    struct Mesh
+    {
+        Renderer* renderer;
+
+        std::string name;
+        size_t count;
+        VkPrimitiveTopology topology;
+        // Only set for a topology of TRIANGLE_LIST, as topology is left unset for topologies that are not recognized
+        bool triangleList = false;
+        std::map<std::string, Attribute> attributes;
+        Material* material;
+
+        vec3 corners[2][2][2];
+
+        VkBuffer buffer = VK_NULL_HANDLE;
+        DeviceAllocation bufferMemory;
+
+        // Set if the vertices are in a shared buffer rather than one of the mesh's own
+        VertexPool* pool = null;
+        u32 firstVertex = 0;
+
+        // Triangle lists are drawn through an index buffer over their distinct vertices (see prepare). Until
+        // initialize() uploads them, indices and the vertex each index refers to are kept here.
+        bool indexed = false;
+        u32 vertexCount = 0;
+        u32 indexCount = 0;
+        u32 firstIndex = 0;
+        std::vector<u32> indices;
+        std::vector<u32> vertexSources;
+
+        VkBuffer indexBuffer = VK_NULL_HANDLE;
+        DeviceAllocation indexBufferMemory;
+
+        // Undoes the normalization of packed positions to the mesh's bounds
+        vec3 positionScale = vec3(1, 1, 1);
+        vec3 positionOffset = vec3(0, 0, 0);
+
+        Mesh(Renderer* t, std::string name, size_t count, const std::string& topology)
+        {
+            this->material = &(t->defaultMaterial);
+            this->name = name;
+            this->count = count;
+
+            if (topology == "POINT_LIST")
+                this->topology = VK_PRIMITIVE_TOPOLOGY_POINT_LIST;
+            else if (topology == "LINE_LIST")
+                this->topology = VK_PRIMITIVE_TOPOLOGY_LINE_LIST;
+            else if (topology == "LINE_STRIP")
+                this->topology = VK_PRIMITIVE_TOPOLOGY_LINE_STRIP;
+            else if (topology == "TRIANGLE_LIST")
+            {
+                this->topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+                this->triangleList = true;
+            }
+            else if (topology == "TRIANGLE_STRIP")
+                this->topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP;
+            else if (topology == "TRIANGLE_FAN")
+                this->topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_FAN;
+            else if (topology == "LINE_LIST_WITH_ADJACENCY")
+                this->topology = VK_PRIMITIVE_TOPOLOGY_LINE_LIST_WITH_ADJACENCY;
+            else if (topology == "LINE_STRIP_WITH_ADJACENCY")
+                this->topology = VK_PRIMITIVE_TOPOLOGY_LINE_STRIP_WITH_ADJACENCY;
+            else if (topology == "TRIANGLE_LIST_WITH_ADJACENCY")
+                this->topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST_WITH_ADJACENCY;
+            else if (topology == "TRIANGLE_STRIP_WITH_ADJACENCY")
+                this->topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_STRIP_WITH_ADJACENCY;
+            else if (topology == "PATCH_LIST")
+                this->topology = VK_PRIMITIVE_TOPOLOGY_PATCH_LIST;
+
+            renderer = t;
+        }
+
+        // The bytes of the mesh's vertices in its file
+        VkDeviceSize size()
+        {
+            return attributes.at("POSITION").stride * count;
+        }
+
+        // The bytes uploaded for the mesh, which are fewer than size() once prepare() has indexed or packed it
+        VkDeviceSize vertexBytes()
+        {
+            return this->material->type->stride * vertexCount;
+        }
+
+        VkDeviceSize indexBytes()
+        {
+            return indexed ? indices.size() * sizeof(u32) : 0;
+        }
+
+        // Checks the mesh's file, finds its bounds and, for triangle lists, builds an index buffer over its distinct
+        // vertices, ordered for the post-transform vertex cache and then for vertex fetch. Called for every mesh
+        // before any is initialized, so that the upload and the pools can be sized for the indexed meshes.
+        void prepare()
+        {
+            VkDeviceSize size = this->size();
+            Attribute pos = attributes.at("POSITION");
+
+            if (size > pos.file->size)
+            {
+                printf("mesh %s needs %llu bytes but its file has %zu\n", name.c_str(), (unsigned long long) size, pos.file->size);
+                throw std::runtime_error("reading mesh data failed!");
+            }
+
+            if (this->material->type->packed && pos.stride != sizeof(ComplexVertex))
+            {
+                printf("mesh %s has a stride of %zu, but only %zu byte vertices can be packed\n", name.c_str(), pos.stride, sizeof(ComplexVertex));
+                throw std::runtime_error("reading mesh data failed!");
+            }
+
+            // Unpacked vertices are uploaded as they are in the file, so its records have to be the material's vertices
+            if (!this->material->type->packed && pos.stride != this->material->type->stride)
+            {
+                printf("mesh %s has a stride of %zu, but its material takes %u byte vertices\n", name.c_str(), pos.stride, this->material->type->stride);
+                throw std::runtime_error("reading mesh data failed!");
+            }
+
+            // Read from the mapping here and again by initialize(), paging the file in as it goes
+            pos.file->advise(0, size, MADV_WILLNEED);
+
+            const char* datac = (const char*) pos.data;
+            float minX = std::numeric_limits<float>::infinity();
+            float minY = std::numeric_limits<float>::infinity();;
+            float minZ = std::numeric_limits<float>::infinity();;
+
+            float maxX = -std::numeric_limits<float>::infinity();;
+            float maxY = -std::numeric_limits<float>::infinity();;
+            float maxZ = -std::numeric_limits<float>::infinity();;
+            for (size_t i = pos.offset; i < size; i += pos.stride)
+            {
+                float x = *((const float*) (&(datac[i])));
+                float y = *((const float*) (&(datac[i + sizeof(float)])));
+                float z = *((const float*) (&(datac[i + sizeof(float) * 2])));
+
+                if (x < minX)
+                    minX = x;
+
+                if (y < minY)
+                    minY = y;
+
+                if (z < minZ)
+                    minZ = z;
+
+                if (x > maxX)
+                    maxX = x;
+
+                if (y > maxY)
+                    maxY = y;
+
+                if (z > maxZ)
+                    maxZ = z;
+            }
+
+            if (renderer->enableCulling)
+            {
+                for (int i = 0; i < 2; i++)
+                {
+                    for (int j = 0; j < 2; j++)
+                    {
+                        for (int k = 0; k < 2; k++)
+                        {
+                            this->corners[i][j][k] = vec3(i == 0 ? minX : maxX,
+                                                          j == 0 ? minY : maxY,
+                                                          k == 0 ? minZ : maxZ);
+                        }
+                    }
+                }
+            }
+
+            if (this->material->type->packed)
+            {
+                // An empty extent keeps its positions exact, as every one of them is the offset
+                positionOffset = vec3(minX, minY, minZ);
+                positionScale = vec3(maxX > minX ? maxX - minX : 1, maxY > minY ? maxY - minY : 1, maxZ > minZ ? maxZ - minZ : 1);
+            }
+
+            vertexCount = (u32) count;
+            if (renderer->generateIndices && triangleList && count > 0 && count % 3 == 0)
+            {
+                vertexCount = deduplicateVertices(datac, pos.stride, count, indices, vertexSources);
+                optimizeVertexCache(indices, vertexCount);
+                optimizeVertexFetch(indices, vertexSources);
+                indexed = true;
+            }
+        }
+
+        // Adds the vertices, and the indices if there are any, to the batch, which has to be submitted before drawing.
+        // They go into the pool if one is given, or else into buffers of the mesh's own.
+        void initialize(UploadBatch& batch, VertexPool* pool = null)
+        {
+            VkDeviceSize size = this->vertexBytes();
+            Attribute pos = attributes.at("POSITION");
+
+            if (pool != null)
+            {
+                VkDeviceSize offset = pool->take(size);
+                this->pool = pool;
+                this->buffer = pool->buffer;
+                this->firstVertex = (u32) (offset / pool->stride);
+            }
+            else
+                renderer->createBuffer(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, buffer, bufferMemory);
+
+            VkDeviceSize offset = (VkDeviceSize) firstVertex * this->material->type->stride;
+            if (indexed || this->material->type->packed)
+            {
+                // The vertices are gathered, and packed if need be, from the mapping straight into staging memory
+                char* staging = (char*) batch.reserve(buffer, size, offset);
+                for (size_t v = 0; v < vertexCount; v++)
+                {
+                    const char* source = (const char*) pos.data + (indexed ? vertexSources[v] : v) * pos.stride;
+
+                    if (this->material->type->packed)
+                    {
+                        ComplexVertex vertex;
+                        memcpy(&vertex, source, sizeof(vertex));
+                        PackedVertex packed (vertex, positionOffset, positionScale);
+                        memcpy(staging + v * sizeof(packed), &packed, sizeof(packed));
+                    }
+                    else
+                        memcpy(staging + v * this->material->type->stride, source, this->material->type->stride);
+                }
+            }
+            else
+                batch.add(buffer, pos.data, size, offset);
+
+            if (indexed)
+            {
+                if (pool != null)
+                {
+                    VkDeviceSize indexOffset = pool->takeIndices(indexBytes());
+                    this->indexBuffer = pool->indexBuffer;
+                    this->firstIndex = (u32) (indexOffset / sizeof(u32));
+                }
+                else
+                    renderer->createBuffer(indexBytes(), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, indexBuffer, indexBufferMemory);
+
+                batch.add(indexBuffer, indices.data(), indexBytes(), (VkDeviceSize) firstIndex * sizeof(u32));
+
+                indexCount = (u32) indices.size();
+                std::vector<u32>().swap(indices);
+                std::vector<u32>().swap(vertexSources);
+            }
+
+            // The staging copy is the one used from now on
+            pos.file->advise(0, this->size(), MADV_DONTNEED);
+        }
+
+        void draw(VkCommandBuffer commandBuffer, mat4 m)
+        {
+            GraphicsPipeline* pipeline = this->material->type->getPipeline(renderer->scene);
+
+            if (renderer->currentMaterialType != this->material->type)
+            {
+                renderer->currentMaterialType = this->material->type;
+                vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->pipeline);
+            }
+
+            if (renderer->currentVertexBuffer != buffer)
+            {
+                renderer->currentVertexBuffer = buffer;
+
+                VkBuffer vertexBuffers[] = { buffer };
+                VkDeviceSize offsets[] = { 0 };
+                vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+            }
+
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->layout,
+                                    0, 1, &(renderer->globalDescriptorSets[renderer->currentFrame]), 0, null);
+            vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline->layout,
+                                    1, 1, &(material->descriptorSets[renderer->currentFrame]), 0, null);
+
+            renderer->updatePushConstants(m, renderer->currentFrame, positionScale, positionOffset);
+
+            if (indexed)
+            {
+                if (renderer->currentIndexBuffer != indexBuffer)
+                {
+                    renderer->currentIndexBuffer = indexBuffer;
+                    vkCmdBindIndexBuffer(commandBuffer, indexBuffer, 0, VK_INDEX_TYPE_UINT32);
+                }
+
+                vkCmdDrawIndexed(commandBuffer, indexCount, 1, firstIndex, (int32_t) firstVertex, 0);
+            }
+            else
+                vkCmdDraw(commandBuffer, count, 1, firstVertex, 0);
+        }
+
+        ~Mesh()
+        {
+            if (pool == null)
+            {
+                vkDestroyBuffer(renderer->device, buffer, null);
+                renderer->freeMemory(bufferMemory);
+
+                if (indexed)
+                {
+                    vkDestroyBuffer(renderer->device, indexBuffer, null);
+                    renderer->freeMemory(indexBufferMemory);
+                }
+            }
+        }
+    };
+
+    struct Camera
+    {
+        std::string name;
+
+        // Frustum projection
+        mat4 perspectiveTransform = mat4::I();
+        // Derived from node scene graph transform
+        mat4 worldToCameraBaseTransform = mat4::I();
+        mat4 cameraBaseToWorldTransform = mat4::I();
+        // Controlled by the user
+        mat4 cameraUserOffsetTransform = mat4::I();
+        mat4 cameraPosTransform = mat4::I();
+        // Everything
+        mat4 fullTransform;
+
+        float aspectRatio;
+        float verticalFOV;
+        float verticalFOVScaled;
+        float verticalFOVTan;
+        float nearPlane;
+        float farPlane;
+
+        vec3 position = vec3(0, 0, 0);
+        mat4 rotation = mat4::I();
+        mat4 rotationInverse = mat4::I();
+        float speed = 10.0f;
+        float zoom = 0.0f;
+
+        explicit Camera(const std::string &name,
+                        float aspectRatio,
+                        float verticalFOV,
+                        float nearPlane,
+                        float farPlane = std::numeric_limits<float>::infinity())
+        {
+            this->name = name;
+            this->aspectRatio = aspectRatio;
+            this->verticalFOV = verticalFOV;
+            this->nearPlane = nearPlane;
+            this->farPlane = farPlane;
+            this->computeTransform();
+        }
+
+        void computeTransform()
+        {
+            if (farPlane == std::numeric_limits<float>::infinity())
+                this->perspectiveTransform = mat4::infinitePerspective(aspectRatio, verticalFOV + zoom, nearPlane);
+            else
+                this->perspectiveTransform = mat4::perspective(aspectRatio, verticalFOV + zoom, nearPlane, farPlane);
+
+            this->verticalFOVScaled = verticalFOV + zoom;
+            this->verticalFOVTan = tan(verticalFOVScaled / 2);
+        }
+
+        void updateTransform()
+        {
+            cameraUserOffsetTransform = rotation * mat4::translation(position * -1) * worldToCameraBaseTransform;
+            cameraPosTransform = cameraBaseToWorldTransform * mat4::translation(position) * rotationInverse;
+            fullTransform = perspectiveTransform * cameraUserOffsetTransform;
+        }
+    };
+
+    static const int step = 0;
+    static const int linear = 1;
+    static const int slerp = 2;
+
+    template<typename V>
+    struct Driver
+    {
+        std::string name;
+        std::vector<double> times;
+        std::vector<V> values;
+        int interpolation;
+
+        Driver(const std::string &name, std::vector<double> times, std::vector<V> values, const std::string& interpolation)
+        {
+            this->name = name;
+            this->times = std::move(times);
+            this->values = std::move(values);
+            if (interpolation == "STEP")
+                this->interpolation = step;
+            else if (interpolation == "LINEAR")
+                this->interpolation = linear;
+            else if (interpolation == "SLERP")
+                this->interpolation = slerp;
+        }
+    };
+
+    // Either a constant color or an image file, as given for a material or environment in the s72 file
+    struct TextureSource
+    {
+        bool constant = true;
+        vec3 color = vec3(0, 0, 0);
+        std::string_view src;
+        bool cube = false;
+        bool rgbe = false;
+    };
+
+    struct Texture
+    {
+        Renderer* renderer;
+
+        bool isCube = false;
+        bool exponential = false;
+
+        // For textures read from image files, which are only decoded by load()
+        std::string src;
+        int mipmapCount = 1;
+
+        std::vector<unsigned char*> data;
+        std::vector<float*> dataFloat;
+        int width;
+        int height;
+        int channels;
+
+        bool initialized = false;
+        VkImage image;
+        DeviceAllocation imageMemory;
+        VkImageView imageView;
+        VkSampler sampler;
+
+        // Textures can be shared between materials and environments, so their holders release them instead of
+        // deleting them. A new texture starts with one reference.
+        int references = 1;
+
+        Texture* acquire()
+        {
+            references++;
+            return this;
+        }
+
+        static void release(Texture* t)
+        {
+            if (t != null && --t->references == 0)
+                delete t;
+        }
+
+        // Constant textures store each channel of their color as this byte
+        static unsigned char channel(float f)
+        {
+            return (unsigned char) (255 * f);
+        }
+
+        Texture(Renderer* r, vec3 data, bool cube = false, unsigned char alpha = 255)
+        {
+            this->renderer = r;
+            this->isCube = cube;
+            this->exponential = false;
+
+            int q = cube ? 6 : 1;
+            this->data.emplace_back(new unsigned char[4 * q]);
+
+            for (int i = 0; i < q; i++)
+            {
+                this->data[0][i * 4 + 0] = channel(data.x);
+                this->data[0][i * 4 + 1] = channel(data.y);
+                this->data[0][i * 4 + 2] = channel(data.z);
+                this->data[0][i * 4 + 3] = alpha;
+            }
+
+            this->width = 1;
+            this->height = q;
+
+            initTexture();
+        }
+
+        // The image is not read until load() and upload() are called, so that the files of many textures can be
+        // decoded at once (see loadTextures)
+        Texture(Renderer* r, const TextureSource& source, int mipmapCount = 1, std::string suffix = "")
+        {
+            assert(!source.constant);
+            this->renderer = r;
+            this->isCube = source.cube;
+            this->exponential = source.rgbe;
+            this->src = std::string(source.src) + suffix;
+            this->mipmapCount = mipmapCount;
+        }
+
+        // Decodes the image files and converts them to floats. Only this texture is touched, so textures can be
+        // loaded on any thread.
+        void load()
+        {
+            data.emplace_back(stbi_load(src.c_str(), &width, &height, &channels, STBI_rgb_alpha));
+            if (!data[0])
+            {
+                printf("source: %s\n", src.c_str());
+                throw std::runtime_error("failed to create image!");
+            }
+
+            for (int i = 0; i < mipmapCount - 1; i++)
+            {
+                int w;
+                int h;
+                data.emplace_back(stbi_load((src + "." + std::to_string(i) + ".png").c_str(), &w, &h, &channels, STBI_rgb_alpha));
+                if (!data[i + 1])
+                    throw std::runtime_error("failed to create image mipmap!");
+            }
+
+            convertTexture();
+        }
+
+        void createTextureImage()
+        {
+            VkDeviceSize imageSize = this->width * this->height * 4 * sizeof(float);
+
+            renderer->createImage(this->width, this->height, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, this->image, this->imageMemory, this->dataFloat.size(), isCube);
+            renderer->transitionImageLayout(this->image, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, this->dataFloat.size(), isCube);
+
+            u32 w = this->width;
+            u32 h = this->height;
+            for (int i = 0; i < this->dataFloat.size(); i++)
+            {
+                VkBuffer stagingBuffer;
+                DeviceAllocation stagingBufferMemory;
+                renderer->createBuffer(imageSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                       stagingBuffer, stagingBufferMemory);
+
+                memcpy(stagingBufferMemory.mapped, this->dataFloat[i], static_cast<size_t>(imageSize));
+
+                renderer->copyBufferToImage(stagingBuffer, this->image, w, h, i, isCube);
+                vkDestroyBuffer(renderer->device, stagingBuffer, null);
+                renderer->freeMemory(stagingBufferMemory);
+
+                w /= 2;
+                h /= 2;
+            }
+
+            renderer->transitionImageLayout(this->image, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, this->dataFloat.size(), isCube);
+        }
+
+        void createTextureImageView()
+        {
+            this->imageView = renderer->createImageView(this->image, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_ASPECT_COLOR_BIT, this->dataFloat.size(), isCube);
+        }
+
+        void createTextureSampler()
+        {
+            VkPhysicalDeviceProperties properties {};
+            vkGetPhysicalDeviceProperties(renderer->physicalDevice, &properties);
+
+            VkSamplerCreateInfo samplerInfo {};
+            samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+            samplerInfo.magFilter = VK_FILTER_LINEAR;
+            samplerInfo.minFilter = VK_FILTER_LINEAR;
+            samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+            samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+            samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+            samplerInfo.anisotropyEnable = VK_TRUE;
+            samplerInfo.maxAnisotropy = properties.limits.maxSamplerAnisotropy;
+            samplerInfo.borderColor = VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+            samplerInfo.unnormalizedCoordinates = VK_FALSE;
+            samplerInfo.compareEnable = VK_FALSE;
+            samplerInfo.compareOp = VK_COMPARE_OP_ALWAYS;
+            samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+            samplerInfo.minLod = 0.0f;
+            samplerInfo.maxLod = VK_LOD_CLAMP_NONE;
+
+            auto result = vkCreateSampler(renderer->device, &samplerInfo, null, &(this->sampler));
+
+            if (result != VK_SUCCESS)
+            {
+                printf("failed: %d\n", result);
+                throw std::runtime_error("texture sampler creation failed!");
+            }
+        }
+
+        void convertTexture()
+        {
+            for (int m = 0; m < data.size(); m++)
+            {
+                this->dataFloat.emplace_back(new float[this->width * this->height * 4]);
+                for (int i = 0; i < this->width * this->height; i++)
+                {
+                    unsigned char r = this->data[m][i * 4];
+                    unsigned char g = this->data[m][i * 4 + 1];
+                    unsigned char b = this->data[m][i * 4 + 2];
                     unsigned char a = this->data[m][i * 4 + 3];
 
-                    if (exponential)
+                    if (exponential)
+                    {
+                        auto e = (float) pow(2, (int) a - 128);
+
+                        if (r == 0 && g == 0 && b == 0 && a == 0)
+                            e = 0;
+
+                        this->dataFloat[m][i * 4] = ((float) r + 0.5f) / 256 * e;
+                        this->dataFloat[m][i * 4 + 1] = ((float) g + 0.5f) / 256 * e;
+                        this->dataFloat[m][i * 4 + 2] = ((float) b + 0.5f) / 256 * e;
+
+                        this->dataFloat[m][i * 4 + 3] = 1.0f;
+                    }
+                    else
+                    {
+                        this->dataFloat[m][i * 4] = (float) r / 255.0f;
+                        this->dataFloat[m][i * 4 + 1] = (float) g / 255.0f;
+                        this->dataFloat[m][i * 4 + 2] = (float) b / 255.0f;
+                        this->dataFloat[m][i * 4 + 3] = (float) a / 255.0f;
+                    }
+                }
+
+                stbi_image_free(data[m]);
+            }
+        }
+
+        void initTexture()
+        {
+            convertTexture();
+            upload();
+        }
+
+        // Creates the image from the converted data, which is freed afterward
+        void upload()
+        {
+            assert (!initialized);
+            createTextureImage();
+            createTextureImageView();
+            createTextureSampler();
+
+            for (int i = 0; i < dataFloat.size(); i++)
+            {
+                delete dataFloat[i];
+            }
+
+            initialized = true;
+        }
+
+        ~Texture()
+        {
+            vkDestroySampler(renderer->device, sampler, null);
+            vkDestroyImageView(renderer->device, imageView, null);
+
+            vkDestroyImage(renderer->device, image, null);
+            renderer->freeMemory(imageMemory);
+        }
+    };
+
+    struct Environment
+    {
+        std::string name;
+        Texture* texturePBR;
+        Texture* textureLambertian;
+        mat4 worldToEnvironmentTransform = mat4::I();
+
+        Environment(std::string name, Texture* texPBR, Texture* texLam)
+        {
+            this->name = name;
+            this->texturePBR = texPBR;
+            this->textureLambertian = texLam;
+        }
+
+        ~Environment()
+        {
+            Texture::release(texturePBR);
+            Texture::release(textureLambertian);
+        }
+    };
+
+    struct Scene;
+    struct MaterialType;
+
+    static std::vector<MaterialType*> materialTypes;
+
+    struct MaterialType
+    {
+        GraphicsPipeline pipeline;
+        GraphicsPipeline shadowMapPipeline;
+
+        GraphicsPipeline* getPipeline(bool shadow)
+        {
+            if (shadow)
+                return &shadowMapPipeline;
+            else
+                return &pipeline;
+        }
+
+        GraphicsPipeline* getPipeline(Scene* scene)
+        {
+            return getPipeline(scene->drawingShadow);
+        }
+
+        u32 stride;
+        // Set if the pipelines take PackedVertex, which meshes then convert their vertices to as they upload them
+        bool packed = false;
+
+        VkDescriptorPool descriptorPool;
+        VkDescriptorSetLayout descriptorSetLayout;
+
+        int textures;
+        int instances = 0;
+
+        MaterialType(int textures)
+        {
+            materialTypes.emplace_back(this);
+            this->textures = textures;
+        }
+
+        void createDescriptorPool(VkDevice &device)
+        {
+            VkDescriptorPoolCreateInfo poolInfo {};
+
+            std::vector<VkDescriptorPoolSize> poolSizes (1);
+
+            int i = 1;
+            if (instances > 0)
+                i = instances;
+
+            poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+            poolSizes[0].descriptorCount = static_cast<uint32_t>(max_frames_in_flight * i);
+
+            if (textures > 0)
+            {
+                poolSizes.resize(2);
+                poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+                poolSizes[1].descriptorCount = static_cast<uint32_t>(max_frames_in_flight * textures * i);
+            }
+
+            poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+            poolInfo.pPoolSizes = poolSizes.data();
+            poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+            poolInfo.maxSets = static_cast<uint32_t>(max_frames_in_flight * i);
+
+            auto result = vkCreateDescriptorPool(device, &poolInfo, null, &descriptorPool);
+            if (result != VK_SUCCESS)
+            {
+                printf("failed: %d\n", result);
+                throw std::runtime_error("descriptor pool creation failed!");
+            }
+        }
+
+        void createDescriptorSetLayout(VkDevice &device)
+        {
+            std::vector<VkDescriptorSetLayoutBinding> bindings(0);
+
+            if (textures > 0)
+            {
+                VkDescriptorSetLayoutBinding samplerLayoutBinding{};
+                samplerLayoutBinding.binding = 0;
+                samplerLayoutBinding.descriptorCount = textures;
+                samplerLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+                samplerLayoutBinding.pImmutableSamplers = null;
+                samplerLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+                bindings.emplace_back(samplerLayoutBinding);
+            }
+
+            VkDescriptorSetLayoutCreateInfo layoutInfo {};
+            layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+            layoutInfo.bindingCount = bindings.size();
+            layoutInfo.pBindings = bindings.data();
+
+//                VkDescriptorSetLayoutBinding uboLayoutBinding{};
+//                uboLayoutBinding.binding = 0;
+//                uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+//                uboLayoutBinding.descriptorCount = 1;
+//                uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+            auto result = vkCreateDescriptorSetLayout(device, &layoutInfo, null, &descriptorSetLayout);
+            if (result != VK_SUCCESS)
+            {
+                printf("failed: %d\n", result);
+                throw std::runtime_error("descriptor set layout failed!");
+            }
+        }
+    };
+
+    static MaterialType materialTypeSimple;
+    static MaterialType materialTypePBR;
+    static MaterialType materialTypeSSR;
+    static MaterialType materialTypeLambertian;
+    static MaterialType materialTypeMirror;
+    static MaterialType materialTypeEnvironment;
+
+    struct Material
+    {
+        std::string name;
+        MaterialType* type;
+        Texture* normalMap = null;
+
+        std::vector<VkDescriptorSet> descriptorSets;
+
+        virtual void createDescriptorSets(VkDevice &device)
+        {
+            std::vector<VkDescriptorSetLayout> layouts(max_frames_in_flight, type->descriptorSetLayout);
+            VkDescriptorSetAllocateInfo allocInfo{};
+            allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+            allocInfo.descriptorPool = type->descriptorPool;
+            allocInfo.descriptorSetCount = static_cast<u32>(max_frames_in_flight);
+            allocInfo.pSetLayouts = layouts.data();
+
+            descriptorSets.resize(max_frames_in_flight);
+            auto result = vkAllocateDescriptorSets(device, &allocInfo, descriptorSets.data());
+            if (result != VK_SUCCESS)
+            {
+                printf("failed: %d\n", result);
+                throw std::runtime_error("descriptor sets creation failed!");
+            }
+        }
+
+        virtual ~Material()
+        {
+            Texture::release(normalMap);
+        }
+    };
+
+    struct MaterialSimple : Material
+    {
+        MaterialSimple()
+        {
+            this->type = &materialTypeSimple;
+        }
+
+        void createDescriptorSets(VkDevice &device) override
+        {
+            Material::createDescriptorSets(device);
+            for (size_t i = 0; i < max_frames_in_flight; i++)
+            {
+                std::array<VkWriteDescriptorSet, 0> descriptorWrites {};
+                vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, null);
+            }
+        }
+    };
+
+    struct MaterialPBR : Material
+    {
+        Texture* albedoTex = null;
+        Texture* roughnessTex = null;
+        Texture* metalnessTex = null;
+
+        MaterialPBR()
+        {
+            this->type = &materialTypePBR;
+        }
+
+        ~MaterialPBR() override
+        {
+            Texture::release(albedoTex);
+            Texture::release(roughnessTex);
+            Texture::release(metalnessTex);
+        }
+
+        void createDescriptorSets(VkDevice &device) override
+        {
+            Material::createDescriptorSets(device);
+            for (size_t i = 0; i < max_frames_in_flight; i++)
+            {
+                VkDescriptorImageInfo normalInfo {};
+                normalInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                normalInfo.imageView = normalMap->imageView;
+                normalInfo.sampler = normalMap->sampler;
+
+                VkDescriptorImageInfo albedoInfo {};
+                albedoInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                albedoInfo.imageView = albedoTex->imageView;
+                albedoInfo.sampler = albedoTex->sampler;
+
+                VkDescriptorImageInfo roughnessInfo {};
+                roughnessInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                roughnessInfo.imageView = roughnessTex->imageView;
+                roughnessInfo.sampler = roughnessTex->sampler;
+
+                VkDescriptorImageInfo metalnessInfo {};
+                metalnessInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                metalnessInfo.imageView = metalnessTex->imageView;
+                metalnessInfo.sampler = metalnessTex->sampler;
+
+                std::array<VkDescriptorImageInfo, 4> imageInfos {normalInfo, albedoInfo, roughnessInfo, metalnessInfo};
+
+                std::array<VkWriteDescriptorSet, 1> descriptorWrites {};
+
+                descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                descriptorWrites[0].dstSet = descriptorSets[i];
+                descriptorWrites[0].dstBinding = 0;
+                descriptorWrites[0].dstArrayElement = 0;
+                descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+                descriptorWrites[0].descriptorCount = 4;
+                descriptorWrites[0].pImageInfo = imageInfos.data();
+
+                vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, null);
+            }
+        }
+    };
+
+    struct MaterialSSR : Material
+    {
+        Texture* albedoTex = null;
+        Texture* specularTex = null;
+
+        MaterialSSR()
+        {
+            this->type = &materialTypeSSR;
+        }
+
+        ~MaterialSSR() override
+        {
+            Texture::release(albedoTex);
+            Texture::release(specularTex);
+        }
+
+        void createDescriptorSets(VkDevice &device) override
+        {
+            Material::createDescriptorSets(device);
+            for (size_t i = 0; i < max_frames_in_flight; i++)
+            {
+                VkDescriptorImageInfo normalInfo {};
+                normalInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                normalInfo.imageView = normalMap->imageView;
+                normalInfo.sampler = normalMap->sampler;
+
+                VkDescriptorImageInfo albedoInfo {};
+                albedoInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                albedoInfo.imageView = albedoTex->imageView;
+                albedoInfo.sampler = albedoTex->sampler;
+
+                VkDescriptorImageInfo specularInfo {};
+                specularInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                specularInfo.imageView = specularTex->imageView;
+                specularInfo.sampler = specularTex->sampler;
+
+                std::array<VkDescriptorImageInfo, 3> imageInfos {normalInfo, albedoInfo, specularInfo};
+
+                std::array<VkWriteDescriptorSet, 1> descriptorWrites {};
+
+                descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                descriptorWrites[0].dstSet = descriptorSets[i];
+                descriptorWrites[0].dstBinding = 0;
+                descriptorWrites[0].dstArrayElement = 0;
+                descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+                descriptorWrites[0].descriptorCount = imageInfos.size();
+                descriptorWrites[0].pImageInfo = imageInfos.data();
+
+                vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, null);
+            }
+        }
+    };
+
+    struct MaterialLambertian : Material
+    {
+        Texture* albedoTex = null;
+
+        MaterialLambertian()
+        {
+            this->type = &materialTypeLambertian;
+        }
+
+        ~MaterialLambertian() override
+        {
+            Texture::release(albedoTex);
+        }
+
+        void createDescriptorSets(VkDevice &device) override
+        {
+            Material::createDescriptorSets(device);
+            for (size_t i = 0; i < max_frames_in_flight; i++)
+            {
+                VkDescriptorImageInfo normalInfo {};
+                normalInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                normalInfo.imageView = normalMap->imageView;
+                normalInfo.sampler = normalMap->sampler;
+
+                VkDescriptorImageInfo imageInfo {};
+                imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                imageInfo.imageView = albedoTex->imageView;
+                imageInfo.sampler = albedoTex->sampler;
+
+                std::array<VkDescriptorImageInfo, 2> imageInfos {normalInfo, imageInfo};
+
+                std::array<VkWriteDescriptorSet, 1> descriptorWrites {};
+                descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                descriptorWrites[0].dstSet = descriptorSets[i];
+                descriptorWrites[0].dstBinding = 0;
+                descriptorWrites[0].dstArrayElement = 0;
+                descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+                descriptorWrites[0].descriptorCount = imageInfos.size();
+                descriptorWrites[0].pImageInfo = imageInfos.data();
+
+                vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, null);
+            }
+        }
+    };
+
+    struct MaterialMirror : Material
+    {
+        MaterialMirror()
+        {
+            this->type = &materialTypeMirror;
+        }
+
+        void createDescriptorSets(VkDevice &device) override
+        {
+            Material::createDescriptorSets(device);
+            for (size_t i = 0; i < max_frames_in_flight; i++)
+            {
+                VkDescriptorImageInfo normalInfo {};
+                normalInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                normalInfo.imageView = normalMap->imageView;
+                normalInfo.sampler = normalMap->sampler;
+
+                std::array<VkDescriptorImageInfo, 1> imageInfos {normalInfo};
+
+                std::array<VkWriteDescriptorSet, 1> descriptorWrites {};
+                descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                descriptorWrites[0].dstSet = descriptorSets[i];
+                descriptorWrites[0].dstBinding = 0;
+                descriptorWrites[0].dstArrayElement = 0;
+                descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+                descriptorWrites[0].descriptorCount = imageInfos.size();
+                descriptorWrites[0].pImageInfo = imageInfos.data();
+
+                vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, null);
+            }
+        }
+    };
+
+    struct MaterialEnvironment : Material
+    {
+        MaterialEnvironment()
+        {
+            this->type = &materialTypeEnvironment;
+        }
+
+        void createDescriptorSets(VkDevice &device) override
+        {
+            Material::createDescriptorSets(device);
+            for (size_t i = 0; i < max_frames_in_flight; i++)
+            {
+                VkDescriptorImageInfo normalInfo {};
+                normalInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+                normalInfo.imageView = normalMap->imageView;
+                normalInfo.sampler = normalMap->sampler;
+
+                std::array<VkDescriptorImageInfo, 1> imageInfos {normalInfo};
+
+                std::array<VkWriteDescriptorSet, 1> descriptorWrites {};
+                descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                descriptorWrites[0].dstSet = descriptorSets[i];
+                descriptorWrites[0].dstBinding = 0;
+                descriptorWrites[0].dstArrayElement = 0;
+                descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+                descriptorWrites[0].descriptorCount = imageInfos.size();
+                descriptorWrites[0].pImageInfo = imageInfos.data();
+
+                vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, null);
+            }
+        }
+    };
+
+    struct Light
+    {
+        bool isSun = false;
+        std::string name;
+        float power;
+        vec3 tint = vec3(0, 0, 0);
+        mat4 worldToLightTransform = mat4::I();
+    };
+
+    // Format of data sent to shader for lights
+    struct alignas(16) ShaderLight
+    {
+        mat4 worldToLight;
+        mat4 projection;
+        vec4 tintPower;
+        float radius;
+        float limit;
+        float fov;
+        float blend;
+        int isSun;
+        int shadowRes;
+    };
+
+    int samplesPerPixel = 32;
+    const float sampleRadius = 0.25;
+    const float ambientOcclusionStrength = 1;
+
+    struct alignas(16) ShaderSample
+    {
+        vec4 pos;
+    };
+
+    std::vector<ShaderSample> shaderSamples {1024};
+
+    struct ShadowMap
+    {
+        std::vector<VkFramebuffer> framebuffers {max_frames_in_flight};
+        std::vector<VkImage> images {max_frames_in_flight};
+        std::vector<DeviceAllocation> imageMemories {max_frames_in_flight};
+        std::vector<VkImageView> imageViews {max_frames_in_flight};
+        std::vector<VkSampler> samplers {max_frames_in_flight};
+        int resolution;
+
+        ShadowMap(int l, int res)
+        {
+            this->resolution = res;
+        }
+    };
+
+    struct SunLight : Light
+    {
+        float angle;
+
+        SunLight(std::string name, vec3 tint, float angle, float power)
+        {
+            this->isSun = true;
+            this->name = name;
+            this->tint = tint;
+            this->angle = angle;
+            this->power = power;
+        }
+    };
+
+    struct SpotLight : Light
+    {
+        float radius;
+        float limit;
+
+        float fov;
+        float blend;
+
+        int shadowRes = 0;
+
+        SpotLight(std::string name, vec3 tint, float radius, float power, float limit = std::numeric_limits<float>::infinity(), float fov = -1, float blend = -1, int shadowRes = 0)
+        {
+            this->name = name;
+            this->tint = tint;
+            this->radius = radius;
+            this->power = power;
+            this->limit = limit;
+            this->fov = fov;
+            this->blend = blend;
+            this->shadowRes = shadowRes;
+        }
+    };
+
+    struct Node
+    {
+        std::string name;
+
+        mat4 transform;
+        mat4 invTransform;
+
+        vec3 translation;
+        vec4 rotation;
+        vec3 scale;
+
+        Driver<dvec3>* translationDriver = null;
+        Driver<dvec4>* rotationDriver = null;
+        Driver<dvec3>* scaleDriver = null;
+
+        std::vector<Node*> children;
+        Camera* camera = null;
+        Mesh* mesh = null;
+        Environment* environment = null;
+        Light* light = null;
+
+        // Position in Scene::nodes, set by SceneGraph::build()
+        u32 index = 0;
+
+        explicit Node(const std::string &name,
+                      vec3 translation = vec3(0.0f, 0.0f, 0.0f),
+                      vec4 rotation = vec4(0.0f, 0.0f, 0.0f, 1.0f),
+                      vec3 scale = vec3(1.0f, 1.0f, 1.0f))
+        {
+            this->translation = translation;
+            this->rotation = rotation;
+            this->scale = scale;
+
+            this->computeTransform();
+            this->name = name;
+        }
+
+        void computeTransform()
+        {
+            this->transform = mat4::translation(translation) * mat4::rotate(rotation) * mat4::scale(scale);
+            this->invTransform = mat4::scale(vec3(1.0f / scale.x, 1.0f / scale.y, 1.0f / scale.z)) * mat4::rotate(vec4(rotation.xyz(), -rotation.w)) * mat4::translation(translation * -1.0f);
+        }
+    };
+
+    // The node hierarchy flattened into arrays, with an entry for each path from a root to a node, so that a node that
+    // is the child of several parents has an entry for each. Entries are in depth-first order, which puts every
+    // parent before its children and keeps the order the hierarchy used to be drawn in, so world transforms are
+    // computed in one pass over the entries.
+    struct SceneGraph
+    {
+        // Per node, by index in Scene::nodes
+        std::vector<mat4> localTransforms;
+        std::vector<mat4> localInverses;
+        std::vector<Node*> animated;
+
+        // Per entry
+        std::vector<u32> nodes;
+        std::vector<int32_t> parents;
+        std::vector<mat4> worldTransforms;
+        std::vector<mat4> worldInverses;
+
+        // The entries with something attached, in entry order
+        std::vector<std::pair<u32, Mesh*>> meshes;
+        std::vector<std::pair<u32, Light*>> lights;
+        std::vector<std::pair<u32, Camera*>> cameras;
+        std::vector<std::pair<u32, Environment*>> environments;
+
+        void build(const std::vector<Node*>& roots, const std::vector<Node*>& sceneNodes)
+        {
+            localTransforms.resize(sceneNodes.size());
+            localInverses.resize(sceneNodes.size());
+            for (u32 i = 0; i < sceneNodes.size(); i++)
+            {
+                Node* n = sceneNodes[i];
+                n->index = i;
+                localTransforms[i] = n->transform;
+                localInverses[i] = n->invTransform;
+
+                if (n->translationDriver != null || n->rotationDriver != null || n->scaleDriver != null)
+                    animated.emplace_back(n);
+            }
+
+            // Pushed in reverse so that they come off in order
+            std::vector<std::pair<Node*, int32_t>> stack;
+            for (auto r = roots.rbegin(); r != roots.rend(); r++)
+                stack.emplace_back(*r, -1);
+
+            while (!stack.empty())
+            {
+                auto [n, parent] = stack.back();
+                stack.pop_back();
+
+                u32 entry = nodes.size();
+                nodes.emplace_back(n->index);
+                parents.emplace_back(parent);
+
+                if (n->mesh != null)
+                    meshes.emplace_back(entry, n->mesh);
+
+                if (n->light != null)
+                    lights.emplace_back(entry, n->light);
+
+                if (n->camera != null)
+                    cameras.emplace_back(entry, n->camera);
+
+                if (n->environment != null)
+                    environments.emplace_back(entry, n->environment);
+
+                for (auto c = n->children.rbegin(); c != n->children.rend(); c++)
+                    stack.emplace_back(*c, (int32_t) entry);
+            }
+
+            worldTransforms.resize(nodes.size());
+            worldInverses.resize(nodes.size());
+        }
+
+        // Computes every world transform from the local ones, after Animation::update() has moved the animated nodes
+        void update()
+        {
+            for (Node* n: animated)
+            {
+                n->computeTransform();
+                localTransforms[n->index] = n->transform;
+                localInverses[n->index] = n->invTransform;
+            }
+
+            for (size_t e = 0; e < nodes.size(); e++)
+            {
+                int32_t p = parents[e];
+                if (p < 0)
+                {
+                    worldTransforms[e] = localTransforms[nodes[e]];
+                    worldInverses[e] = localInverses[nodes[e]];
+                }
+                else
+                {
+                    worldTransforms[e] = worldTransforms[p] * localTransforms[nodes[e]];
+                    worldInverses[e] = localInverses[nodes[e]] * worldInverses[p];
+                }
+            }
+        }
+
+        // Computes transforms for cameras and environments
+        void computeCameras()
+        {
+            for (auto [e, camera]: cameras)
+            {
+                camera->cameraBaseToWorldTransform = worldTransforms[e];
+                camera->worldToCameraBaseTransform = worldInverses[e];
+                camera->updateTransform();
+            }
+
+            for (auto [e, environment]: environments)
+                environment->worldToEnvironmentTransform = worldInverses[e];
+        }
+
+        // Computes shader information for lights
+        void computeLights(std::vector<ShaderLight> &shaderLights, std::vector<ShadowMap> &shadowMaps, bool init, int &shadowIndex)
+        {
+            for (auto [e, light]: lights)
+            {
+                mat4 m2i = worldInverses[e];
+
+                if (light->isSun)
+                {
+                    auto* s = (SunLight*) light;
+                    ShaderLight sl = {m2i, mat4::I(), vec4(s->tint, s->power), s->angle, -1, -1, -1, true};
+                    shaderLights.emplace_back(sl);
+                }
+                else
+                {
+                    auto* s = (SpotLight*) light;
+                    ShaderLight sl = {m2i, mat4::I(), vec4(s->tint, s->power), s->radius, s->limit, s->fov, s->blend, false};
+                    if (s->fov > 0)
                     {
-                        auto e = (float) pow(2, (int) a - 128);
+                        if (isinf(s->limit))
+                            sl.projection = mat4::infinitePerspective(1, s->fov, s->radius);
+                        else
+                            sl.projection = mat4::perspective(1, s->fov, s->radius, s->limit);
 
-                        if (r == 0 && g == 0 && b == 0 && a == 0)
-                            e = 0;
+                        sl.shadowRes = s->shadowRes;
+                        if (sl.shadowRes > 0)
+                        {
+                            shaderLights.emplace_back(sl);
+                            shadowIndex++;
 
-                        this->dataFloat[m][i * 4] = ((float) r + 0.5f) / 256 * e;
-                        this->dataFloat[m][i * 4 + 1] = ((float) g + 0.5f) / 256 * e;
-                        this->dataFloat[m][i * 4 + 2] = ((float) b + 0.5f) / 256 * e;
+                            if (!init)
+                                shadowMaps.emplace_back(ShadowMap(shaderLights.size() - 1, sl.shadowRes));
+                        }
+                        else
+                            shaderLights.emplace_back(sl);
+                    }
+                    else
+                        shaderLights.emplace_back(sl);
+                }
+            }
+        }
 
-                        this->dataFloat[m][i * 4 + 3] = 1.0f;
+        void draw(VkCommandBuffer b, Camera* camera, bool enableCulling)
+        {
+            for (auto [e, mesh]: meshes)
+            {
+                mat4 m2 = worldTransforms[e];
+                mat4 t = camera->cameraUserOffsetTransform * m2;
+                bool culled = false;
+
+                if (enableCulling)
+                {
+                    vec3 minPos;
+                    vec3 maxPos;
+
+                    for (int i = 0; i < 2; i++)
+                    {
+                        for (int j = 0; j < 2; j++)
+                        {
+                            for (int k = 0; k < 2; k++)
+                            {
+                                vec4 pos = (t * vec4(mesh->corners[i][j][k], 1.0f));
+
+                                if (i == 0 && j == 0 && k == 0)
+                                {
+                                    minPos = pos.xyz();
+                                    maxPos = pos.xyz();
+                                    minPos.z = -pos.z;
+                                    maxPos.z = -pos.z;
+                                }
+                                else
+                                {
+                                    minPos = vec3(std::min(pos.x, minPos.x), std::min(pos.y, minPos.y),
+                                                  std::min(-pos.z, minPos.z));
+                                    maxPos = vec3(std::max(pos.x, maxPos.x), std::max(pos.y, maxPos.y),
+                                                  std::max(-pos.z, maxPos.z));
+                                }
+                            }
+                        }
                     }
+
+                    if (maxPos.z < camera->nearPlane || minPos.z > camera->farPlane)
+                        culled = true;
                     else
                     {
-                        this->dataFloat[m][i * 4] = (float) r / 255.0f;
-                        this->dataFloat[m][i * 4 + 1] = (float) g / 255.0f;
-                        this->dataFloat[m][i * 4 + 2] = (float) b / 255.0f;
-                        this->dataFloat[m][i * 4 + 3] = (float) a / 255.0f;
+                        float z = std::min(maxPos.z, camera->farPlane);
+                        float y = camera->verticalFOVTan * z;
+                        float x = y * camera->aspectRatio;
+                        culled = maxPos.y < -y || minPos.y > y || maxPos.x < -x || minPos.x > x;
                     }
                 }
 
-                stbi_image_free(data[m]);
+                if (culled)
+                    meshesCulled++;
+                else
+                {
+                    meshesDrawn++;
+                    mesh->draw(b, m2);
+                }
+            }
+        }
+    };
+
+    // Every driver of the scene, evaluated together once per frame. Keyframes are stored one driver after another in
+    // arrays per component, and each driver keeps a cursor at the keyframe it was last between, so that playing
+    // forward costs O(1) per driver. Evaluation first finds the two keyframes and the fraction between them for
+    // every driver, and then interpolates all of them in loops over contiguous arrays, which the compiler can
+    // vectorize.
+    struct Animation
+    {
+        static const int channelTranslation = 0;
+        static const int channelRotation = 1;
+        static const int channelScale = 2;
+
+        // Series terms of the slerp weights (see slerpWeight)
+        static const int slerpTerms = 16;
+
+        struct Lanes
+        {
+            std::vector<double> x;
+            std::vector<double> y;
+            std::vector<double> z;
+            std::vector<double> w;
+
+            void resize(size_t size)
+            {
+                x.resize(size);
+                y.resize(size);
+                z.resize(size);
+                w.resize(size);
+            }
+        };
+
+        // Keyframes of every driver
+        std::vector<double> times;
+        Lanes values;
+
+        // Per driver, with the ones that slerp after all the others
+        std::vector<u32> first;
+        std::vector<u32> count;
+        std::vector<u32> cursor;
+        std::vector<char> stepped;
+        std::vector<Node*> nodes;
+        std::vector<int> channels;
+        size_t slerpStart = 0;
+
+        // Per driver, for the current frame: the keyframes it is between, the fraction of the way from one to the
+        // other and the result
+        Lanes before;
+        Lanes after;
+        std::vector<double> fractions;
+        Lanes results;
+
+        double slerpU[slerpTerms];
+        double slerpV[slerpTerms];
+
+        Animation()
+        {
+            for (int i = 0; i < slerpTerms; i++)
+            {
+                slerpU[i] = 1.0 / ((i + 1) * (2 * i + 3));
+                slerpV[i] = (i + 1.0) / (2 * i + 3);
+            }
+
+            // Stands in for the terms after the last, which matter most as the angle approaches 90 degrees
+            slerpU[slerpTerms - 1] *= 1.917;
+            slerpV[slerpTerms - 1] *= 1.917;
+        }
+
+        void build(const std::vector<Node*>& sceneNodes)
+        {
+            for (Node* n: sceneNodes)
+            {
+                add(n->translationDriver, n, channelTranslation, false);
+                add(n->rotationDriver, n, channelRotation, false);
+                add(n->scaleDriver, n, channelScale, false);
+            }
+
+            slerpStart = first.size();
+            for (Node* n: sceneNodes)
+            {
+                add(n->translationDriver, n, channelTranslation, true);
+                add(n->rotationDriver, n, channelRotation, true);
+                add(n->scaleDriver, n, channelScale, true);
+            }
+
+            before.resize(first.size());
+            after.resize(first.size());
+            fractions.resize(first.size());
+            results.resize(first.size());
+        }
+
+        // Only rotations are slerped. Translations and scales given slerp interpolation are interpolated linearly.
+        template<typename V>
+        void add(Driver<V>* d, Node* n, int channel, bool slerping)
+        {
+            if (d == null || (d->interpolation == slerp && channel == channelRotation) != slerping)
+                return;
+
+            u32 keys = std::min(d->times.size(), d->values.size());
+            if (keys == 0)
+                return;
+
+            first.emplace_back(times.size());
+            count.emplace_back(keys);
+            cursor.emplace_back(0);
+            stepped.emplace_back(d->interpolation == step);
+            nodes.emplace_back(n);
+            channels.emplace_back(channel);
+
+            for (u32 k = 0; k < keys; k++)
+            {
+                times.emplace_back(d->times[k]);
+                values.x.emplace_back(d->values[k].x);
+                values.y.emplace_back(d->values[k].y);
+                values.z.emplace_back(d->values[k].z);
+
+                if constexpr (std::is_same_v<V, dvec4>)
+                    values.w.emplace_back(d->values[k].w);
+                else
+                    values.w.emplace_back(0);
             }
         }
 
-        void initTexture()
-        {
-            assert (!initialized);
-            convertTexture();
-            createTextureImage();
-            createTextureImageView();
-            createTextureSampler();
+        // sin(t * angle) / sin(angle), where x is the cosine of an angle of at most 90 degrees, as a series in x - 1
+        // without trigonometry or branches (Eberly, "A Fast and Accurate Algorithm for Computing SLERP", 2011). With
+        // the last term adjusted as in the paper, though for twice its number of terms, the error is within 5e-8.
+        double slerpWeight(double t, double x) const
+        {
+            double t2 = t * t;
+            double xm1 = x - 1;
+            double c = 1;
+            for (int i = slerpTerms - 1; i >= 0; i--)
+                c = 1 + (slerpU[i] * t2 - slerpV[i]) * xm1 * c;
+
+            return t * c;
+        }
+
+        // Sets the translation, rotation and scale of every animated node for the given time. The nodes' transforms
+        // still have to be computed from them.
+        void update(double t)
+        {
+            size_t drivers = first.size();
+
+            // Before a driver's first keyframe or after its last, that keyframe is used on its own
+            for (size_t d = 0; d < drivers; d++)
+            {
+                const double* keys = times.data() + first[d];
+                u32 k = count[d];
+                u32 c = cursor[d];
+
+                if (c > 0 && keys[c - 1] > t)
+                    c = std::upper_bound(keys, keys + c, t) - keys;
+                else if (c < k && keys[c] <= t)
+                {
+                    if (c + 1 < k && keys[c + 1] <= t)
+                        c = std::upper_bound(keys + c, keys + k, t) - keys;
+                    else
+                        c++;
+                }
+
+                cursor[d] = c;
+
+                u32 a = first[d] + (c == 0 ? 0 : c - 1);
+                u32 b = a;
+                double fraction = 0;
+                if (c > 0 && c < k && !stepped[d])
+                {
+                    b = a + 1;
+                    fraction = (t - keys[c - 1]) / (keys[c] - keys[c - 1]);
+                }
+
+                before.x[d] = values.x[a];
+                before.y[d] = values.y[a];
+                before.z[d] = values.z[a];
+                before.w[d] = values.w[a];
+                after.x[d] = values.x[b];
+                after.y[d] = values.y[b];
+                after.z[d] = values.z[b];
+                after.w[d] = values.w[b];
+                fractions[d] = fraction;
+            }
 
-            for (int i = 0; i < dataFloat.size(); i++)
+            for (size_t d = 0; d < slerpStart; d++)
             {
-                delete dataFloat[i];
+                double f = fractions[d];
+                results.x[d] = before.x[d] * (1 - f) + after.x[d] * f;
+                results.y[d] = before.y[d] * (1 - f) + after.y[d] * f;
+                results.z[d] = before.z[d] * (1 - f) + after.z[d] * f;
+                results.w[d] = before.w[d] * (1 - f) + after.w[d] * f;
             }
 
-            initialized = true;
-        }
+            // Along the shorter arc, which for quaternions is the one between before and whichever of after and -after
+            // is nearer to it
+            for (size_t d = slerpStart; d < drivers; d++)
+            {
+                double f = fractions[d];
+                double cosTheta = before.x[d] * after.x[d] + before.y[d] * after.y[d] + before.z[d] * after.z[d] + before.w[d] * after.w[d];
+                double sign = cosTheta < 0 ? -1.0 : 1.0;
+                double x = std::min(cosTheta * sign, 1.0);
+
+                double wb = slerpWeight(1 - f, x);
+                double wa = slerpWeight(f, x) * sign;
+                results.x[d] = before.x[d] * wb + after.x[d] * wa;
+                results.y[d] = before.y[d] * wb + after.y[d] * wa;
+                results.z[d] = before.z[d] * wb + after.z[d] * wa;
+                results.w[d] = before.w[d] * wb + after.w[d] * wa;
+            }
 
-        ~Texture()
-        {
-            vkDestroySampler(renderer->device, sampler, null);
-            vkDestroyImageView(renderer->device, imageView, null);
+            for (size_t d = 0; d < drivers; d++)
+            {
+                vec3 v = vec3((float) results.x[d], (float) results.y[d], (float) results.z[d]);
 
-            vkDestroyImage(renderer->device, image, null);
-            vkFreeMemory(renderer->device, imageMemory, null);
+                if (channels[d] == channelTranslation)
+                    nodes[d]->translation = v;
+                else if (channels[d] == channelRotation)
+                    nodes[d]->rotation = vec4(v.x, v.y, v.z, (float) results.w[d]);
+                else
+                    nodes[d]->scale = v;
+            }
         }
     };
 
-    struct Environment
+    struct Scene
     {
         std::string name;
-        Texture* texturePBR;
-        Texture* textureLambertian;
-        mat4 worldToEnvironmentTransform = mat4::I();
-
-        Environment(std::string name, Texture* texPBR, Texture* texLam)
-        {
-            this->name = name;
-            this->texturePBR = texPBR;
-            this->textureLambertian = texLam;
-        }
-
-        ~Environment()
-        {
-            delete texturePBR;
-            delete textureLambertian;
-        }
-    };
+        std::vector<Node*> roots;
+        SceneGraph graph;
+        Animation animation;
+
+        // Every object of the scene by type, in file order
+        std::vector<Node*> nodes;
+        std::vector<Mesh*> meshes;
+        std::vector<Camera*> cameras;
+        std::vector<Driver<dvec3>*> translationDrivers;
+        std::vector<Driver<dvec4>*> rotationDrivers;
+        std::vector<Driver<dvec3>*> scaleDrivers;
+        std::vector<Environment*> environments;
+        std::vector<Material*> materials;
+        std::vector<Light*> lights;
 
-    struct Scene;
-    struct MaterialType;
+        std::vector<ShaderLight> shaderLights {};
+        std::vector<ShadowMap> shadowMaps {};
+        int shadowCount = 0;
 
-    static std::vector<MaterialType*> materialTypes;
+        bool drawingShadow = false;
+        int currentShadowMapIndex;
+        ShadowMap* currentShadowMap = null;
 
-    struct MaterialType
-    {
-        GraphicsPipeline pipeline;
-        GraphicsPipeline shadowMapPipeline;
+        Environment* defaultEnvironment;
+        Environment* environment;
 
-        GraphicsPipeline* getPipeline(bool shadow)
-        {
-            if (shadow)
-                return &shadowMapPipeline;
-            else
-                return &pipeline;
-        }
+        // The cameras the shadow maps of the current frame are drawn from, by shadow map index
+        std::vector<Camera> shadowCameras;
 
-        GraphicsPipeline* getPipeline(Scene* scene)
-        {
-            return getPipeline(scene->drawingShadow);
-        }
+        // Cameras enumerated sequentially, starting with the detached camera
+        std::vector<Camera*> camerasEnumerated;
+        int currentCameraIndex = 0;
 
-        u32 stride;
+        int cameraCount = 1;
+        Camera* detachedCamera = new Camera("default", 1.5, PI / 2, 0.1);
+        Camera* debugCamera = new Camera("debug", 1.5, PI / 2, 0.1);
 
-        VkDescriptorPool descriptorPool;
-        VkDescriptorSetLayout descriptorSetLayout;
+        Camera* currentCamera = detachedCamera;
+        bool debugCameraMode = false;
 
-        int textures;
-        int instances = 0;
+        bool initialized = false;
 
-        MaterialType(int textures)
+        Scene(std::string name)
         {
-            materialTypes.emplace_back(this);
-            this->textures = textures;
+            this->name = name;
         }
 
-        void createDescriptorPool(VkDevice &device)
+        ~Scene()
         {
-            VkDescriptorPoolCreateInfo poolInfo {};
-
-            std::vector<VkDescriptorPoolSize> poolSizes (1);
+            for (Node* n: nodes)
+                delete n;
 
-            int i = 1;
-            if (instances > 0)
-                i = instances;
+            for (Mesh* n: meshes)
+                delete n;
 
-            poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-            poolSizes[0].descriptorCount = static_cast<uint32_t>(max_frames_in_flight * i);
+            for (Camera* n: cameras)
+                delete n;
 
-            if (textures > 0)
-            {
-                poolSizes.resize(2);
-                poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-                poolSizes[1].descriptorCount = static_cast<uint32_t>(max_frames_in_flight * textures * i);
-            }
+            for (Driver<dvec3>* n: translationDrivers)
+                delete n;
 
-            poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
-            poolInfo.pPoolSizes = poolSizes.data();
-            poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-            poolInfo.maxSets = static_cast<uint32_t>(max_frames_in_flight * i);
+            for (Driver<dvec4>* n: rotationDrivers)
+                delete n;
 
-            auto result = vkCreateDescriptorPool(device, &poolInfo, null, &descriptorPool);
-            if (result != VK_SUCCESS)
-            {
-                printf("failed: %d\n", result);
-                throw std::runtime_error("descriptor pool creation failed!");
-            }
-        }
+            for (Driver<dvec3>* n: scaleDrivers)
+                delete n;
 
-        void createDescriptorSetLayout(VkDevice &device)
-        {
-            std::vector<VkDescriptorSetLayoutBinding> bindings(0);
+            for (Environment* n: environments)
+                delete n;
 
-            if (textures > 0)
-            {
-                VkDescriptorSetLayoutBinding samplerLayoutBinding{};
-                samplerLayoutBinding.binding = 0;
-                samplerLayoutBinding.descriptorCount = textures;
-                samplerLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-                samplerLayoutBinding.pImmutableSamplers = null;
-                samplerLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
-                bindings.emplace_back(samplerLayoutBinding);
-            }
+            for (Material* n: materials)
+                delete n;
 
-            VkDescriptorSetLayoutCreateInfo layoutInfo {};
-            layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-            layoutInfo.bindingCount = bindings.size();
-            layoutInfo.pBindings = bindings.data();
+            delete detachedCamera;
+            delete debugCamera;
+            delete defaultEnvironment;
+        }
+    };
 
-//                VkDescriptorSetLayoutBinding uboLayoutBinding{};
-//                uboLayoutBinding.binding = 0;
-//                uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-//                uboLayoutBinding.descriptorCount = 1;
-//                uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+    // A run of numbers from an s72 array, pointing into whatever the element was read from
+    struct NumberSpan
+    {
+        const double* data = null;
+        size_t size = 0;
 
-            auto result = vkCreateDescriptorSetLayout(device, &layoutInfo, null, &descriptorSetLayout);
-            if (result != VK_SUCCESS)
-            {
-                printf("failed: %d\n", result);
-                throw std::runtime_error("descriptor set layout failed!");
-            }
+        double operator[](size_t i) const
+        {
+            return data[i];
         }
     };
 
-    static MaterialType materialTypeSimple;
-    static MaterialType materialTypePBR;
-    static MaterialType materialTypeSSR;
-    static MaterialType materialTypeLambertian;
-    static MaterialType materialTypeMirror;
-    static MaterialType materialTypeEnvironment;
+    struct AttributeSource
+    {
+        std::string_view name;
+        std::string_view src;
+        uint64_t offset = 0;
+        uint64_t stride = 0;
+        std::string_view format;
+    };
 
-    struct Material
+    // One s72 element reduced to the values SceneBuilder needs, read either from the parsed text or from a scene cache.
+    // Strings and numbers point into that source, so an element can only be used until the next one is read.
+    struct SceneElement
     {
-        std::string name;
-        MaterialType* type;
-        Texture* normalMap = null;
+        static const int32_t s72Header = 0;
+        static const int32_t s72Scene = 1;
+        static const int32_t s72Node = 2;
+        static const int32_t s72Camera = 3;
+        static const int32_t s72Mesh = 4;
+        static const int32_t s72Driver = 5;
+        static const int32_t s72Material = 6;
+        static const int32_t s72Environment = 7;
+        static const int32_t s72Light = 8;
+        static const int32_t s72Unknown = 9;
+
+        static const int32_t channelNone = 0;
+        static const int32_t channelTranslation = 1;
+        static const int32_t channelRotation = 2;
+        static const int32_t channelScale = 3;
+
+        static const int32_t materialSimple = 0;
+        static const int32_t materialPBR = 1;
+        static const int32_t materialLambertian = 2;
+        static const int32_t materialSSR = 3;
+        static const int32_t materialMirror = 4;
+        static const int32_t materialEnvironment = 5;
+
+        static const int32_t lightNone = 0;
+        static const int32_t lightSun = 1;
+        static const int32_t lightSphere = 2;
+        static const int32_t lightSpot = 3;
+
+        int32_t type = s72Unknown;
+        std::string_view name;
+
+        // SCENE
+        NumberSpan roots;
+
+        // NODE
+        vec3 translation = vec3(0.0f, 0.0f, 0.0f);
+        vec4 rotation = vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        vec3 scale = vec3(1.0f, 1.0f, 1.0f);
+        NumberSpan children;
+        int32_t camera = -1;
+        int32_t mesh = -1;
+        int32_t environment = -1;
+        int32_t light = -1;
+
+        // CAMERA
+        float aspect = 0;
+        float vfov = 0;
+        float near = 0;
+        bool hasFar = false;
+        double far = 0;
+
+        // MESH
+        std::string_view topology;
+        int32_t count = 0;
+        int32_t material = -1;
+        std::vector<AttributeSource> attributes;
+
+        // DRIVER
+        int32_t node = -1;
+        int32_t channel = channelNone;
+        NumberSpan times;
+        NumberSpan values;
+        std::string_view interpolation;
+
+        // MATERIAL
+        int32_t model = materialSimple;
+        TextureSource normalMap;
+        TextureSource albedo;
+        TextureSource roughness;
+        TextureSource metalness;
+        TextureSource specular;
+
+        // ENVIRONMENT
+        TextureSource radiance;
+
+        // LIGHT
+        vec3 tint = vec3(0, 0, 0);
+        int32_t kind = lightNone;
+        float angle = 0;
+        float strength = 0;
+        float radius = 0;
+        float power = 0;
+        bool hasLimit = false;
+        float limit = 0;
+        float fov = 0;
+        float blend = 0;
+        int32_t shadow = 0;
+
+        // Number arrays that were not parsed as dense blocks
+        std::vector<std::vector<double>> copies;
+    };
 
-        std::vector<VkDescriptorSet> descriptorSets;
+    // The s72 words compared while decoding, interned first so that strings parsed with the same table compare
+    // with them as integers. Keys and other short strings of the file are interned here as well while parsing.
+    struct SceneWords
+    {
+        jatoms atoms;
 
-        virtual void createDescriptorSets(VkDevice &device)
-        {
-            std::vector<VkDescriptorSetLayout> layouts(max_frames_in_flight, type->descriptorSetLayout);
-            VkDescriptorSetAllocateInfo allocInfo{};
-            allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-            allocInfo.descriptorPool = type->descriptorPool;
-            allocInfo.descriptorSetCount = static_cast<u32>(max_frames_in_flight);
-            allocInfo.pSetLayouts = layouts.data();
+        uint32_t scene = atoms.intern("SCENE");
+        uint32_t node = atoms.intern("NODE");
+        uint32_t camera = atoms.intern("CAMERA");
+        uint32_t mesh = atoms.intern("MESH");
+        uint32_t driver = atoms.intern("DRIVER");
+        uint32_t material = atoms.intern("MATERIAL");
+        uint32_t environment = atoms.intern("ENVIRONMENT");
+        uint32_t light = atoms.intern("LIGHT");
 
-            descriptorSets.resize(max_frames_in_flight);
-            auto result = vkAllocateDescriptorSets(device, &allocInfo, descriptorSets.data());
-            if (result != VK_SUCCESS)
-            {
-                printf("failed: %d\n", result);
-                throw std::runtime_error("descriptor sets creation failed!");
-            }
-        }
+        uint32_t translation = atoms.intern("translation");
+        uint32_t rotation = atoms.intern("rotation");
+        uint32_t scale = atoms.intern("scale");
 
-        virtual ~Material()
+        uint32_t cube = atoms.intern("cube");
+        uint32_t rgbe = atoms.intern("rgbe");
+
+        bool is(jvalue* v, uint32_t word) const
         {
-            delete normalMap;
+            return atoms.is(jstring::cast(v), word);
         }
     };
 
-    struct MaterialSimple : Material
+    // The s72 objects as they appear in the file, filled in by jdecode in one pass over each object's members.
+    // Members missing from the file keep these defaults.
+    struct S72Scene
     {
-        MaterialSimple()
+        std::string_view name;
+        jarray* roots = null;
+
+        static constexpr auto fields()
         {
-            this->type = &materialTypeSimple;
+            return std::make_tuple(jbind("name", &S72Scene::name), jbind("roots", &S72Scene::roots));
         }
+    };
 
-        void createDescriptorSets(VkDevice &device) override
+    struct S72Node
+    {
+        std::string_view name;
+        jarray* translation = null;
+        jarray* rotation = null;
+        jarray* scale = null;
+        jarray* children = null;
+        int32_t camera = -1;
+        int32_t mesh = -1;
+        int32_t environment = -1;
+        int32_t light = -1;
+
+        static constexpr auto fields()
+        {
+            return std::make_tuple(jbind("name", &S72Node::name), jbind("translation", &S72Node::translation),
+                                   jbind("rotation", &S72Node::rotation), jbind("scale", &S72Node::scale),
+                                   jbind("children", &S72Node::children), jbind("camera", &S72Node::camera),
+                                   jbind("mesh", &S72Node::mesh), jbind("environment", &S72Node::environment),
+                                   jbind("light", &S72Node::light));
+        }
+    };
+
+    struct S72Perspective
+    {
+        float aspect = 0;
+        float vfov = 0;
+        float near = 0;
+        std::optional<double> far;
+
+        static constexpr auto fields()
         {
-            Material::createDescriptorSets(device);
-            for (size_t i = 0; i < max_frames_in_flight; i++)
-            {
-                std::array<VkWriteDescriptorSet, 0> descriptorWrites {};
-                vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, null);
-            }
+            return std::make_tuple(jbind("aspect", &S72Perspective::aspect), jbind("vfov", &S72Perspective::vfov),
+                                   jbind("near", &S72Perspective::near), jbind("far", &S72Perspective::far));
         }
     };
 
-    struct MaterialPBR : Material
+    struct S72Camera
     {
-        Texture* albedoTex = null;
-        Texture* roughnessTex = null;
-        Texture* metalnessTex = null;
+        std::string_view name;
+        S72Perspective perspective;
 
-        MaterialPBR()
+        static constexpr auto fields()
         {
-            this->type = &materialTypePBR;
+            return std::make_tuple(jbind("name", &S72Camera::name), jbind("perspective", &S72Camera::perspective));
         }
+    };
 
-        ~MaterialPBR() override
+    struct S72Attribute
+    {
+        std::string_view src;
+        uint64_t offset = 0;
+        uint64_t stride = 0;
+        std::string_view format;
+
+        static constexpr auto fields()
         {
-            delete albedoTex;
-            delete roughnessTex;
-            delete metalnessTex;
+            return std::make_tuple(jbind("src", &S72Attribute::src), jbind("offset", &S72Attribute::offset),
+                                   jbind("stride", &S72Attribute::stride), jbind("format", &S72Attribute::format));
         }
+    };
 
-        void createDescriptorSets(VkDevice &device) override
+    struct S72Mesh
+    {
+        std::string_view name;
+        std::string_view topology;
+        int32_t count = 0;
+        int32_t material = -1;
+        jobject* attributes = null;
+
+        static constexpr auto fields()
         {
-            Material::createDescriptorSets(device);
-            for (size_t i = 0; i < max_frames_in_flight; i++)
-            {
-                VkDescriptorImageInfo normalInfo {};
-                normalInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                normalInfo.imageView = normalMap->imageView;
-                normalInfo.sampler = normalMap->sampler;
+            return std::make_tuple(jbind("name", &S72Mesh::name), jbind("topology", &S72Mesh::topology),
+                                   jbind("count", &S72Mesh::count), jbind("material", &S72Mesh::material),
+                                   jbind("attributes", &S72Mesh::attributes));
+        }
+    };
 
-                VkDescriptorImageInfo albedoInfo {};
-                albedoInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                albedoInfo.imageView = albedoTex->imageView;
-                albedoInfo.sampler = albedoTex->sampler;
+    struct S72Driver
+    {
+        std::string_view name;
+        int32_t node = -1;
+        jvalue* channel = null;
+        jarray* times = null;
+        jarray* values = null;
+        std::string_view interpolation;
 
-                VkDescriptorImageInfo roughnessInfo {};
-                roughnessInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                roughnessInfo.imageView = roughnessTex->imageView;
-                roughnessInfo.sampler = roughnessTex->sampler;
+        static constexpr auto fields()
+        {
+            return std::make_tuple(jbind("name", &S72Driver::name), jbind("node", &S72Driver::node),
+                                   jbind("channel", &S72Driver::channel), jbind("times", &S72Driver::times),
+                                   jbind("values", &S72Driver::values), jbind("interpolation", &S72Driver::interpolation));
+        }
+    };
 
-                VkDescriptorImageInfo metalnessInfo {};
-                metalnessInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                metalnessInfo.imageView = metalnessTex->imageView;
-                metalnessInfo.sampler = metalnessTex->sampler;
+    struct S72TextureFile
+    {
+        std::string_view src;
+        jvalue* type = null;
+        jvalue* format = null;
 
-                std::array<VkDescriptorImageInfo, 4> imageInfos {normalInfo, albedoInfo, roughnessInfo, metalnessInfo};
+        static constexpr auto fields()
+        {
+            return std::make_tuple(jbind("src", &S72TextureFile::src), jbind("type", &S72TextureFile::type),
+                                   jbind("format", &S72TextureFile::format));
+        }
+    };
 
-                std::array<VkWriteDescriptorSet, 1> descriptorWrites {};
+    // Parameters of every material model; each model only uses some of them
+    struct S72MaterialModel
+    {
+        jvalue* albedo = null;
+        jvalue* roughness = null;
+        jvalue* metalness = null;
+        jvalue* specular = null;
 
-                descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-                descriptorWrites[0].dstSet = descriptorSets[i];
-                descriptorWrites[0].dstBinding = 0;
-                descriptorWrites[0].dstArrayElement = 0;
-                descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-                descriptorWrites[0].descriptorCount = 4;
-                descriptorWrites[0].pImageInfo = imageInfos.data();
+        static constexpr auto fields()
+        {
+            return std::make_tuple(jbind("albedo", &S72MaterialModel::albedo), jbind("roughness", &S72MaterialModel::roughness),
+                                   jbind("metalness", &S72MaterialModel::metalness), jbind("specular", &S72MaterialModel::specular));
+        }
+    };
+
+    struct S72Material
+    {
+        std::string_view name;
+        jvalue* normalMap = null;
+        std::optional<S72MaterialModel> pbr;
+        std::optional<S72MaterialModel> lambertian;
+        std::optional<S72MaterialModel> ssr;
+        jvalue* mirror = null;
+        jvalue* environment = null;
 
-                vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, null);
-            }
+        static constexpr auto fields()
+        {
+            return std::make_tuple(jbind("name", &S72Material::name), jbind("normalMap", &S72Material::normalMap),
+                                   jbind("pbr", &S72Material::pbr), jbind("lambertian", &S72Material::lambertian),
+                                   jbind("ssr", &S72Material::ssr), jbind("mirror", &S72Material::mirror),
+                                   jbind("environment", &S72Material::environment));
         }
     };
 
-    struct MaterialSSR : Material
+    struct S72Environment
     {
-        Texture* albedoTex = null;
-        Texture* specularTex = null;
+        std::string_view name;
+        jvalue* radiance = null;
 
-        MaterialSSR()
+        static constexpr auto fields()
         {
-            this->type = &materialTypeSSR;
+            return std::make_tuple(jbind("name", &S72Environment::name), jbind("radiance", &S72Environment::radiance));
         }
+    };
 
-        ~MaterialSSR() override
+    // Parameters of every light kind; each kind only uses some of them
+    struct S72LightKind
+    {
+        float angle = 0;
+        float strength = 0;
+        float radius = 0;
+        float power = 0;
+        std::optional<float> limit;
+        float fov = 0;
+        float blend = 0;
+
+        static constexpr auto fields()
         {
-            delete albedoTex;
-            delete specularTex;
+            return std::make_tuple(jbind("angle", &S72LightKind::angle), jbind("strength", &S72LightKind::strength),
+                                   jbind("radius", &S72LightKind::radius), jbind("power", &S72LightKind::power),
+                                   jbind("limit", &S72LightKind::limit), jbind("fov", &S72LightKind::fov),
+                                   jbind("blend", &S72LightKind::blend));
         }
+    };
 
-        void createDescriptorSets(VkDevice &device) override
+    struct S72Light
+    {
+        std::string_view name;
+        jarray* tint = null;
+        std::optional<S72LightKind> sun;
+        std::optional<S72LightKind> sphere;
+        std::optional<S72LightKind> spot;
+        int32_t shadow = 0;
+
+        static constexpr auto fields()
         {
-            Material::createDescriptorSets(device);
-            for (size_t i = 0; i < max_frames_in_flight; i++)
-            {
-                VkDescriptorImageInfo normalInfo {};
-                normalInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                normalInfo.imageView = normalMap->imageView;
-                normalInfo.sampler = normalMap->sampler;
+            return std::make_tuple(jbind("name", &S72Light::name), jbind("tint", &S72Light::tint),
+                                   jbind("sun", &S72Light::sun), jbind("sphere", &S72Light::sphere),
+                                   jbind("spot", &S72Light::spot), jbind("shadow", &S72Light::shadow));
+        }
+    };
 
-                VkDescriptorImageInfo albedoInfo {};
-                albedoInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                albedoInfo.imageView = albedoTex->imageView;
-                albedoInfo.sampler = albedoTex->sampler;
+    static NumberSpan decodeNumbers(jarray* a, SceneElement& e)
+    {
+        if (a == null)
+            return NumberSpan {};
 
-                VkDescriptorImageInfo specularInfo {};
-                specularInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                specularInfo.imageView = specularTex->imageView;
-                specularInfo.sampler = specularTex->sampler;
+        if (a->dense || a->size() == 0)
+            return NumberSpan {a->numbers, a->numberCount};
 
-                std::array<VkDescriptorImageInfo, 3> imageInfos {normalInfo, albedoInfo, specularInfo};
+        e.copies.emplace_back(a->to_vector<double>());
+        return NumberSpan {e.copies.back().data(), e.copies.back().size()};
+    }
 
-                std::array<VkWriteDescriptorSet, 1> descriptorWrites {};
+    static vec3 decodeVec3(jarray* a)
+    {
+        return vec3((float) a->number(0), (float) a->number(1), (float) a->number(2));
+    }
 
-                descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-                descriptorWrites[0].dstSet = descriptorSets[i];
-                descriptorWrites[0].dstBinding = 0;
-                descriptorWrites[0].dstArrayElement = 0;
-                descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-                descriptorWrites[0].descriptorCount = imageInfos.size();
-                descriptorWrites[0].pImageInfo = imageInfos.data();
+    // Textures are given inline as a color or a single number, or as an object naming an image
+    static TextureSource decodeTexture(jvalue* v, const SceneWords& words)
+    {
+        TextureSource t;
 
-                vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, null);
-            }
+        if (v->type == type_array)
+            t.color = decodeVec3(jarray::cast(v));
+        else if (v->type == type_number)
+        {
+            auto f = (float) jnumber::cast(v)->value;
+            t.color = vec3(f, f, f);
         }
-    };
+        else
+        {
+            S72TextureFile file;
+            jdecode(v, file);
 
-    struct MaterialLambertian : Material
-    {
-        Texture* albedoTex = null;
+            t.constant = false;
+            t.src = file.src;
 
-        MaterialLambertian()
-        {
-            this->type = &materialTypeLambertian;
+            if (file.type != null)
+                t.cube = words.is(file.type, words.cube);
+
+            if (file.format != null)
+                t.rgbe = words.is(file.format, words.rgbe);
         }
 
-        ~MaterialLambertian() override
+        return t;
+    }
+
+    static void decodeElement(int i, jvalue* v, SceneElement& e, const SceneWords& words)
+    {
+        // The header is kept as an element with only a name, so that the cache has one record per element too
+        if (i == 0)
         {
-            delete albedoTex;
+            e.type = SceneElement::s72Header;
+            e.name = jstring::cast(v)->value;
+            return;
         }
 
-        void createDescriptorSets(VkDevice &device) override
+        jvalue* type = (*jobject::cast(v))["type"];
+        if (words.is(type, words.scene))
         {
-            Material::createDescriptorSets(device);
-            for (size_t i = 0; i < max_frames_in_flight; i++)
-            {
-                VkDescriptorImageInfo normalInfo {};
-                normalInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                normalInfo.imageView = normalMap->imageView;
-                normalInfo.sampler = normalMap->sampler;
+            S72Scene o;
+            jdecode(v, o);
 
-                VkDescriptorImageInfo imageInfo {};
-                imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                imageInfo.imageView = albedoTex->imageView;
-                imageInfo.sampler = albedoTex->sampler;
+            e.type = SceneElement::s72Scene;
+            e.name = o.name;
+            e.roots = decodeNumbers(o.roots, e);
+        }
+        else if (words.is(type, words.node))
+        {
+            S72Node o;
+            jdecode(v, o);
 
-                std::array<VkDescriptorImageInfo, 2> imageInfos {normalInfo, imageInfo};
+            e.type = SceneElement::s72Node;
+            e.name = o.name;
 
-                std::array<VkWriteDescriptorSet, 1> descriptorWrites {};
-                descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-                descriptorWrites[0].dstSet = descriptorSets[i];
-                descriptorWrites[0].dstBinding = 0;
-                descriptorWrites[0].dstArrayElement = 0;
-                descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-                descriptorWrites[0].descriptorCount = imageInfos.size();
-                descriptorWrites[0].pImageInfo = imageInfos.data();
+            if (o.translation != null)
+                e.translation = decodeVec3(o.translation);
 
-                vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, null);
-            }
+            if (o.rotation != null)
+                e.rotation = vec4(o.rotation->number(0), o.rotation->number(1), o.rotation->number(2), o.rotation->number(3));
+
+            if (o.scale != null)
+                e.scale = decodeVec3(o.scale);
+
+            e.children = decodeNumbers(o.children, e);
+            e.camera = o.camera;
+            e.mesh = o.mesh;
+            e.environment = o.environment;
+            e.light = o.light;
         }
-    };
+        else if (words.is(type, words.camera))
+        {
+            S72Camera o;
+            jdecode(v, o);
 
-    struct MaterialMirror : Material
-    {
-        MaterialMirror()
+            e.type = SceneElement::s72Camera;
+            e.name = o.name;
+            e.aspect = o.perspective.aspect;
+            e.vfov = o.perspective.vfov;
+            e.near = o.perspective.near;
+            e.hasFar = o.perspective.far.has_value();
+            e.far = o.perspective.far.value_or(0);
+        }
+        else if (words.is(type, words.mesh))
         {
-            this->type = &materialTypeMirror;
+            S72Mesh o;
+            jdecode(v, o);
+
+            e.type = SceneElement::s72Mesh;
+            e.name = o.name;
+            e.topology = o.topology;
+            e.count = o.count;
+            e.material = o.material;
+
+            for (const jmember& m: o.attributes->elements)
+            {
+                S72Attribute a;
+                jdecode(m.value, a);
+                e.attributes.push_back({m.key, a.src, a.offset, a.stride, a.format});
+            }
         }
+        else if (words.is(type, words.driver))
+        {
+            S72Driver o;
+            jdecode(v, o);
 
-        void createDescriptorSets(VkDevice &device) override
+            e.type = SceneElement::s72Driver;
+            e.name = o.name;
+            e.node = o.node;
+
+            if (words.is(o.channel, words.translation))
+                e.channel = SceneElement::channelTranslation;
+            else if (words.is(o.channel, words.rotation))
+                e.channel = SceneElement::channelRotation;
+            else if (words.is(o.channel, words.scale))
+                e.channel = SceneElement::channelScale;
+
+            e.times = decodeNumbers(o.times, e);
+            e.values = decodeNumbers(o.values, e);
+            e.interpolation = o.interpolation;
+        }
+        else if (words.is(type, words.material))
         {
-            Material::createDescriptorSets(device);
-            for (size_t i = 0; i < max_frames_in_flight; i++)
+            S72Material o;
+            jdecode(v, o);
+
+            e.type = SceneElement::s72Material;
+            e.name = o.name;
+
+            if (o.normalMap != null)
+                e.normalMap = decodeTexture(o.normalMap, words);
+            else
+                e.normalMap.color = vec3(0.5, 0.5, 1);
+
+            if (o.pbr)
             {
-                VkDescriptorImageInfo normalInfo {};
-                normalInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                normalInfo.imageView = normalMap->imageView;
-                normalInfo.sampler = normalMap->sampler;
+                e.model = SceneElement::materialPBR;
+                e.albedo = decodeTexture(o.pbr->albedo, words);
+                e.roughness = decodeTexture(o.pbr->roughness, words);
+                e.metalness = decodeTexture(o.pbr->metalness, words);
+            }
+            else if (o.lambertian)
+            {
+                e.model = SceneElement::materialLambertian;
+                e.albedo = decodeTexture(o.lambertian->albedo, words);
+            }
+            else if (o.ssr)
+            {
+                e.model = SceneElement::materialSSR;
+                e.albedo = decodeTexture(o.ssr->albedo, words);
+                e.specular = decodeTexture(o.ssr->specular, words);
+            }
+            else if (o.mirror != null)
+                e.model = SceneElement::materialMirror;
+            else if (o.environment != null)
+                e.model = SceneElement::materialEnvironment;
+        }
+        else if (words.is(type, words.environment))
+        {
+            S72Environment o;
+            jdecode(v, o);
 
-                std::array<VkDescriptorImageInfo, 1> imageInfos {normalInfo};
+            e.type = SceneElement::s72Environment;
+            e.name = o.name;
+            e.radiance = decodeTexture(o.radiance, words);
+        }
+        else if (words.is(type, words.light))
+        {
+            S72Light o;
+            jdecode(v, o);
 
-                std::array<VkWriteDescriptorSet, 1> descriptorWrites {};
-                descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-                descriptorWrites[0].dstSet = descriptorSets[i];
-                descriptorWrites[0].dstBinding = 0;
-                descriptorWrites[0].dstArrayElement = 0;
-                descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-                descriptorWrites[0].descriptorCount = imageInfos.size();
-                descriptorWrites[0].pImageInfo = imageInfos.data();
+            e.type = SceneElement::s72Light;
+            e.name = o.name;
+            e.tint = decodeVec3(o.tint);
 
-                vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, null);
+            // Only the first of these that is present counts
+            if (o.sun)
+            {
+                e.kind = SceneElement::lightSun;
+                e.angle = o.sun->angle;
+                e.strength = o.sun->strength;
+            }
+            else if (o.sphere || o.spot)
+            {
+                bool spot = !o.sphere;
+                const S72LightKind& l = spot ? *o.spot : *o.sphere;
+                e.kind = spot ? SceneElement::lightSpot : SceneElement::lightSphere;
+                e.radius = l.radius;
+                e.power = l.power;
+                e.hasLimit = l.limit.has_value();
+                e.limit = l.limit.value_or(0);
+
+                if (spot)
+                {
+                    e.fov = l.fov;
+                    e.blend = l.blend;
+                    e.shadow = o.shadow;
+                }
             }
         }
+    }
+
+    // Scene cache (.s72b): the decoded elements of an s72 file, written next to it after the first load and mapped
+    // instead of parsing the text while the text's content hash still matches. The text's size and modification time
+    // are kept too, so that the text is only read and hashed again once either changes. After the header, each element
+    // is written field by field in the order given by transferElement, with number arrays 8-byte aligned so that they
+    // can be used in place from the mapping.
+    static const uint32_t sceneCacheVersion = 4;
+
+    struct SceneCacheHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t contentHash;
+        FileStamp text;
+        uint64_t size;
+        uint64_t elementCount;
     };
 
-    struct MaterialEnvironment : Material
+    // Writes each element to a temporary file as it is added, so that writing the cache holds no more of the scene in
+    // memory than loading it does. The file only replaces the cache once save() has completed it.
+    struct SceneCacheWriter
     {
-        MaterialEnvironment()
+        std::string filename;
+        std::string temp;
+        std::ofstream file;
+        uint64_t size = 0;
+        uint64_t elementCount = 0;
+
+        // Starts with room for the header, which save() fills in once the size and element count are known
+        void open(const std::string& filename)
         {
-            this->type = &materialTypeEnvironment;
+            this->filename = filename;
+            this->temp = filename + ".tmp";
+            file.open(temp, std::ios::binary);
+
+            SceneCacheHeader header {};
+            value(header);
         }
 
-        void createDescriptorSets(VkDevice &device) override
+        void write(const void* p, size_t n)
         {
-            Material::createDescriptorSets(device);
-            for (size_t i = 0; i < max_frames_in_flight; i++)
-            {
-                VkDescriptorImageInfo normalInfo {};
-                normalInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-                normalInfo.imageView = normalMap->imageView;
-                normalInfo.sampler = normalMap->sampler;
+            file.write((const char*) p, (long) n);
+            size += n;
+        }
 
-                std::array<VkDescriptorImageInfo, 1> imageInfos {normalInfo};
+        template<typename T>
+        void value(T& v)
+        {
+            static_assert(std::is_trivially_copyable_v<T>);
+            write(&v, sizeof(T));
+        }
 
-                std::array<VkWriteDescriptorSet, 1> descriptorWrites {};
-                descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-                descriptorWrites[0].dstSet = descriptorSets[i];
-                descriptorWrites[0].dstBinding = 0;
-                descriptorWrites[0].dstArrayElement = 0;
-                descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-                descriptorWrites[0].descriptorCount = imageInfos.size();
-                descriptorWrites[0].pImageInfo = imageInfos.data();
+        void string(std::string_view& s)
+        {
+            auto n = (uint32_t) s.size();
+            value(n);
+            write(s.data(), n);
+        }
 
-                vkUpdateDescriptorSets(device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, null);
+        void numbers(NumberSpan& s)
+        {
+            static const char padding[8] {};
+
+            auto n = (uint64_t) s.size;
+            value(n);
+            write(padding, ((size + 7) & ~(uint64_t) 7) - size);
+            write(s.data, n * sizeof(double));
+        }
+
+        // Failing to write the cache only costs the next load its speedup, so it is not an error
+        void save(uint64_t contentHash, FileStamp text)
+        {
+            SceneCacheHeader header {{'S', '7', '2', 'B'}, sceneCacheVersion, contentHash, text, size, elementCount};
+            file.seekp(0);
+            file.write((const char*) &header, sizeof(header));
+            file.close();
+
+            if (!file || rename(temp.c_str(), filename.c_str()) != 0)
+            {
+                printf("Writing scene cache %s failed\n", filename.c_str());
+                remove(temp.c_str());
             }
         }
-    };
 
-    struct Light
-    {
-        bool isSun = false;
-        std::string name;
-        float power;
-        vec3 tint = vec3(0, 0, 0);
-        mat4 worldToLightTransform = mat4::I();
+        // Nothing is left behind if the scene failed to load before the cache was saved
+        ~SceneCacheWriter()
+        {
+            if (file.is_open())
+            {
+                file.close();
+                remove(temp.c_str());
+            }
+        }
     };
 
-    // Format of data sent to shader for lights
-    struct alignas(16) ShaderLight
+    struct SceneCacheReader
     {
-        mat4 worldToLight;
-        mat4 projection;
-        vec4 tintPower;
-        float radius;
-        float limit;
-        float fov;
-        float blend;
-        int isSun;
-        int shadowRes;
-    };
-
-    int samplesPerPixel = 32;
-    const float sampleRadius = 0.25;
-    const float ambientOcclusionStrength = 1;
+        const char* data;
+        size_t size;
+        size_t offset = 0;
 
-    struct alignas(16) ShaderSample
-    {
-        vec4 pos;
-    };
+        void need(uint64_t n)
+        {
+            if (n > size - offset)
+                throw std::runtime_error("reading scene cache failed!");
+        }
 
-    std::vector<ShaderSample> shaderSamples {1024};
+        template<typename T>
+        void value(T& v)
+        {
+            static_assert(std::is_trivially_copyable_v<T>);
+            need(sizeof(T));
+            memcpy(&v, data + offset, sizeof(T));
+            offset += sizeof(T);
+        }
 
-    struct ShadowMap
-    {
-        std::vector<VkFramebuffer> framebuffers {max_frames_in_flight};
-        std::vector<VkImage> images {max_frames_in_flight};
-        std::vector<VkDeviceMemory> imageMemories {max_frames_in_flight};
-        std::vector<VkImageView> imageViews {max_frames_in_flight};
-        std::vector<VkSampler> samplers {max_frames_in_flight};
-        int resolution;
+        void string(std::string_view& s)
+        {
+            uint32_t n;
+            value(n);
+            need(n);
+            s = std::string_view(data + offset, n);
+            offset += n;
+        }
 
-        ShadowMap(int l, int res)
+        void numbers(NumberSpan& s)
         {
-            this->resolution = res;
+            uint64_t n;
+            value(n);
+            offset = std::min(size, (offset + 7) & ~(size_t) 7);
+            need(n > size / sizeof(double) ? size + 1 : n * sizeof(double));
+            s = NumberSpan {(const double*) (data + offset), n};
+            offset += n * sizeof(double);
         }
     };
 
-    struct SunLight : Light
+    template<typename A>
+    static void transferTexture(A& a, TextureSource& t)
     {
-        float angle;
+        a.value(t.constant);
+        a.value(t.color);
+        a.string(t.src);
+        a.value(t.cube);
+        a.value(t.rgbe);
+    }
 
-        SunLight(std::string name, vec3 tint, float angle, float power)
+    // The one description of the cache layout, used both to write elements and to read them back
+    template<typename A>
+    static void transferElement(A& a, SceneElement& e)
+    {
+        a.value(e.type);
+        a.string(e.name);
+
+        if (e.type == SceneElement::s72Scene)
+            a.numbers(e.roots);
+        else if (e.type == SceneElement::s72Node)
         {
-            this->isSun = true;
-            this->name = name;
-            this->tint = tint;
-            this->angle = angle;
-            this->power = power;
+            a.value(e.translation);
+            a.value(e.rotation);
+            a.value(e.scale);
+            a.numbers(e.children);
+            a.value(e.camera);
+            a.value(e.mesh);
+            a.value(e.environment);
+            a.value(e.light);
         }
-    };
+        else if (e.type == SceneElement::s72Camera)
+        {
+            a.value(e.aspect);
+            a.value(e.vfov);
+            a.value(e.near);
+            a.value(e.hasFar);
+            a.value(e.far);
+        }
+        else if (e.type == SceneElement::s72Mesh)
+        {
+            a.string(e.topology);
+            a.value(e.count);
+            a.value(e.material);
 
-    struct SpotLight : Light
-    {
-        float radius;
-        float limit;
+            auto n = (uint32_t) e.attributes.size();
+            a.value(n);
+            e.attributes.resize(n);
 
-        float fov;
-        float blend;
+            for (AttributeSource& attribute: e.attributes)
+            {
+                a.string(attribute.name);
+                a.string(attribute.src);
+                a.value(attribute.offset);
+                a.value(attribute.stride);
+                a.string(attribute.format);
+            }
+        }
+        else if (e.type == SceneElement::s72Driver)
+        {
+            a.value(e.node);
+            a.value(e.channel);
+            a.numbers(e.times);
+            a.numbers(e.values);
+            a.string(e.interpolation);
+        }
+        else if (e.type == SceneElement::s72Material)
+        {
+            a.value(e.model);
+            transferTexture(a, e.normalMap);
+            transferTexture(a, e.albedo);
+            transferTexture(a, e.roughness);
+            transferTexture(a, e.metalness);
+            transferTexture(a, e.specular);
+        }
+        else if (e.type == SceneElement::s72Environment)
+            transferTexture(a, e.radiance);
+        else if (e.type == SceneElement::s72Light)
+        {
+            a.value(e.tint);
+            a.value(e.kind);
+            a.value(e.angle);
+            a.value(e.strength);
+            a.value(e.radius);
+            a.value(e.power);
+            a.value(e.hasLimit);
+            a.value(e.limit);
+            a.value(e.fov);
+            a.value(e.blend);
+            a.value(e.shadow);
+        }
+    }
+
+    // Builds a Scene from s72 elements handed over one at a time in file order, so the parsed form of each element
+    // can be dropped as soon as it has been added. References between elements are kept as indices until finish().
+    struct SceneBuilder
+    {
+        struct NodeLinks
+        {
+            std::vector<int> children;
+            int camera = -1;
+            int mesh = -1;
+            int environment = -1;
+            int light = -1;
+        };
 
-        int shadowRes = 0;
+        struct DriverLinks
+        {
+            int node;
+            int32_t channel;
+            int driver;
+        };
 
-        SpotLight(std::string name, vec3 tint, float radius, float power, float limit = std::numeric_limits<float>::infinity(), float fov = -1, float blend = -1, int shadowRes = 0)
+        struct ElementSlot
         {
-            this->name = name;
-            this->tint = tint;
-            this->radius = radius;
-            this->power = power;
-            this->limit = limit;
-            this->fov = fov;
-            this->blend = blend;
-            this->shadowRes = shadowRes;
-        }
-    };
+            int32_t type = SceneElement::s72Unknown;
+            int32_t index = -1;
+        };
 
-    struct Node
-    {
-        std::string name;
+        Renderer* renderer;
+        Scene* scene = null;
 
-        mat4 transform;
-        mat4 invTransform;
+        // Receives a copy of every element added, if set
+        SceneCacheWriter* cache = null;
 
-        vec3 translation;
-        vec4 rotation;
-        vec3 scale;
+        // Parsers feeding this builder intern their strings here
+        SceneWords words;
 
-        Driver<dvec3>* translationDriver = null;
-        Driver<dvec4>* rotationDriver = null;
-        Driver<dvec3>* scaleDriver = null;
+        // Textures read from image files, loaded together by finish()
+        std::vector<Texture*> textures;
 
-        std::vector<Node*> children;
-        Camera* camera = null;
-        Mesh* mesh = null;
-        Environment* environment = null;
-        Light* light = null;
+        // Every texture created so far, by the file, format, type and suffix it is read from or by its constant color.
+        // Elements that name the same texture share it.
+        std::unordered_map<std::string, Texture*> textureCache;
 
-        explicit Node(const std::string &name,
-                      vec3 translation = vec3(0.0f, 0.0f, 0.0f),
-                      vec4 rotation = vec4(0.0f, 0.0f, 0.0f, 1.0f),
-                      vec3 scale = vec3(1.0f, 1.0f, 1.0f))
-        {
-            this->translation = translation;
-            this->rotation = rotation;
-            this->scale = scale;
+        // Where each s72 element was added: its type, and its index in the table for that type
+        std::vector<ElementSlot> elements;
 
-            this->computeTransform();
-            this->name = name;
-        }
+        // The tables, in file order
+        std::vector<Node*> nodes;
+        std::vector<Mesh*> meshes;
+        std::vector<Camera*> cameras;
 
-        void computeDriverTransforms(float time)
-        {
-            if (this->translationDriver == null && this->scaleDriver == null && this->rotationDriver == null)
-                return;
+        std::vector<Driver<dvec3>*> translations;
+        std::vector<Driver<dvec4>*> rotations;
+        std::vector<Driver<dvec3>*> scales;
 
-            if (this->translationDriver != null)
-                this->translation = vec3(this->translationDriver->get(time).x, this->translationDriver->get(time).y, this->translationDriver->get(time).z);
+        std::vector<Environment*> environments;
+        std::vector<Material*> materials;
+        std::vector<Light*> lights;
 
-            if (this->rotationDriver != null)
-                this->rotation = vec4(this->rotationDriver->get(time).x, this->rotationDriver->get(time).y, this->rotationDriver->get(time).z, this->rotationDriver->get(time).w);
+        Environment* env = null;
 
-            if (this->scaleDriver != null)
-                this->scale = vec3(this->scaleDriver->get(time).x, this->scaleDriver->get(time).y, this->scaleDriver->get(time).z);
+        Camera* currentCam = null;
+        int currentCamIndex = 0;
 
-            this->computeTransform();
+        // References as s72 element indices, resolved by finish(). Node links and mesh materials are by table index,
+        // driver links are in file order.
+        std::vector<int> roots;
+        std::vector<NodeLinks> nodeLinks;
+        std::vector<DriverLinks> driverLinks;
+        std::vector<int> meshMaterials;
+
+        SceneBuilder(Renderer* r)
+        {
+            this->renderer = r;
         }
 
-        void computeTransform()
+        void add(int i, jvalue* v)
         {
-            this->transform = mat4::translation(translation) * mat4::rotate(rotation) * mat4::scale(scale);
-            this->invTransform = mat4::scale(vec3(1.0f / scale.x, 1.0f / scale.y, 1.0f / scale.z)) * mat4::rotate(vec4(rotation.xyz(), -rotation.w)) * mat4::translation(translation * -1.0f);
+            SceneElement e;
+            decodeElement(i, v, e, words);
+            add(i, e);
         }
 
-        void draw(VkCommandBuffer b, mat4 m, Camera* camera, bool enableCulling, float time)
+        Texture* texture(const TextureSource& t)
         {
-            assert(this);
-            this->computeDriverTransforms(time);
+            if (!t.constant)
+                return image(t, 1, "");
 
-            mat4 m2 = m * transform;
-            if (mesh != null)
-            {
-                mat4 t = camera->cameraUserOffsetTransform * m2;
-                bool culled = false;
+            char key[16];
+            snprintf(key, sizeof(key), "#%u,%u,%u", Texture::channel(t.color.x), Texture::channel(t.color.y), Texture::channel(t.color.z));
 
-                if (enableCulling)
-                {
-                    vec3 minPos;
-                    vec3 maxPos;
+            Texture*& cached = textureCache[key];
+            if (cached != null)
+                return cached->acquire();
 
-                    for (int i = 0; i < 2; i++)
-                    {
-                        for (int j = 0; j < 2; j++)
-                        {
-                            for (int k = 0; k < 2; k++)
-                            {
-                                vec4 pos = (t * vec4(mesh->corners[i][j][k], 1.0f));
+            cached = new Texture(renderer, t.color);
+            return cached;
+        }
 
-                                if (i == 0 && j == 0 && k == 0)
-                                {
-                                    minPos = pos.xyz();
-                                    maxPos = pos.xyz();
-                                    minPos.z = -pos.z;
-                                    maxPos.z = -pos.z;
-                                }
-                                else
-                                {
-                                    minPos = vec3(std::min(pos.x, minPos.x), std::min(pos.y, minPos.y),
-                                                  std::min(-pos.z, minPos.z));
-                                    maxPos = vec3(std::max(pos.x, maxPos.x), std::max(pos.y, maxPos.y),
-                                                  std::max(-pos.z, maxPos.z));
-                                }
-                            }
-                        }
-                    }
+        Texture* image(const TextureSource& t, int mipmapCount, const std::string& suffix)
+        {
+            std::string key = std::string(t.src) + suffix + (t.cube ? "|cube" : "|2d") + (t.rgbe ? "|rgbe" : "|linear") + "|" + std::to_string(mipmapCount);
 
-                    if (maxPos.z < camera->nearPlane || minPos.z > camera->farPlane)
-                        culled = true;
-                    else
-                    {
-                        float z = std::min(maxPos.z, camera->farPlane);
-                        float y = camera->verticalFOVTan * z;
-                        float x = y * camera->aspectRatio;
-                        culled = maxPos.y < -y || minPos.y > y || maxPos.x < -x || minPos.x > x;
-                    }
-                }
+            Texture*& cached = textureCache[key];
+            if (cached != null)
+                return cached->acquire();
 
-                if (culled)
-                    meshesCulled++;
-                else
-                {
-                    meshesDrawn++;
-                    mesh->draw(b, m2);
-                }
+            cached = textures.emplace_back(new Texture(renderer, t, mipmapCount, suffix));
+            return cached;
+        }
+
+        void add(int i, SceneElement& e)
+        {
+            if (cache != null)
+            {
+                transferElement(*cache, e);
+                cache->elementCount++;
             }
 
-            for (Node* n: children)
+            if (i >= (int) elements.size())
+                elements.resize(i + 1);
+
+            elements[i].type = e.type;
+
+            if (i == 0)
             {
-                n->draw(b, m2, camera, enableCulling, time);
+                assert(e.name == "s72-v1");
+                return;
             }
-        }
 
-        // Computes transforms for cameras and environments
-        void precomputeTransforms(mat4 m, mat4 mi)
-        {
-            mat4 m2 = m * transform;
-            mat4 m2i = invTransform * mi;
-            if (camera != null)
+            std::string name = std::string(e.name);
+            if (e.type == SceneElement::s72Scene)
             {
-                camera->cameraBaseToWorldTransform = m2;
-                camera->worldToCameraBaseTransform = m2i;
-                camera->updateTransform();
+                scene = new Scene(name);
+
+                for (size_t k = 0; k < e.roots.size; k++)
+                    roots.emplace_back((int) e.roots[k]);
             }
+            else if (e.type == SceneElement::s72Node)
+            {
+                elements[i].index = (int32_t) nodes.size();
+                nodes.emplace_back(new Node(name, e.translation, e.rotation, e.scale));
 
-            if (environment != null)
-                environment->worldToEnvironmentTransform = m2i;
+                NodeLinks& links = nodeLinks.emplace_back();
+                for (size_t k = 0; k < e.children.size; k++)
+                    links.children.emplace_back((int) e.children[k]);
 
-            for (Node* n: children)
+                links.camera = e.camera;
+                links.mesh = e.mesh;
+                links.environment = e.environment;
+                links.light = e.light;
+            }
+            else if (e.type == SceneElement::s72Camera)
             {
-                n->precomputeTransforms(m2, m2i);
+                Camera* camera;
+
+                if (e.hasFar)
+                    camera = new Camera(name, e.aspect, e.vfov, e.near, e.far);
+                else
+                    camera = new Camera(name, e.aspect, e.vfov, e.near);
+
+                elements[i].index = (int32_t) cameras.size();
+                cameras.emplace_back(camera);
+
+                // Enumerated cameras start at 1, after the detached camera
+                if (renderer->requestedCameraName == null || strcmp(name.c_str(), renderer->requestedCameraName) == 0)
+                {
+                    currentCamIndex = (int) cameras.size();
+                    currentCam = camera;
+                }
             }
-        }
+            else if (e.type == SceneElement::s72Mesh)
+            {
+                Mesh* mesh = new Mesh(renderer, name, e.count, std::string(e.topology));
 
-        // Computes shader information for lights
-        void precomputeLights(std::vector<ShaderLight> &shaderLights, std::vector<ShadowMap> &shadowMaps, bool init, int &shadowIndex, mat4 m, mat4 mi)
-        {
-            mat4 m2 = m * transform;
-            mat4 m2i = invTransform * mi;
+                for (const AttributeSource& a: e.attributes)
+                    mesh->attributes.insert(std::pair(std::string(a.name), Attribute(std::string(a.src), a.offset, a.stride, std::string(a.format))));
 
-            if (light != null)
+                elements[i].index = (int32_t) meshes.size();
+                meshes.emplace_back(mesh);
+                meshMaterials.emplace_back(e.material);
+            }
+            else if (e.type == SceneElement::s72Driver)
             {
-                if (light->isSun)
+                std::string interpolation = std::string(e.interpolation);
+
+                const NumberSpan& times = e.times;
+                const NumberSpan& values = e.values;
+
+                std::vector<double> keyTimes (times.data, times.data + times.size);
+
+                if (e.channel == SceneElement::channelTranslation)
                 {
-                    auto* s = (SunLight*) light;
-                    ShaderLight sl = {m2i, mat4::I(), vec4(s->tint, s->power), s->angle, -1, -1, -1, true};
-                    shaderLights.emplace_back(sl);
+                    std::vector<dvec3> keyValues (times.size);
+                    for (int i = 0; i < times.size; i++)
+                    {
+                        keyValues[i] = dvec3(values[3 * i], values[3 * i + 1], values[3 * i + 2]);
+                    }
+                    driverLinks.push_back({e.node, e.channel, (int) translations.size()});
+                    translations.emplace_back(new Driver<dvec3>(name, std::move(keyTimes), std::move(keyValues), interpolation));
                 }
-                else
+                else if (e.channel == SceneElement::channelRotation)
                 {
-                    auto* s = (SpotLight*) light;
-                    ShaderLight sl = {m2i, mat4::I(), vec4(s->tint, s->power), s->radius, s->limit, s->fov, s->blend, false};
-                    if (s->fov > 0)
+                    std::vector<dvec4> keyValues (times.size);
+                    for (int i = 0; i < times.size; i++)
                     {
-                        if (isinf(s->limit))
-                            sl.projection = mat4::infinitePerspective(1, s->fov, s->radius);
-                        else
-                            sl.projection = mat4::perspective(1, s->fov, s->radius, s->limit);
-
-                        sl.shadowRes = s->shadowRes;
-                        if (sl.shadowRes > 0)
-                        {
-                            shaderLights.emplace_back(sl);
-                            shadowIndex++;
-
-                            if (!init)
-                                shadowMaps.emplace_back(ShadowMap(shaderLights.size() - 1, sl.shadowRes));
-                        }
-                        else
-                            shaderLights.emplace_back(sl);
+                        keyValues[i] = dvec4(values[4 * i], values[4 * i + 1], values[4 * i + 2], values[4 * i + 3]);
                     }
-                    else
-                        shaderLights.emplace_back(sl);
+                    driverLinks.push_back({e.node, e.channel, (int) rotations.size()});
+                    rotations.emplace_back(new Driver<dvec4>(name, std::move(keyTimes), std::move(keyValues), interpolation));
+                }
+                else if (e.channel == SceneElement::channelScale)
+                {
+                    std::vector<dvec3> keyValues (times.size);
+                    for (int i = 0; i < times.size; i++)
+                    {
+                        keyValues[i] = dvec3(values[3 * i], values[3 * i + 1], values[3 * i + 2]);
+                    }
+                    driverLinks.push_back({e.node, e.channel, (int) scales.size()});
+                    scales.emplace_back(new Driver<dvec3>(name, std::move(keyTimes), std::move(keyValues), interpolation));
                 }
             }
+            else if (e.type == SceneElement::s72Material)
+            {
+                Texture* normalTex = texture(e.normalMap);
+                Material* material;
+
+                if (e.model == SceneElement::materialPBR)
+                {
+                    auto m = new MaterialPBR();
+                    m->albedoTex = texture(e.albedo);
+                    m->roughnessTex = texture(e.roughness);
+                    m->metalnessTex = texture(e.metalness);
+                    material = m;
+                }
+                else if (e.model == SceneElement::materialLambertian)
+                {
+                    auto m = new MaterialLambertian();
+                    m->albedoTex = texture(e.albedo);
+                    material = m;
+                }
+                else if (e.model == SceneElement::materialSSR)
+                {
+                    auto m = new MaterialSSR();
+                    m->albedoTex = texture(e.albedo);
+                    m->specularTex = texture(e.specular);
+                    material = m;
+                }
+                else if (e.model == SceneElement::materialMirror)
+                    material = new MaterialMirror();
+                else if (e.model == SceneElement::materialEnvironment)
+                    material = new MaterialEnvironment();
+                else
+                    material = new MaterialSimple();
 
-            for (Node* n: children)
+                material->type->instances++;
+                material->name = name;
+                material->normalMap = normalTex;
+                elements[i].index = (int32_t) materials.size();
+                materials.emplace_back(material);
+            }
+            else if (e.type == SceneElement::s72Environment)
             {
-                n->precomputeLights(shaderLights, shadowMaps, init, shadowIndex, m2, m2i);
+                env = new Environment(name, image(e.radiance, 5, ""), image(e.radiance, 1, ".l.png"));
+                elements[i].index = (int32_t) environments.size();
+                environments.emplace_back(env);
             }
-        }
-    };
+            else if (e.type == SceneElement::s72Light)
+            {
+                Light* light = null;
 
-    struct Scene
-    {
-        std::string name;
-        std::vector<Node*> roots;
+                if (e.kind == SceneElement::lightSun)
+                    light = new SunLight(name, e.tint, e.angle, e.strength);
+                else if (e.kind == SceneElement::lightSphere)
+                {
+                    if (!e.hasLimit)
+                        light = new SpotLight(name, e.tint, e.radius, e.power);
+                    else
+                        light = new SpotLight(name, e.tint, e.radius, e.power, e.limit);
+                }
+                else if (e.kind == SceneElement::lightSpot)
+                {
+                    float limit = e.hasLimit ? e.limit : std::numeric_limits<float>::infinity();
+                    light = new SpotLight(name, e.tint, e.radius, e.power, limit, e.fov, e.blend, e.shadow);
+                }
 
-        std::map<int, Node*> nodes;
-        std::map<int, Mesh*> meshes;
-        std::map<int, Camera*> cameras;
-        std::map<int, Driver<dvec3>*> translationDrivers;
-        std::map<int, Driver<dvec4>*> rotationDrivers;
-        std::map<int, Driver<dvec3>*> scaleDrivers;
-        std::map<int, Environment*> environments;
-        std::map<int, Material*> materials;
-        std::map<int, Light*> lights;
+                // Lights of no known kind are left out, so references to them fail like references to anything else
+                if (light != null)
+                {
+                    elements[i].index = (int32_t) lights.size();
+                    lights.emplace_back(light);
+                }
+            }
+        }
 
-        std::vector<ShaderLight> shaderLights {};
-        std::vector<ShadowMap> shadowMaps {};
-        int shadowCount = 0;
+        // The table index of element i, checking that it was added with the type it is referenced as
+        int resolve(int i, int32_t type)
+        {
+            if (i < 0 || i >= (int) elements.size() || elements[i].type != type || elements[i].index < 0)
+            {
+                printf("s72 element %d is referenced with the wrong type\n", i);
+                throw std::runtime_error("resolving scene references failed!");
+            }
 
-        bool drawingShadow = false;
-        int currentShadowMapIndex;
-        ShadowMap* currentShadowMap = null;
+            return elements[i].index;
+        }
 
-        Environment* defaultEnvironment;
-        Environment* environment;
+        Scene* finish()
+        {
+            renderer->loadTextures(textures);
 
-        // Cameras enumerated sequentially
-        std::map<int, Camera*> camerasEnumerated;
-        int currentCameraIndex = 0;
+            for (int n: roots)
+                scene->roots.emplace_back(nodes[resolve(n, SceneElement::s72Node)]);
 
-        int cameraCount = 1;
-        Camera* detachedCamera = new Camera("default", 1.5, PI / 2, 0.1);
-        Camera* debugCamera = new Camera("debug", 1.5, PI / 2, 0.1);
+            for (size_t i = 0; i < nodes.size(); i++)
+            {
+                Node* node = nodes[i];
+                const NodeLinks& links = nodeLinks[i];
 
-        Camera* currentCamera = detachedCamera;
-        bool debugCameraMode = false;
+                node->children.reserve(links.children.size());
+                for (int n: links.children)
+                    node->children.emplace_back(nodes[resolve(n, SceneElement::s72Node)]);
 
-        bool initialized = false;
+                if (links.camera >= 0)
+                    node->camera = cameras[resolve(links.camera, SceneElement::s72Camera)];
 
-        Scene(std::string name)
-        {
-            this->name = name;
-        }
+                if (links.mesh >= 0)
+                    node->mesh = meshes[resolve(links.mesh, SceneElement::s72Mesh)];
 
-        ~Scene()
-        {
-            for (auto n: nodes)
-                delete n.second;
+                if (links.environment >= 0)
+                    node->environment = environments[resolve(links.environment, SceneElement::s72Environment)];
 
-            for (auto n: meshes)
-                delete n.second;
+                if (links.light >= 0)
+                    node->light = lights[resolve(links.light, SceneElement::s72Light)];
+            }
 
-            for (auto n: cameras)
-                delete n.second;
+            // In file order, so a later driver for the same node and channel still wins
+            for (const DriverLinks& d: driverLinks)
+            {
+                Node* node = nodes[resolve(d.node, SceneElement::s72Node)];
+
+                if (d.channel == SceneElement::channelTranslation)
+                    node->translationDriver = translations[d.driver];
+                else if (d.channel == SceneElement::channelRotation)
+                    node->rotationDriver = rotations[d.driver];
+                else if (d.channel == SceneElement::channelScale)
+                    node->scaleDriver = scales[d.driver];
+            }
 
-            for (auto n: translationDrivers)
-                delete n.second;
+            for (size_t i = 0; i < meshes.size(); i++)
+            {
+                if (meshMaterials[i] >= 0)
+                    meshes[i]->material = materials[resolve(meshMaterials[i], SceneElement::s72Material)];
+            }
 
-            for (auto n: rotationDrivers)
-                delete n.second;
+            scene->camerasEnumerated.reserve(cameras.size() + 1);
+            scene->camerasEnumerated.emplace_back(scene->detachedCamera);
+            scene->camerasEnumerated.insert(scene->camerasEnumerated.end(), cameras.begin(), cameras.end());
+
+            scene->nodes = std::move(nodes);
+            scene->cameras = cameras;
+            scene->meshes = std::move(meshes);
+            scene->currentCameraIndex = currentCamIndex;
+            scene->cameraCount = (int) cameras.size() + 1;
+            scene->translationDrivers = std::move(translations);
+            scene->rotationDrivers = std::move(rotations);
+            scene->scaleDrivers = std::move(scales);
+            scene->environments = std::move(environments);
+            scene->materials = std::move(materials);
+            scene->lights = std::move(lights);
+
+            scene->defaultEnvironment = new Environment("default", new Texture(renderer, vec3(0, 0, 0), true), new Texture(renderer, vec3(0, 0, 0), true));
+
+            if (env != null)
+                scene->environment = env;
+            else
+                scene->environment = scene->defaultEnvironment;
 
-            for (auto n: scaleDrivers)
-                delete n.second;
+            if (currentCam != null)
+                scene->currentCamera = currentCam;
+            else if (renderer->requestedCameraName != null)
+            {
+                printf("Did not find any cameras matching requested camera name \"%s\". Try one of these:\n", renderer->requestedCameraName);
 
-            for (auto n: environments)
-                delete n.second;
+                for (Camera* c: cameras)
+                {
+                    printf("camera: \"%s\"\n", c->name.c_str());
+                }
 
-            for (auto n: materials)
-                delete n.second;
+                abort();
+            }
 
-            delete detachedCamera;
-            delete debugCamera;
-            delete defaultEnvironment;
+            return scene;
         }
     };
 
-    Scene* parseScene(jarray* sceneArray)
+    // Receives the events for a whole s72 file and hands each top-level element to a SceneBuilder as soon as it is
+    // complete. Only the element being read is ever held as a tree, in an arena that is reused for the next one.
+    struct SceneLoader
     {
-        Scene* scene;
-        std::map<int, Node*> nodes;
-        std::map<int, Mesh*> meshes;
-        std::map<int, Camera*> cameras;
+        SceneBuilder& builder;
+        jarena arena;
+        jbuilder element;
+        int depth = 0;
+        int index = 0;
 
-        std::map<int, Driver<dvec3>*> translations;
-        std::map<int, Driver<dvec4>*> rotations;
-        std::map<int, Driver<dvec3>*> scales;
+        SceneLoader(SceneBuilder& builder) : builder(builder), element(&arena)
+        {
+            element.denseNumbers = true;
+            element.atoms = &builder.words.atoms;
+        }
+
+        void added()
+        {
+            if (element.complete())
+            {
+                builder.add(index, element.root);
+                index++;
+                arena.reset();
+            }
+        }
 
-        std::map<int, Environment*> environments;
-        std::map<int, Material*> materials;
-        std::map<int, Light*> lights;
+        void start_object()
+        {
+            expectTopLevel();
+            element.start_object();
+        }
 
-        Environment* env = null;
+        void key(std::string_view k)
+        {
+            element.key(k);
+        }
 
-        int cameraCount = 1;
-        std::map<int, Camera*> camerasEnumerated;
+        void end_object()
+        {
+            element.end_object();
+            added();
+        }
 
-        Camera* currentCam = null;
-        int currentCamIndex = 0;
+        void start_array()
+        {
+            // The file itself is one array of elements
+            if (depth == 0)
+                depth = 1;
+            else
+                element.start_array();
+        }
 
-        // Initialize
-        int i = 0;
-        for (jvalue* v: sceneArray->elements)
+        void end_array()
         {
-            if (i == 0)
+            if (element.complete())
+                depth = 0;
+            else
             {
-                jstring* s = jstring::cast(v);
-                assert(s->value == "s72-v1");
-                i++;
-                continue;
+                element.end_array();
+                added();
             }
+        }
 
-            jobject* o = jobject::cast(v);
-            std::string type = jstring::cast((*o)["type"])->value;
-            if (type == "SCENE")
-            {
-                scene = new Scene(jstring::cast((*o)["name"])->value);
-            }
-            else if (type == "NODE")
-            {
-                std::string name = jstring::cast((*o)["name"])->value;
-                vec3 translation = vec3(0.0f, 0.0f, 0.0f);
-                vec4 rotation = vec4(0.0f, 0.0f, 0.0f, 1.0f);
-                vec3 scale = vec3(1.0f, 1.0f, 1.0f);
+        void string(std::string_view s)
+        {
+            expectTopLevel();
+            element.string(s);
+            added();
+        }
 
-                jarray* jtranslation = jarray::cast((*o)["translation"]);
-                if (jtranslation != null)
-                    translation = vec3(jnumber::cast((*jtranslation)[0])->value, jnumber::cast((*jtranslation)[1])->value, jnumber::cast((*jtranslation)[2])->value);
+        void number(double d)
+        {
+            expectTopLevel();
+            element.number(d);
+            added();
+        }
 
-                jarray* jrotation = jarray::cast((*o)["rotation"]);
-                if (jrotation != null)
-                    rotation = vec4(jnumber::cast((*jrotation)[0])->value, jnumber::cast((*jrotation)[1])->value, jnumber::cast((*jrotation)[2])->value, jnumber::cast((*jrotation)[3])->value);
+        void boolean(bool b)
+        {
+            expectTopLevel();
+            element.boolean(b);
+            added();
+        }
 
-                jarray* jscale = jarray::cast((*o)["scale"]);
-                if (jscale != null)
-                    scale = vec3(jnumber::cast((*jscale)[0])->value, jnumber::cast((*jscale)[1])->value, jnumber::cast((*jscale)[2])->value);
+        void null_value()
+        {
+            expectTopLevel();
+            element.null_value();
+            added();
+        }
 
-                nodes.insert(std::pair(i, new Node(name, translation, rotation, scale)));
-            }
-            else if (type == "CAMERA")
+        void expectTopLevel()
+        {
+            if (depth == 0)
             {
-                std::string name = jstring::cast((*o)["name"])->value;
-                jobject* perspective = jobject::cast((*o)["perspective"]);
-                float aspect = jnumber::cast((*perspective)["aspect"])->value;
-                float vfov = jnumber::cast((*perspective)["vfov"])->value;
-                float near = jnumber::cast((*perspective)["near"])->value;
-                jnumber* far = jnumber::cast((*perspective)["far"]);
+                printf("Scene file is not an array of elements\n");
+                throw std::runtime_error("parse failed");
+            }
+        }
+    };
 
-                Camera* camera;
+    // Builds the scene from a scene cache if there is one for exactly this text, otherwise returns null. The text is
+    // only hashed if its size or modification time differ from the cache's; if its content turns out to be the same
+    // anyway, the cache is given the new ones so that the next load need not hash it again.
+    Scene* loadSceneCache(const std::string& cacheName, const std::string& filename, FileStamp text)
+    {
+        if (access(cacheName.c_str(), R_OK) != 0)
+            return null;
 
-                if (far != null)
-                    camera = new Camera(name, aspect, vfov, near, far->value);
-                else
-                    camera = new Camera(name, aspect, vfov, near);
+        MappedFile file (cacheName);
+        SceneCacheReader reader {file.data, file.size};
+        SceneCacheHeader header {};
 
-                cameras.insert(std::pair(i, camera));
-                camerasEnumerated.insert(std::pair(cameraCount, camera));
+        if (file.size < sizeof(header))
+            return null;
 
-                if (requestedCameraName == null || strcmp(name.c_str(), requestedCameraName) == 0)
-                {
-                    currentCamIndex = cameraCount;
-                    currentCam = camera;
-                }
+        reader.value(header);
+        if (memcmp(header.magic, "S72B", 4) != 0 || header.version != sceneCacheVersion || header.size != file.size)
+            return null;
 
-                cameraCount++;
-            }
-            else if (type == "MESH")
-            {
-                std::string name = jstring::cast((*o)["name"])->value;
-                std::string topology = jstring::cast((*o)["name"])->value;
-                int count = (int) jnumber::cast((*o)["count"])->value;
-                jobject* attributes = jobject::cast((*o)["attributes"]);
-                Mesh* mesh = new Mesh(this, name, count, topology);
+        if (!(header.text == text))
+        {
+            MappedFile textFile (filename);
+            if (hashBytes(textFile.data, textFile.size) != header.contentHash)
+                return null;
 
-                for (auto ap: attributes->elements)
-                {
-                    jobject* a = jobject::cast(ap.second);
-                    std::string src = jstring::cast((*a)["src"])->value;
-                    auto offset = (size_t) jnumber::cast((*a)["offset"])->value;
-                    auto stride = (size_t) jnumber::cast((*a)["stride"])->value;
-                    std::string format = jstring::cast((*a)["format"])->value;
+            header.text = text;
+            std::fstream update (cacheName, std::ios::binary | std::ios::in | std::ios::out);
+            update.write((const char*) &header, sizeof(header));
+        }
 
-                    mesh->attributes.insert(std::pair(ap.first, Attribute(src, offset, stride, format)));
-                }
+        if (logStats)
+            printf("Using scene cache %s\n", cacheName.c_str());
 
-                meshes.insert(std::pair(i, mesh));
-            }
-            else if (type == "DRIVER")
-            {
-                std::string name = jstring::cast((*o)["name"])->value;
-                std::string channel = jstring::cast((*o)["channel"])->value;
-                jarray* times = jarray::cast((*o)["times"]);
-                jarray* values = jarray::cast((*o)["values"]);
-                std::string interpolation = jstring::cast((*o)["interpolation"])->value;
+        SceneBuilder builder (this);
+        for (uint64_t i = 0; i < header.elementCount; i++)
+        {
+            SceneElement e;
+            transferElement(reader, e);
+            builder.add((int) i, e);
+        }
 
-                std::vector<double> timesF (times->elements.size());
-                for (int i = 0; i < times->elements.size(); i++)
-                {
-                    timesF[i] = (float) jnumber::cast((*times)[i])->value;
-                }
+        return builder.finish();
+    }
 
-                if (channel == "translation")
-                {
-                    std::vector<dvec3> valuesF (times->elements.size());
-                    for (int i = 0; i < times->elements.size(); i++)
-                    {
-                        valuesF[i] = dvec3((float) jnumber::cast((*values)[3 * i])->value, (float) jnumber::cast((*values)[3 * i + 1])->value, (float) jnumber::cast((*values)[3 * i + 2])->value);
-                    }
-                    translations.insert(std::pair(i, new Driver<dvec3>(name, timesF, valuesF, interpolation)));
-                }
-                else if (channel == "rotation")
-                {
-                    std::vector<dvec4> valuesF (times->elements.size());
-                    for (int i = 0; i < times->elements.size(); i++)
-                    {
-                        valuesF[i] = dvec4((float) jnumber::cast((*values)[4 * i])->value, (float) jnumber::cast((*values)[4 * i + 1])->value, (float) jnumber::cast((*values)[4 * i + 2])->value, (float) jnumber::cast((*values)[4 * i + 3])->value);
-                    }
-                    rotations.insert(std::pair(i, new Driver<dvec4>(name, timesF, valuesF, interpolation)));
-                }
-                else if (channel == "scale")
-                {
-                    std::vector<dvec3> valuesF (times->elements.size());
-                    for (int i = 0; i < times->elements.size(); i++)
-                    {
-                        valuesF[i] = dvec3((float) jnumber::cast((*values)[3 * i])->value, (float) jnumber::cast((*values)[3 * i + 1])->value, (float) jnumber::cast((*values)[3 * i + 2])->value);
-                    }
-                    scales.insert(std::pair(i, new Driver<dvec3>(name, timesF, valuesF, interpolation)));
-                }
-            }
-            else if (type == "MATERIAL")
-            {
-                std::string name = jstring::cast((*o)["name"])->value;
-                jobject* normalMap = jobject::cast((*o)["normalMap"]);
-                Texture* normalTex = null;
-                if (normalMap != null)
-                    normalTex = new Texture(this, normalMap);
-                else
-                    normalTex = new Texture(this, vec3(0.5, 0.5, 1));
+    // Decodes the image files of the given textures on worker threads (all hardware threads if textureThreads is 0),
+    // while this thread creates the image of each one as soon as it is decoded, since uploads go through the one
+    // graphics queue. Each decoded texture holds its image as floats until uploaded, so workers only start on another
+    // texture while fewer than two per worker are decoded or being decoded and not yet uploaded.
+    void loadTextures(const std::vector<Texture*>& textures)
+    {
+        unsigned threads = textureThreads;
+        if (threads == 0)
+            threads = std::max(1u, std::thread::hardware_concurrency());
 
-                Material* material;
+        if (threads > textures.size())
+            threads = (unsigned) textures.size();
 
-                if ((*o)["pbr"] != null)
-                {
-                    auto m = new MaterialPBR();
-                    jobject* pbr = jobject::cast((*o)["pbr"]);
+        size_t maxPending = threads * 2;
 
-                    jvalue* albedo = (*pbr)["albedo"];
-                    if (albedo->type == type_array)
-                    {
-                        jarray* a = jarray::cast(albedo);
-                        m->albedoTex = new Texture(this, vec3((float) jnumber::cast((*a)[0])->value, (float) jnumber::cast((*a)[1])->value, (float) jnumber::cast((*a)[2])->value));
-                    }
-                    else
-                        m->albedoTex = new Texture(this, jobject::cast(albedo));
+        std::mutex mutex;
+        std::condition_variable changed;
+        std::deque<Texture*> decoded;
+        size_t next = 0;
+        size_t pending = 0;
+        bool stop = false;
+        std::exception_ptr error;
 
-                    jvalue* roughness = (*pbr)["roughness"];
-                    if (roughness->type == type_number)
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; t++)
+        {
+            workers.emplace_back([&]()
+            {
+                while (true)
+                {
+                    Texture* texture;
                     {
-                        auto v = (float) jnumber::cast(roughness)->value;
-                        m->roughnessTex = new Texture(this, vec3(v, v, v));
-                    }
-                    else
-                        m->roughnessTex = new Texture(this, jobject::cast(roughness));
+                        std::unique_lock<std::mutex> lock (mutex);
+                        changed.wait(lock, [&]() { return stop || next >= textures.size() || pending < maxPending; });
 
+                        if (stop || next >= textures.size())
+                            return;
 
-                    jvalue* metalness = (*pbr)["metalness"];
-                    if (metalness->type == type_number)
-                    {
-                        auto v = (float) jnumber::cast(metalness)->value;
-                        m->metalnessTex = new Texture(this, vec3(v, v, v));
+                        texture = textures[next++];
+                        pending++;
                     }
-                    else
-                        m->metalnessTex = new Texture(this, jobject::cast(metalness));
-
-                    material = m;
-                }
-                else if ((*o)["lambertian"] != null)
-                {
-                    auto m = new MaterialLambertian();
-                    jobject* lamb = jobject::cast((*o)["lambertian"]);
 
-                    jvalue* albedo = (*lamb)["albedo"];
-                    if (albedo->type == type_array)
+                    try
                     {
-                        jarray* a = jarray::cast(albedo);
-                        m->albedoTex = new Texture(this, vec3((float) jnumber::cast((*a)[0])->value, (float) jnumber::cast((*a)[1])->value, (float) jnumber::cast((*a)[2])->value));
+                        texture->load();
                     }
-                    else
-                        m->albedoTex = new Texture(this, jobject::cast(albedo));
-
-                    material = m;
-                }
-                else if ((*o)["ssr"] != null)
-                {
-                    auto m = new MaterialSSR();
-                    jobject* ssr = jobject::cast((*o)["ssr"]);
-
-                    jvalue* albedo = (*ssr)["albedo"];
-                    if (albedo->type == type_array)
+                    catch (...)
                     {
-                        jarray* a = jarray::cast(albedo);
-                        m->albedoTex = new Texture(this, vec3((float) jnumber::cast((*a)[0])->value, (float) jnumber::cast((*a)[1])->value, (float) jnumber::cast((*a)[2])->value), false);
-                    }
-                    else
-                        m->albedoTex = new Texture(this, jobject::cast(albedo));
+                        std::lock_guard<std::mutex> lock (mutex);
+                        if (!error)
+                            error = std::current_exception();
 
-                    jvalue* roughness = (*ssr)["specular"];
-                    if (roughness->type == type_number)
-                    {
-                        auto v = (float) jnumber::cast(roughness)->value;
-                        m->specularTex = new Texture(this, vec3(v, v, v));
+                        stop = true;
+                        changed.notify_all();
+                        return;
                     }
-                    else
-                        m->specularTex = new Texture(this, jobject::cast(roughness));
 
-                    material = m;
+                    std::lock_guard<std::mutex> lock (mutex);
+                    decoded.emplace_back(texture);
+                    changed.notify_all();
                 }
-                else if ((*o)["mirror"] != null)
-                    material = new MaterialMirror();
-                else if ((*o)["environment"] != null)
-                    material = new MaterialEnvironment();
-                else
-                    material = new MaterialSimple();
+            });
+        }
 
-                material->type->instances++;
-                material->name = name;
-                material->normalMap = normalTex;
-                materials.insert(std::pair(i, material));
-            }
-            else if (type == "ENVIRONMENT")
-            {
-                std::string name = jstring::cast((*o)["name"])->value;
-                jobject* ob = jobject::cast((*o)["radiance"]);
-                env = new Environment(name, new Texture(this, ob, 5), new Texture(this, ob, 1, ".l.png"));
-                environments.insert(std::pair(i, env));
-            }
-            else if (type == "LIGHT")
+        try
+        {
+            for (size_t i = 0; i < textures.size(); i++)
             {
-                std::string name = jstring::cast((*o)["name"])->value;
-                jarray* a = jarray::cast((*o)["tint"]);
-                vec3 tint = vec3((float) jnumber::cast((*a)[0])->value, (float) jnumber::cast((*a)[1])->value, (float) jnumber::cast((*a)[2])->value);
-
-                if ((*o)["sun"] != null)
+                Texture* texture;
                 {
-                    jobject* sun = jobject::cast((*o)["sun"]);
-                    float angle = (float) (jnumber::cast((*sun)["angle"])->value);
-                    float strength = (float) (jnumber::cast((*sun)["strength"])->value);
-                    SunLight* l = new SunLight(name, tint, angle, strength);
-                    lights.insert(std::pair(i, l));
-                }
-                else if ((*o)["sphere"] != null)
-                {
-                    jobject* sphere = jobject::cast((*o)["sphere"]);
-                    float radius = (float) (jnumber::cast((*sphere)["radius"])->value);
-                    float power = (float) (jnumber::cast((*sphere)["power"])->value);
+                    std::unique_lock<std::mutex> lock (mutex);
+                    changed.wait(lock, [&]() { return stop || !decoded.empty(); });
 
-                    auto lim = jnumber::cast((*sphere)["limit"]);
-                    SpotLight* l;
-
-                    if (lim == null)
-                        l = new SpotLight(name, tint, radius, power);
-                    else
-                        l = new SpotLight(name, tint, radius, power, (float) (lim->value));
+                    if (stop)
+                        break;
 
-                    lights.insert(std::pair(i, l));
+                    texture = decoded.front();
+                    decoded.pop_front();
                 }
-                else if ((*o)["spot"] != null)
-                {
-                    jobject* spot = jobject::cast((*o)["spot"]);
-                    float radius = (float) (jnumber::cast((*spot)["radius"])->value);
-                    float power = (float) (jnumber::cast((*spot)["power"])->value);
-                    auto lim = jnumber::cast((*spot)["limit"]);
-                    float limit;
-                    float fov = (float) (jnumber::cast((*spot)["fov"])->value);
-                    float blend = (float) (jnumber::cast((*spot)["blend"])->value);
-                    int shadow;
-
-                    auto jshadow = jnumber::cast((*o)["shadow"]);
-
-                    if (lim != null)
-                        limit = (float) (lim->value);
-                    else
-                        limit = std::numeric_limits<float>::infinity();
 
-                    if (jshadow != null)
-                        shadow = (int) (jshadow->value);
-                    else
-                        shadow = 0;
+                texture->upload();
 
-                    SpotLight* l = new SpotLight(name, tint, radius, power, limit, fov, blend, shadow);
-                    lights.insert(std::pair(i, l));
-                }
+                std::lock_guard<std::mutex> lock (mutex);
+                pending--;
+                changed.notify_all();
             }
-
-            i++;
         }
-
-        //Populate pointers
-        i = 0;
-        for (jvalue* v: sceneArray->elements)
+        catch (...)
         {
-            if (i == 0)
-            {
-                i++;
-                continue;
-            }
-
-            jobject *o = static_cast<jobject *>(v);
-            std::string type = jstring::cast((*o)["type"])->value;
-            if (type == "SCENE")
-            {
-                jarray* roots = jarray::cast((*o)["roots"]);
-                for (jvalue* v: roots->elements)
-                {
-                    int n = (int) jnumber::cast(v)->value;
-                    scene->roots.emplace_back(nodes.at(n));
-                }
-            }
-            else if (type == "NODE")
-            {
-                jarray* kids = jarray::cast((*o)["children"]);
-                if (kids != null)
-                {
-                    for (jvalue *v: kids->elements)
-                    {
-                        int n = (int) jnumber::cast(v)->value;
-                        nodes[i]->children.emplace_back(nodes.at(n));
-                    }
-                }
+            std::lock_guard<std::mutex> lock (mutex);
+            if (!error)
+                error = std::current_exception();
 
-                jnumber* camera = jnumber::cast((*o)["camera"]);
-                if (camera != null)
-                    nodes[i]->camera = cameras.at((int) camera->value);
+            stop = true;
+            changed.notify_all();
+        }
 
-                jnumber* mesh = jnumber::cast((*o)["mesh"]);
-                if (mesh != null)
-                    nodes[i]->mesh = meshes.at((int) mesh->value);
+        for (auto& w: workers)
+        {
+            w.join();
+        }
 
-                jnumber* environment = jnumber::cast((*o)["environment"]);
-                if (environment != null)
-                    nodes[i]->environment = environments.at((int) environment->value);
+        if (error)
+            std::rethrow_exception(error);
+    }
 
-                jnumber* light = jnumber::cast((*o)["light"]);
-                if (light != null)
-                    nodes[i]->light = lights.at((int) light->value);
-            }
-            else if (type == "DRIVER")
-            {
-                int node = (int) jnumber::cast((*o)["node"])->value;
-                std::string channel = jstring::cast((*o)["channel"])->value;
-                if (channel == "translation")
-                    nodes[node]->translationDriver = translations[i];
-                else if (channel == "rotation")
-                    nodes[node]->rotationDriver = rotations[i];
-                else if (channel == "scale")
-                    nodes[node]->scaleDriver = scales[i];
-            }
-            else if (type == "MESH")
-            {
-                jnumber* material = jnumber::cast((*o)["material"]);
-                if (material != null)
-                    meshes[i]->material = materials.at((int) material->value);
-            }
+    // Reads the file in fixed-size chunks, so memory use is bounded by the scene objects rather than the file size.
+    // With more than one parse thread the whole file is mapped and its elements are parsed in parallel instead.
+    // Either way the decoded elements are saved as a scene cache next to the file for the next load, along with the
+    // content hash, which is taken over the text as it is parsed rather than by reading it separately.
+    Scene* parseScene(const std::string& filename)
+    {
+        std::string cacheName = filename + "b";
+        FileStamp text = fileStamp(filename);
+        uint64_t contentHash = 0;
 
-            i++;
+        if (sceneCache)
+        {
+            Scene* cached = loadSceneCache(cacheName, filename, text);
+            if (cached != null)
+                return cached;
         }
 
-        camerasEnumerated[0] = scene->detachedCamera;
+        SceneBuilder builder (this);
+        SceneCacheWriter cache;
+        if (sceneCache)
+        {
+            cache.open(cacheName);
+            builder.cache = &cache;
+        }
 
-        scene->nodes = nodes;
-        scene->cameras = cameras;
-        scene->camerasEnumerated = camerasEnumerated;
-        scene->meshes = meshes;
-        scene->currentCameraIndex = currentCamIndex;
-        scene->cameraCount = cameraCount;
-        scene->translationDrivers = translations;
-        scene->rotationDrivers = rotations;
-        scene->scaleDrivers = scales;
-        scene->environments = environments;
-        scene->materials = materials;
-        scene->lights = lights;
+        if (parseThreads != 1)
+        {
+            // The document's strings point into the mapping, so both stay alive until the builder is done
+            MappedFile file (filename);
+            jdocument document;
+            document.denseNumbers = true;
+            document.atoms = &builder.words.atoms;
+            jarray* elements = jarray::cast(document.parse_parallel(file.data, file.size, parseThreads));
 
-        scene->defaultEnvironment = new Environment("default", new Texture(this, vec3(0, 0, 0), true), new Texture(this, vec3(0, 0, 0), true));
+            if (sceneCache)
+                contentHash = hashBytes(file.data, file.size);
 
-        if (env != null)
-            scene->environment = env;
+            for (size_t i = 0; i < elements->size(); i++)
+            {
+                builder.add((int) i, (*elements)[i]);
+            }
+        }
         else
-            scene->environment = scene->defaultEnvironment;
-
-        if (currentCam != null)
-            scene->currentCamera = currentCam;
-        else if (requestedCameraName != null)
         {
-            printf("Did not find any cameras matching requested camera name \"%s\". Try one of these:\n", requestedCameraName);
+            std::ifstream file(filename, std::ios::binary);
+
+            if (!file.is_open())
+                throw std::runtime_error("opening file " + filename + " failed!");
 
-            for (auto p: cameras)
+            SceneLoader loader (builder);
+            jstream<SceneLoader> stream (loader);
+            StreamHash hash (text.size);
+
+            std::vector<char> chunk (4 << 20);
+            while (file)
             {
-                printf("camera: \"%s\"\n", p.second->name.c_str());
+                file.read(chunk.data(), (long) chunk.size());
+                stream.feed(chunk.data(), (size_t) file.gcount());
+
+                if (sceneCache)
+                    hash.feed(chunk.data(), (size_t) file.gcount());
             }
 
-            abort();
+            stream.finish();
+            contentHash = hash.finish();
         }
 
+        Scene* scene = builder.finish();
+
+        if (sceneCache)
+            cache.save(contentHash, text);
+
         return scene;
     }
 
+    // Uploads the vertices and indices of every mesh and the post-processing panel together, waiting for the GPU once
+    // per maxUploadBatchSize bytes rather than once per mesh
     void initMeshes()
     {
-        for (auto m: scene->meshes)
+        size_t inputVertices = 0;
+        size_t uploadedVertices = 0;
+        for (Mesh* m: scene->meshes)
+        {
+            m->prepare();
+            inputVertices += m->count;
+            uploadedVertices += m->vertexCount;
+        }
+
+        if (logStats)
+            printf("Mesh vertices: %zu in scene, %zu uploaded\n", inputVertices, uploadedVertices);
+
+        VkDeviceSize total = sizeof(postPanel);
+        VkDeviceSize largest = sizeof(postPanel);
+        for (Mesh* m: scene->meshes)
         {
-            m.second->initialize();
+            total += m->vertexBytes() + m->indexBytes() + 2 * UploadBatch::alignment;
+            largest = std::max(largest, std::max(m->vertexBytes(), m->indexBytes()));
         }
 
-        VkBuffer staging;
-        VkDeviceMemory stagingMemory;
-        createBuffer(sizeof(postPanel), VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, staging, stagingMemory);
+        UploadBatch batch (this, std::max(largest, std::min(total, maxUploadBatchSize)));
+
+        if (shareVertexBuffers)
+        {
+            // One pool per vertex layout, which the stride of the material type tells apart
+            std::map<u32, std::pair<VkDeviceSize, VkDeviceSize>> layoutSizes;
+            for (Mesh* m: scene->meshes)
+            {
+                auto& [vertexSize, indexSize] = layoutSizes[m->material->type->stride];
+                vertexSize += m->vertexBytes();
+                indexSize += m->indexBytes();
+            }
+
+            std::map<u32, VertexPool*> pools;
+            for (auto [stride, sizes]: layoutSizes)
+            {
+                if (sizes.first > 0)
+                    pools[stride] = vertexPools.emplace_back(std::make_unique<VertexPool>(this, stride, sizes.first, sizes.second)).get();
+            }
 
-        void* data;
-        vkMapMemory(device, stagingMemory, 0, sizeof(postPanel), 0, &data);
-        memcpy(data, postPanel.data(), sizeof(postPanel));
-        vkUnmapMemory(device, stagingMemory);
+            for (Mesh* m: scene->meshes)
+            {
+                m->initialize(batch, m->vertexBytes() > 0 ? pools[m->material->type->stride] : null);
+            }
+        }
+        else
+        {
+            for (Mesh* m: scene->meshes)
+            {
+                m->initialize(batch);
+            }
+        }
 
         createBuffer(sizeof(postPanel), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, panelBuffer, panelBufferMemory);
+        batch.add(panelBuffer, postPanel.data(), sizeof(postPanel));
 
-        copyBuffer(staging, panelBuffer, sizeof(postPanel));
+        batch.submit();
 
-        vkDestroyBuffer(device, staging, null);
-        vkFreeMemory(device, stagingMemory, null);
+        if (logStats)
+            memoryAllocator.printStats();
     }
 
     char* sceneName = null;
@@ -2058,6 +4504,12 @@ public:
     char* requestedCameraName = null;
     char* requestedPhysicalDeviceName = null;
     bool logStats = false;
+    unsigned parseThreads = 1;
+    unsigned textureThreads = 0;
+    bool sceneCache = true;
+    bool shareVertexBuffers = true;
+    bool generateIndices = true;
+    bool packVertices = false;
     bool hdr = false;
     bool postPass = true;
     bool ssao = true;
@@ -2071,8 +4523,8 @@ public:
         long time;
         int type;
 
-        float animTime;
-        float animRate;
+        double animTime;
+        double animRate;
         std::string text;
 
         HeadlessEvent(long time)
@@ -2081,10 +4533,12 @@ public:
             this->type = 0;
         }
 
-        HeadlessEvent(long time, float t, float r)
+        HeadlessEvent(long time, double t, double r)
         {
             this->time = time;
             this->type = 1;
+            this->animTime = t;
+            this->animRate = r;
         }
 
         HeadlessEvent(long time, std::string text, bool save)
@@ -2108,7 +4562,7 @@ public:
         int mode = 0;
         long time;
         int type = -1;
-        float animTime;
+        double animTime;
         for (int i = 0; i < text.size(); i++)
         {
             if (mode == 0 && text[i] == ' ')
@@ -2136,7 +4590,7 @@ public:
             {
                 std::string s = textStr.substr(lineStart, i - lineStart);
                 mode = 3;
-                animTime = std::stof(s);
+                animTime = std::stod(s);
                 lineStart = i + 1;
             }
 
@@ -2161,7 +4615,7 @@ public:
                 else if (mode == 3 && type == 1)
                 {
                     std::string s = textStr.substr(lineStart, i - lineStart);
-                    headlessEvents.emplace_back(HeadlessEvent(time, animTime, std::stof(s)));
+                    headlessEvents.emplace_back(HeadlessEvent(time, animTime, std::stod(s)));
                 }
 
                 mode = 0;
@@ -2192,18 +4646,18 @@ private:
 
     VkFormat intermediateImageFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
 
-    std::vector<VkDeviceMemory> swapChainImageMemory;
+    std::vector<DeviceAllocation> swapChainImageMemory;
 
     VkImage depthImage;
-    VkDeviceMemory depthImageMemory;
+    DeviceAllocation depthImageMemory;
     VkImageView depthImageView;
 
     VkImage normalImage;
-    VkDeviceMemory normalImageMemory;
+    DeviceAllocation normalImageMemory;
     VkImageView normalImageView;
 
     VkImage specularImage;
-    VkDeviceMemory specularImageMemory;
+    DeviceAllocation specularImageMemory;
     VkImageView specularImageView;
 
     GraphicsPipeline postPipeline;
@@ -2215,18 +4669,18 @@ private:
     std::vector<VkFramebuffer> swapChainFramebuffers;
 
     std::vector<VkBuffer> globalUniformBuffers;
-    std::vector<VkDeviceMemory> globalUniformBuffersMemory;
+    std::vector<DeviceAllocation> globalUniformBuffersMemory;
     std::vector<void*> globalUniformBuffersMapped;
 
     std::vector<VkBuffer> postUniformBuffers;
-    std::vector<VkDeviceMemory> postUniformBuffersMemory;
+    std::vector<DeviceAllocation> postUniformBuffersMemory;
     std::vector<void*> postUniformBuffersMapped;
 
     std::vector<VkBuffer> shaderStorageBuffers;
-    std::vector<VkDeviceMemory> shaderStorageBuffersMemory;
+    std::vector<DeviceAllocation> shaderStorageBuffersMemory;
 
     std::vector<VkBuffer> postShaderStorageBuffers;
-    std::vector<VkDeviceMemory> postShaderStorageBuffersMemory;
+    std::vector<DeviceAllocation> postShaderStorageBuffersMemory;
 
     VkDescriptorPool globalDescriptorPool;
     VkDescriptorSetLayout globalDescriptorSetLayout;
@@ -2248,28 +4702,31 @@ private:
     std::vector<VkFramebuffer> mainPassFramebuffers {max_frames_in_flight};
 
     std::vector<VkImage> mainPassImages {max_frames_in_flight};
-    std::vector<VkDeviceMemory> mainPassImageMemories {max_frames_in_flight};
+    std::vector<DeviceAllocation> mainPassImageMemories {max_frames_in_flight};
     std::vector<VkImageView> mainPassImageViews {max_frames_in_flight};
     std::vector<VkSampler> mainPassSamplers {max_frames_in_flight};
 
     std::vector<VkImage> mainPassDepthImages {max_frames_in_flight};
-    std::vector<VkDeviceMemory> mainPassDepthImageMemories {max_frames_in_flight};
+    std::vector<DeviceAllocation> mainPassDepthImageMemories {max_frames_in_flight};
     std::vector<VkImageView> mainPassDepthImageViews {max_frames_in_flight};
     std::vector<VkSampler> mainPassDepthSamplers {max_frames_in_flight};
 
     std::vector<VkImage> mainPassNormalImages {max_frames_in_flight};
-    std::vector<VkDeviceMemory> mainPassNormalImageMemories {max_frames_in_flight};
+    std::vector<DeviceAllocation> mainPassNormalImageMemories {max_frames_in_flight};
     std::vector<VkImageView> mainPassNormalImageViews {max_frames_in_flight};
     std::vector<VkSampler> mainPassNormalSamplers {max_frames_in_flight};
 
     std::vector<VkImage> mainPassSpecularImages {max_frames_in_flight};
-    std::vector<VkDeviceMemory> mainPassSpecularImageMemories {max_frames_in_flight};
+    std::vector<DeviceAllocation> mainPassSpecularImageMemories {max_frames_in_flight};
     std::vector<VkImageView> mainPassSpecularImageViews {max_frames_in_flight};
     std::vector<VkSampler> mainPassSpecularSamplers {max_frames_in_flight};
 
 
     VkBuffer panelBuffer;
-    VkDeviceMemory panelBufferMemory;
+    DeviceAllocation panelBufferMemory;
+
+    MemoryAllocator memoryAllocator {this};
+    std::vector<std::unique_ptr<VertexPool>> vertexPools;
 
     int mouseGrabbed = 0;
     bool rightMouseDown = false;
@@ -2280,6 +4737,8 @@ private:
     double mouseLastGrabY;
 
     MaterialType* currentMaterialType;
+    VkBuffer currentVertexBuffer = VK_NULL_HANDLE;
+    VkBuffer currentIndexBuffer = VK_NULL_HANDLE;
     Material defaultMaterial = MaterialSimple();
 
     u32 currentFrame = 0;
@@ -2291,8 +4750,8 @@ private:
 
     bool timeRecorded = false;
     std::chrono::steady_clock::time_point lastRecordedTime;
-    float currentTime = 0;
-    float timeRate = 1.0;
+    double currentTime = 0;
+    double timeRate = 1.0;
 
     void initWindow()
     {
@@ -3300,7 +5759,24 @@ private:
         auto attribDesc = T::getAttributeDesc();
 
         if (!post)
+        {
             material.stride = sizeof(T);
+            material.packed = std::is_same_v<T, PackedVertex>;
+        }
+
+        // Tells complex.vert which vertex format to decode. Shaders without the constant ignore it.
+        VkBool32 packed = std::is_same_v<T, PackedVertex>;
+        VkSpecializationMapEntry packedEntry {};
+        packedEntry.constantID = 0;
+        packedEntry.offset = 0;
+        packedEntry.size = sizeof(packed);
+
+        VkSpecializationInfo specialization {};
+        specialization.mapEntryCount = 1;
+        specialization.pMapEntries = &packedEntry;
+        specialization.dataSize = sizeof(packed);
+        specialization.pData = &packed;
+        shaderStages[0].pSpecializationInfo = &specialization;
 
         VkPipelineVertexInputStateCreateInfo vertII {};
         vertII.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
@@ -3563,6 +6039,23 @@ private:
         }
     }
 
+    // The pipelines of every material type that draws ComplexVertex meshes, taking vertices of type V
+    template<typename V>
+    void createComplexPipelines(VkPushConstantRange matrices)
+    {
+        createGraphicsPipeline<V>(materialTypeEnvironment, "spv/complex.vert.spv", "spv/environment.frag.spv", {matrices});
+        createGraphicsPipeline<V>(materialTypeMirror, "spv/complex.vert.spv", "spv/mirror.frag.spv", {matrices});
+        createGraphicsPipeline<V>(materialTypeLambertian, "spv/complex.vert.spv", "spv/lambertian.frag.spv", {matrices});
+        createGraphicsPipeline<V>(materialTypePBR, "spv/complex.vert.spv", "spv/pbr.frag.spv", {matrices});
+        createGraphicsPipeline<V>(materialTypeSSR, "spv/complex.vert.spv", "spv/ssr.frag.spv", {matrices});
+
+        createGraphicsPipeline<V>(materialTypeEnvironment, "spv/complex.vert.spv", "spv/depth_complex.frag.spv", {matrices}, true);
+        createGraphicsPipeline<V>(materialTypeMirror, "spv/complex.vert.spv", "spv/depth_complex.frag.spv", {matrices}, true);
+        createGraphicsPipeline<V>(materialTypeLambertian, "spv/complex.vert.spv", "spv/depth_complex.frag.spv", {matrices}, true);
+        createGraphicsPipeline<V>(materialTypePBR, "spv/complex.vert.spv", "spv/depth_complex.frag.spv", {matrices}, true);
+        createGraphicsPipeline<V>(materialTypeSSR, "spv/complex.vert.spv", "spv/depth_complex.frag.spv", {matrices}, true);
+    }
+
     void createGraphicsPipelines()
     {
         // Adapted from https://vkguide.dev/docs/chapter-3/push_constants/
@@ -3571,18 +6064,12 @@ private:
         matrices.size = sizeof(PushConstant);
         matrices.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
         createGraphicsPipeline<SimpleVertex>(materialTypeSimple, "spv/simple.vert.spv",  "spv/simple.frag.spv", {matrices});
-        createGraphicsPipeline<ComplexVertex>(materialTypeEnvironment, "spv/complex.vert.spv", "spv/environment.frag.spv", {matrices});
-        createGraphicsPipeline<ComplexVertex>(materialTypeMirror, "spv/complex.vert.spv", "spv/mirror.frag.spv", {matrices});
-        createGraphicsPipeline<ComplexVertex>(materialTypeLambertian, "spv/complex.vert.spv", "spv/lambertian.frag.spv", {matrices});
-        createGraphicsPipeline<ComplexVertex>(materialTypePBR, "spv/complex.vert.spv", "spv/pbr.frag.spv", {matrices});
-        createGraphicsPipeline<ComplexVertex>(materialTypeSSR, "spv/complex.vert.spv", "spv/ssr.frag.spv", {matrices});
-
         createGraphicsPipeline<SimpleVertex>(materialTypeSimple, "spv/simple.vert.spv",  "spv/depth_simple.frag.spv", {matrices}, true);
-        createGraphicsPipeline<ComplexVertex>(materialTypeEnvironment, "spv/complex.vert.spv", "spv/depth_complex.frag.spv", {matrices}, true);
-        createGraphicsPipeline<ComplexVertex>(materialTypeMirror, "spv/complex.vert.spv", "spv/depth_complex.frag.spv", {matrices}, true);
-        createGraphicsPipeline<ComplexVertex>(materialTypeLambertian, "spv/complex.vert.spv", "spv/depth_complex.frag.spv", {matrices}, true);
-        createGraphicsPipeline<ComplexVertex>(materialTypePBR, "spv/complex.vert.spv", "spv/depth_complex.frag.spv", {matrices}, true);
-        createGraphicsPipeline<ComplexVertex>(materialTypeSSR, "spv/complex.vert.spv", "spv/depth_complex.frag.spv", {matrices}, true);
+
+        if (packVertices)
+            createComplexPipelines<PackedVertex>(matrices);
+        else
+            createComplexPipelines<ComplexVertex>(matrices);
 
         if (postPass)
         {
@@ -3688,7 +6175,7 @@ private:
         return format == VK_FORMAT_D32_SFLOAT_S8_UINT || format == VK_FORMAT_D24_UNORM_S8_UINT;
     }
 
-    void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, VkDeviceMemory& imageMemory, size_t mips = 1, bool cube = false)
+    void createImage(uint32_t width, uint32_t height, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage, VkMemoryPropertyFlags properties, VkImage& image, DeviceAllocation& imageMemory, size_t mips = 1, bool cube = false)
     {
         VkImageCreateInfo imageInfo {};
         imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -3718,19 +6205,9 @@ private:
         VkMemoryRequirements memRequirements;
         vkGetImageMemoryRequirements(device, image, &memRequirements);
 
-        VkMemoryAllocateInfo allocInfo{};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memRequirements.size;
-        allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
-
-        result = vkAllocateMemory(device, &allocInfo, null, &imageMemory);
-        if (result != VK_SUCCESS)
-        {
-            printf("failed: %d\n", result);
-            throw std::runtime_error("memory allocation failed!");
-        }
-
-        vkBindImageMemory(device, image, imageMemory, 0);
+        // Linear images are laid out like buffers, so they can share their blocks
+        imageMemory = memoryAllocator.allocate(memRequirements, properties, tiling == VK_IMAGE_TILING_LINEAR ? memoryBuffer : memoryImage);
+        vkBindImageMemory(device, image, imageMemory.memory, imageMemory.offset);
     }
 
     VkImageView createImageView(VkImage image, VkFormat format, VkImageAspectFlags aspectFlags, size_t mips = 1, bool cube = false)
@@ -3881,7 +6358,7 @@ private:
 
     }
 
-    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags props, VkBuffer& buffer, VkDeviceMemory& bufMem)
+    void createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags props, VkBuffer& buffer, DeviceAllocation& bufMem)
     {
         VkBufferCreateInfo bufferInfo {};
         bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -3899,20 +6376,10 @@ private:
         VkMemoryRequirements memReq;
         vkGetBufferMemoryRequirements(device, buffer, &memReq);
 
-        VkMemoryAllocateInfo allocInfo {};
-        allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-        allocInfo.allocationSize = memReq.size;
-        allocInfo.memoryTypeIndex = findMemoryType(memReq.memoryTypeBits, props);
-
-        result = vkAllocateMemory(device, &allocInfo, null, &bufMem);
-        if (result != VK_SUCCESS)
-        {
-            printf("failed: %d\n", result);
-            abort();
-            throw std::runtime_error("buffer memory allocation failed!");
-        }
-
-        vkBindBufferMemory(device, buffer, bufMem, 0);
+        // Buffers that are only ever copied from are staging buffers, which are freed soon after
+        bool staging = usage == VK_BUFFER_USAGE_TRANSFER_SRC_BIT && (props & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
+        bufMem = memoryAllocator.allocate(memReq, props, staging ? memoryStaging : memoryBuffer);
+        vkBindBufferMemory(device, buffer, bufMem.memory, bufMem.offset);
     }
 
     void copyBuffer(VkBuffer src, VkBuffer dest, VkDeviceSize size)
@@ -3974,6 +6441,11 @@ private:
         endSingleTimeCommands(commandBuffer);
     }
 
+    void freeMemory(DeviceAllocation& a)
+    {
+        memoryAllocator.free(a);
+    }
+
     u32 findMemoryType(u32 typeFilter, VkMemoryPropertyFlags props)
     {
         VkPhysicalDeviceMemoryProperties memProps;
@@ -3999,7 +6471,7 @@ private:
         for (size_t i = 0; i < max_frames_in_flight; i++)
         {
             createBuffer(size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, globalUniformBuffers[i], globalUniformBuffersMemory[i]);
-            vkMapMemory(device, globalUniformBuffersMemory[i], 0, size, 0, &globalUniformBuffersMapped[i]);
+            globalUniformBuffersMapped[i] = globalUniformBuffersMemory[i].mapped;
         }
     }
 
@@ -4017,7 +6489,7 @@ private:
         for (size_t i = 0; i < max_frames_in_flight; i++)
         {
             createBuffer(size, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, postUniformBuffers[i], postUniformBuffersMemory[i]);
-            vkMapMemory(device, postUniformBuffersMemory[i], 0, size, 0, &postUniformBuffersMapped[i]);
+            postUniformBuffersMapped[i] = postUniformBuffersMemory[i].mapped;
         }
     }
 
@@ -4409,6 +6881,8 @@ private:
 
             vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, materialTypeSimple.getPipeline(scene)->pipeline);
             currentMaterialType = &materialTypeSimple;
+            currentVertexBuffer = VK_NULL_HANDLE;
+            currentIndexBuffer = VK_NULL_HANDLE;
 
             draw(commandBuffer);
 
@@ -4455,13 +6929,14 @@ private:
         VkBuffer vertexBuffers[] = { panelBuffer };
         VkDeviceSize offsets[] = { 0 };
         vkCmdBindVertexBuffers(commandBuffer, 0, 1, vertexBuffers, offsets);
+        currentVertexBuffer = panelBuffer;
         vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, postPipeline.layout, 0, 1, &(postDescriptorSets[currentFrame]), 0, null);
         vkCmdDraw(commandBuffer, postPanel.size(), 1, 0, 0);
 
         vkCmdEndRenderPass(commandBuffer);
     }
 
-    float lastHeadlessTime = 0;
+    double lastHeadlessTime = 0;
     void recordCommandBuffer(VkCommandBuffer commandBuffer, u32 imageIndex)
     {
         VkCommandBufferBeginInfo beginInfo {};
@@ -4499,6 +6974,8 @@ private:
         vkCmdBeginRenderPass(commandBuffer, &renderPassInfo, VK_SUBPASS_CONTENTS_INLINE);
         vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, materialTypeSimple.getPipeline(scene)->pipeline);
         currentMaterialType = &materialTypeSimple;
+        currentVertexBuffer = VK_NULL_HANDLE;
+        currentIndexBuffer = VK_NULL_HANDLE;
 
         VkViewport viewport {};
         viewport.x = 0.0f;
@@ -4547,47 +7024,45 @@ private:
         }
     }
 
-    void draw(VkCommandBuffer &commandBuffer)
+    // Evaluates animation and computes the transforms, cameras and lights of the frame, which every pass then draws
+    // with. Called once per frame, after the frame's uniform and storage buffers are free to be written.
+    void updateScene()
     {
-        mat4 transform = mat4::I();
-
         scene->detachedCamera->updateTransform();
 
         if (scene->debugCameraMode)
             scene->debugCamera->updateTransform();
 
-        if (scene != null)
-        {
-            for (auto r: scene->roots)
-            {
-                r->precomputeTransforms(mat4::I(), mat4::I());
-            }
+        scene->animation.update(currentTime);
+        scene->graph.update();
+        scene->graph.computeCameras();
 
-            scene->shaderLights.clear();
-            scene->shadowCount = 0;
-            for (auto r: scene->roots)
-            {
-                r->precomputeLights(scene->shaderLights, scene->shadowMaps, scene->initialized, scene->shadowCount, mat4::I(), mat4::I());
-            }
+        scene->shaderLights.clear();
+        scene->shadowCount = 0;
+        scene->graph.computeLights(scene->shaderLights, scene->shadowMaps, scene->initialized, scene->shadowCount);
+
+        updateUniformBuffer();
+        updateLightSSBOs();
 
-            updateUniformBuffer();
-            updateLightSSBOs();
+        // Shadowed lights come first once updateLightSSBOs() has sorted them, in the order of the shadow maps
+        scene->shadowCameras.clear();
+        for (size_t i = 0; i < scene->shadowMaps.size(); i++)
+        {
+            const ShaderLight& sl = scene->shaderLights[i];
+            Camera& cam = scene->shadowCameras.emplace_back("shadow", 1, sl.fov, sl.radius, sl.limit);
+            cam.cameraUserOffsetTransform = sl.worldToLight;
+        }
+    }
 
+    void draw(VkCommandBuffer &commandBuffer)
+    {
+        if (scene != null)
+        {
             Camera* cam = scene->currentCamera;
             if (scene->drawingShadow)
-            {
-                ShaderLight sl = scene->shaderLights[scene->currentShadowMapIndex];
-                cam = new Camera("shadow", 1, sl.fov, sl.radius, sl.limit);
-                cam->cameraUserOffsetTransform = sl.worldToLight;
-            }
-
-            for (auto r: scene->roots)
-            {
-                r->draw(commandBuffer, transform, cam, enableCulling, currentTime);
-            }
+                cam = &scene->shadowCameras[scene->currentShadowMapIndex];
 
-            if (scene->drawingShadow)
-                delete cam;
+            scene->graph.draw(commandBuffer, cam, enableCulling);
         }
     }
 
@@ -4617,9 +7092,14 @@ private:
 
     void load()
     {
-        std::string s = std::string(readFileWithCache(this->sceneName)->data());
-        jarray* o = jparse_array(s);
-        this->scene = parseScene(o);
+        auto start = std::chrono::high_resolution_clock::now();
+        this->scene = parseScene(this->sceneName);
+        scene->graph.build(scene->roots, scene->nodes);
+        scene->animation.build(scene->nodes);
+        auto end = std::chrono::high_resolution_clock::now();
+
+        if (logStats)
+            printf("Parsed scene in %lld\n", (long long) (end - start).count());
 
         // Add default material
         materialTypeSimple.instances++;
@@ -4629,17 +7109,16 @@ private:
             t->createDescriptorPool(device);
         }
 
-        for (auto m: scene->materials)
+        for (Material* m: scene->materials)
         {
-            m.second->createDescriptorSets(device);
+            m->createDescriptorSets(device);
         }
 
         defaultMaterial.createDescriptorSets(device);
 
-        for (auto r: scene->roots)
-        {
-            r->precomputeLights(scene->shaderLights, scene->shadowMaps, scene->initialized, scene->shadowCount, mat4::I(), mat4::I());
-        }
+        scene->animation.update(currentTime);
+        scene->graph.update();
+        scene->graph.computeLights(scene->shaderLights, scene->shadowMaps, scene->initialized, scene->shadowCount);
         scene->initialized = true;
     }
 
@@ -4831,7 +7310,7 @@ private:
 
         if (headless)
         {
-            float t = (float) headlessEvents[headlessIndex].time / 1000000.0f;
+            double t = (double) headlessEvents[headlessIndex].time / 1000000.0;
             currentTime += (t - lastHeadlessTime) * timeRate;
             lastHeadlessTime = t;
 
@@ -4878,12 +7357,12 @@ private:
             {
                 lastRecordedTime = std::chrono::high_resolution_clock::now();
                 timeRecorded = true;
-                currentTime = 0.0f;
+                currentTime = 0.0;
             }
             else
             {
                 auto now = std::chrono::high_resolution_clock::now();
-                currentTime += timeRate * std::chrono::duration<float, std::chrono::seconds::period>(
+                currentTime += timeRate * std::chrono::duration<double, std::chrono::seconds::period>(
                         now - lastRecordedTime).count();
                 lastRecordedTime = now;
             }
@@ -4895,6 +7374,8 @@ private:
 
         vkResetFences(device, 1, &inFlightFences[currentFrame]);
 
+        updateScene();
+
         vkResetCommandBuffer(commandBuffers[currentFrame], 0);
         recordCommandBuffer(commandBuffers[currentFrame], imageIndex);
 
@@ -5026,7 +7507,7 @@ private:
     void updateLightSSBOs()
     {
         VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
+        DeviceAllocation stagingBufferMemory;
         u32 size = scene->shaderLights.size() * sizeof(ShaderLight) + 16;
         createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer,
@@ -5051,17 +7532,15 @@ private:
             scene->shaderLights.emplace_back(sl);
         }
 
-        void *data;
-        vkMapMemory(device, stagingBufferMemory, 0, size, 0, &data);
+        void *data = stagingBufferMemory.mapped;
         memcpy((char*) data + 16, lights.data(), size - 16);
         u32 s = lights.size();
         memcpy(data, &s, 4);
-        vkUnmapMemory(device, stagingBufferMemory);
 
         copyBuffer(stagingBuffer, shaderStorageBuffers[currentFrame], size);
 
         vkDestroyBuffer(device, stagingBuffer, null);
-        vkFreeMemory(device, stagingBufferMemory, null);
+        freeMemory(stagingBufferMemory);
     }
 
     void setupShaderSamples()
@@ -5079,14 +7558,13 @@ private:
     void updateSampleSSBOs()
     {
         VkBuffer stagingBuffer;
-        VkDeviceMemory stagingBufferMemory;
+        DeviceAllocation stagingBufferMemory;
         u32 size = shaderSamples.size() * sizeof(ShaderSample) + 16;
         createBuffer(size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, stagingBuffer,
                      stagingBufferMemory);
 
-        void *data;
-        vkMapMemory(device, stagingBufferMemory, 0, size, 0, &data);
+        void *data = stagingBufferMemory.mapped;
         memcpy((char*) data + 16, shaderSamples.data(), size - 16);
 
         u32 s = shaderSamples.size();
@@ -5101,18 +7579,18 @@ private:
         r = ambientOcclusionStrength;
         memcpy((char*) data + 12, &r, 4);
 
-        vkUnmapMemory(device, stagingBufferMemory);
-
         copyBuffer(stagingBuffer, postShaderStorageBuffers[currentFrame], size);
 
         vkDestroyBuffer(device, stagingBuffer, null);
-        vkFreeMemory(device, stagingBufferMemory, null);
+        freeMemory(stagingBufferMemory);
     }
 
-    void updatePushConstants(mat4 m, u32 currentImage)
+    void updatePushConstants(mat4 m, u32 currentImage, vec3 positionScale = vec3(1, 1, 1), vec3 positionOffset = vec3(0, 0, 0))
     {
         PushConstant pc {};
         pc.modelView = m;
+        pc.positionScale = vec4(positionScale.x, positionScale.y, positionScale.z, 0);
+        pc.positionOffset = vec4(positionOffset.x, positionOffset.y, positionOffset.z, 0);
 
         if (scene->drawingShadow)
             pc.shadowMap = scene->currentShadowMapIndex;
@@ -5126,7 +7604,7 @@ private:
     void cleanup()
     {
         vkDestroyBuffer(device, panelBuffer, null);
-        vkFreeMemory(device, panelBufferMemory, null);
+        freeMemory(panelBufferMemory);
 
         for (ShadowMap &s: this->scene->shadowMaps)
         {
@@ -5136,7 +7614,7 @@ private:
                 vkDestroyImageView(device, s.imageViews[i], null);
 
                 vkDestroyImage(device, s.images[i], null);
-                vkFreeMemory(device, s.imageMemories[i], null);
+                freeMemory(s.imageMemories[i]);
 
                 vkDestroyFramebuffer(device, s.framebuffers[i], null);
             }
@@ -5145,6 +7623,8 @@ private:
         if (this->scene != null)
             delete this->scene;
 
+        vertexPools.clear();
+
         for (int i = 0; i < max_frames_in_flight; i++)
         {
             vkDestroySampler(device, mainPassSamplers[i], null);
@@ -5158,16 +7638,16 @@ private:
         for (size_t i = 0; i < max_frames_in_flight; i++)
         {
             vkDestroyBuffer(device, globalUniformBuffers[i], null);
-            vkFreeMemory(device, globalUniformBuffersMemory[i], null);
+            freeMemory(globalUniformBuffersMemory[i]);
             vkDestroyBuffer(device, shaderStorageBuffers[i], null);
-            vkFreeMemory(device, shaderStorageBuffersMemory[i], null);
+            freeMemory(shaderStorageBuffersMemory[i]);
 
             if (postPass)
             {
                 vkDestroyBuffer(device, postUniformBuffers[i], null);
-                vkFreeMemory(device, postUniformBuffersMemory[i], null);
+                freeMemory(postUniformBuffersMemory[i]);
                 vkDestroyBuffer(device, postShaderStorageBuffers[i], null);
-                vkFreeMemory(device, postShaderStorageBuffersMemory[i], null);
+                freeMemory(postShaderStorageBuffersMemory[i]);
             }
         }
 
@@ -5202,6 +7682,11 @@ private:
         }
 
         vkDestroyCommandPool(device, commandPool, null);
+
+        if (logStats)
+            memoryAllocator.printStats();
+
+        memoryAllocator.destroy();
         vkDestroyDevice(device, null);
 
         if (enable_validation_layers)
@@ -5222,15 +7707,15 @@ private:
     {
         vkDestroyImageView(device, depthImageView, null);
         vkDestroyImage(device, depthImage, null);
-        vkFreeMemory(device, depthImageMemory, null);
+        freeMemory(depthImageMemory);
 
         vkDestroyImageView(device, normalImageView, null);
         vkDestroyImage(device, normalImage, null);
-        vkFreeMemory(device, normalImageMemory, null);
+        freeMemory(normalImageMemory);
 
         vkDestroyImageView(device, specularImageView, null);
         vkDestroyImage(device, specularImage, null);
-        vkFreeMemory(device, specularImageMemory, null);
+        freeMemory(specularImageMemory);
         
         for (auto framebuffer: swapChainFramebuffers)
         {
@@ -5248,19 +7733,19 @@ private:
             {
                 vkDestroyImageView(device, mainPassImageViews[i], null);
                 vkDestroyImage(device, mainPassImages[i], null);
-                vkFreeMemory(device, mainPassImageMemories[i], null);
+                freeMemory(mainPassImageMemories[i]);
 
                 vkDestroyImageView(device, mainPassDepthImageViews[i], null);
                 vkDestroyImage(device, mainPassDepthImages[i], null);
-                vkFreeMemory(device, mainPassDepthImageMemories[i], null);
+                freeMemory(mainPassDepthImageMemories[i]);
 
                 vkDestroyImageView(device, mainPassNormalImageViews[i], null);
                 vkDestroyImage(device, mainPassNormalImages[i], null);
-                vkFreeMemory(device, mainPassNormalImageMemories[i], null);
+                freeMemory(mainPassNormalImageMemories[i]);
 
                 vkDestroyImageView(device, mainPassSpecularImageViews[i], null);
                 vkDestroyImage(device, mainPassSpecularImages[i], null);
-                vkFreeMemory(device, mainPassSpecularImageMemories[i], null);
+                freeMemory(mainPassSpecularImageMemories[i]);
 
                 vkDestroyFramebuffer(device, mainPassFramebuffers[i], null);
 
@@ -5373,6 +7858,12 @@ int main(int argc, char** args)
     bool hdr = false;
     int ssaoSamples = 0;
     bool ssr = false;
+    unsigned parseThreads = 1;
+    unsigned textureThreads = 0;
+    bool sceneCache = true;
+    bool shareVertexBuffers = true;
+    bool generateIndices = true;
+    bool packVertices = false;
 
     std::string events;
 
@@ -5423,6 +7914,29 @@ int main(int argc, char** args)
 
         if (strncmp(args[i], "--ssr", 5) == 0)
             ssr = true;
+
+        // 0 uses every hardware thread
+        if (strncmp(args[i], "--parse-threads", 15) == 0 && i + 1 < argc)
+            parseThreads = std::stoi(args[i + 1]);
+
+        // 0 uses every hardware thread
+        if (strncmp(args[i], "--texture-threads", 17) == 0 && i + 1 < argc)
+            textureThreads = std::stoi(args[i + 1]);
+
+        if (strncmp(args[i], "--no-scene-cache", 16) == 0)
+            sceneCache = false;
+
+        // Gives every mesh a vertex buffer of its own instead of sharing one per vertex layout
+        if (strncmp(args[i], "--no-vertex-pools", 17) == 0)
+            shareVertexBuffers = false;
+
+        // Draws meshes from their vertices as given, without building index buffers for them
+        if (strncmp(args[i], "--no-index-buffers", 18) == 0)
+            generateIndices = false;
+
+        // Uploads the vertices of non-simple materials in PackedVertex's compact format
+        if (strncmp(args[i], "--packed-vertices", 17) == 0)
+            packVertices = true;
     }
 
     if (scene == null)
@@ -5444,6 +7958,12 @@ int main(int argc, char** args)
     app.postPass = ssaoSamples > 0 || ssr;
     app.ssao = ssaoSamples > 0;
     app.ssr = ssr;
+    app.parseThreads = parseThreads;
+    app.textureThreads = textureThreads;
+    app.sceneCache = sceneCache;
+    app.shareVertexBuffers = shareVertexBuffers;
+    app.generateIndices = generateIndices;
+    app.packVertices = packVertices;
 
     if (app.postPass)
         app.samplesPerPixel = ssaoSamples;
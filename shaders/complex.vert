@@ -1,8 +1,12 @@
 #version 450
 
-layout(location = 0) in vec3 position;
-layout(location = 1) in vec3 normal;
-layout(location = 2) in vec4 tangent;
+// Set for PackedVertex, whose position is normalized to the mesh's bounds with the tangent's handedness in w, and
+// whose normal and tangent are octahedral in xy
+layout(constant_id = 0) const bool packedVertices = false;
+
+layout(location = 0) in vec4 inPosition;
+layout(location = 1) in vec3 inNormal;
+layout(location = 2) in vec4 inTangent;
 layout(location = 3) in vec2 texCoord;
 layout(location = 4) in vec4 color;
 
@@ -44,10 +48,31 @@ layout(push_constant) uniform PushConstant
 {
     mat4 model;
     int shadowMap;
+    vec4 positionScale;
+    vec4 positionOffset;
 } pc;
 
+vec3 octahedral(vec2 e)
+{
+    vec3 n = vec3(e, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+    return normalize(n);
+}
+
 void main()
 {
+    vec3 position = inPosition.xyz;
+    vec3 normal = inNormal;
+    vec4 tangent = inTangent;
+
+    if (packedVertices)
+    {
+        position = pc.positionOffset.xyz + pc.positionScale.xyz * inPosition.xyz;
+        normal = octahedral(inNormal.xy);
+        tangent = vec4(octahedral(inTangent.xy), inPosition.w * 2.0 - 1.0);
+    }
+
     gl_Position = vec4(position, 1.0);
 
     fragWorldPos = (pc.model * vec4(position, 1.0)).xyz;
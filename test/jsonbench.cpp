@@ -0,0 +1,469 @@
+//
+// Parser benchmark over a generated s72 corpus.
+//
+// Usage: jsonbench [--nodes N] [--drivers M] [--keyframes K] [--string-length L] [--depth D]
+//                  [--repeat R] [--out file.s72]
+//
+// Each stage runs in a child process of its own so that its peak RSS can be reported separately. Scene
+// construction (parseScene) needs a Vulkan device and is timed by the renderer itself: --out also writes the
+// bench.b72 the corpus's meshes read, next to it, so that "renderer --scene file.s72 --log-stats --no-scene-cache"
+// loads it. Without --no-scene-cache, every load after the first reads the .s72b cache instead of parsing.
+//
+
+#include "../json.hpp"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <random>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+std::atomic<size_t> allocations {0};
+std::atomic<size_t> allocatedBytes {0};
+
+// The replacements allocate through these, rather than calling malloc and free themselves, which GCC reports as a
+// mismatch with new and delete wherever it inlines them into each other
+static void* allocate(size_t size)
+{
+    allocations++;
+    allocatedBytes += size;
+
+    void* p = std::malloc(size == 0 ? 1 : size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+
+    return p;
+}
+
+static void deallocate(void* p)
+{
+    std::free(p);
+}
+
+void* operator new(size_t size)
+{
+    return allocate(size);
+}
+
+void* operator new[](size_t size)
+{
+    return allocate(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    deallocate(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    deallocate(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    deallocate(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    deallocate(p);
+}
+
+struct CorpusOptions
+{
+    int nodes = 10000;
+    int drivers = 1000;
+    int keyframes = 200;
+    int stringLength = 16;
+    int depth = 0;
+};
+
+struct Corpus
+{
+    std::string text;
+    std::mt19937 random {72};
+
+    void number(double d)
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%.6g", d);
+        text += buf;
+    }
+
+    void numbers(int count, double scale)
+    {
+        text += '[';
+        for (int i = 0; i < count; i++)
+        {
+            if (i > 0)
+                text += ',';
+
+            number(std::uniform_real_distribution<double>(-scale, scale)(random));
+        }
+        text += ']';
+    }
+
+    void string(const char* prefix, int i, int length)
+    {
+        text += '"';
+        text += prefix;
+        text += std::to_string(i);
+
+        for (int c = 0; c < length; c++)
+        {
+            int r = (int) (random() % 64);
+            if (r == 0)
+                text += "\\\"";
+            else if (r == 1)
+                text += "\\\\";
+            else
+                text += (char) ('a' + r % 26);
+        }
+
+        text += '"';
+    }
+
+    // Unknown keys are ignored by the scene loader, so this only exercises the parser
+    void nested(int depth)
+    {
+        if (depth == 0)
+        {
+            number(depth);
+            return;
+        }
+
+        text += depth % 2 == 0 ? "[" : "{\"d\":";
+        nested(depth - 1);
+        text += depth % 2 == 0 ? "]" : "}";
+    }
+};
+
+static std::string generateCorpus(const CorpusOptions& o)
+{
+    Corpus c;
+    int meshes = std::max(1, o.nodes / 10);
+
+    // Element indices: 1 scene, 2 camera, then meshes, nodes and drivers
+    int firstMesh = 3;
+    int firstNode = firstMesh + meshes;
+
+    c.text += "[\"s72-v1\",\n";
+    c.text += "{\"type\":\"SCENE\",\"name\":\"bench\",\"roots\":[";
+    for (int i = 0; i < o.nodes; i += 8)
+    {
+        if (i > 0)
+            c.text += ',';
+
+        c.text += std::to_string(firstNode + i);
+    }
+    c.text += "]},\n";
+
+    c.text += "{\"type\":\"CAMERA\",\"name\":\"main\",\"perspective\":{\"aspect\":1.777,\"vfov\":0.9,\"near\":0.1,\"far\":1000}}";
+
+    for (int i = 0; i < meshes; i++)
+    {
+        c.text += ",\n{\"type\":\"MESH\",\"name\":";
+        c.string("mesh", i, o.stringLength);
+        c.text += ",\"topology\":\"TRIANGLE_LIST\",\"count\":36,\"attributes\":{";
+        c.text += "\"POSITION\":{\"src\":\"bench.b72\",\"offset\":0,\"stride\":52,\"format\":\"R32G32B32_SFLOAT\"},";
+        c.text += "\"NORMAL\":{\"src\":\"bench.b72\",\"offset\":12,\"stride\":52,\"format\":\"R32G32B32_SFLOAT\"},";
+        c.text += "\"TANGENT\":{\"src\":\"bench.b72\",\"offset\":24,\"stride\":52,\"format\":\"R32G32B32A32_SFLOAT\"},";
+        c.text += "\"TEXCOORD\":{\"src\":\"bench.b72\",\"offset\":40,\"stride\":52,\"format\":\"R32G32_SFLOAT\"}}}";
+    }
+
+    for (int i = 0; i < o.nodes; i++)
+    {
+        c.text += ",\n{\"type\":\"NODE\",\"name\":";
+        c.string("node", i, o.stringLength);
+        c.text += ",\"translation\":";
+        c.numbers(3, 100);
+        c.text += ",\"rotation\":";
+        c.numbers(4, 1);
+        c.text += ",\"scale\":";
+        c.numbers(3, 2);
+
+        // Groups of eight: the first of each group is a root with the other seven as children
+        if (i % 8 == 0)
+        {
+            c.text += ",\"children\":[";
+            for (int k = i + 1; k < std::min(i + 8, o.nodes); k++)
+            {
+                if (k > i + 1)
+                    c.text += ',';
+
+                c.text += std::to_string(firstNode + k);
+            }
+            c.text += "]";
+        }
+        else
+        {
+            c.text += ",\"mesh\":";
+            c.text += std::to_string(firstMesh + i % meshes);
+        }
+
+        if (o.depth > 0)
+        {
+            c.text += ",\"extras\":";
+            c.nested(o.depth);
+        }
+
+        c.text += "}";
+    }
+
+    const char* channels[] = {"translation", "rotation", "scale"};
+    for (int i = 0; i < o.drivers; i++)
+    {
+        int channel = i % 3;
+
+        c.text += ",\n{\"type\":\"DRIVER\",\"name\":";
+        c.string("driver", i, o.stringLength);
+        c.text += ",\"node\":";
+        c.text += std::to_string(firstNode + (i / 3) % o.nodes);
+        c.text += ",\"channel\":\"";
+        c.text += channels[channel];
+        c.text += "\",\"times\":[";
+        for (int k = 0; k < o.keyframes; k++)
+        {
+            if (k > 0)
+                c.text += ',';
+
+            c.number(k / 24.0);
+        }
+        c.text += "],\"values\":";
+        c.numbers(o.keyframes * (channel == 1 ? 4 : 3), 10);
+        c.text += ",\"interpolation\":\"LINEAR\"}";
+    }
+
+    c.text += "\n]\n";
+    return c.text;
+}
+
+// The one mesh every MESH element of the corpus points at: a cube of 36 vertices, laid out as the renderer's
+// ComplexVertex (position, normal, tangent, texture coordinates and color, 52 bytes in all)
+static void writeMeshData(const std::string& filename)
+{
+    std::ofstream file (filename, std::ios::binary);
+
+    for (int face = 0; face < 6; face++)
+    {
+        int axis = face / 2;
+        float side = face % 2 == 0 ? 1.0f : -1.0f;
+
+        // The two triangles of the face, as corners in the face's own coordinates
+        const float corners[6][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, -1}, {1, 1}, {-1, 1}};
+        for (const auto& corner: corners)
+        {
+            float position[3];
+            float normal[3] = {0, 0, 0};
+            position[axis] = side;
+            position[(axis + 1) % 3] = corner[0];
+            position[(axis + 2) % 3] = corner[1] * side;
+            normal[axis] = side;
+
+            float tangent[4] = {0, 0, 0, 1};
+            tangent[(axis + 1) % 3] = 1;
+
+            float texCoord[2] = {(corner[0] + 1) / 2, (corner[1] + 1) / 2};
+            unsigned char color[4] = {255, 255, 255, 255};
+
+            file.write((const char*) position, sizeof(position));
+            file.write((const char*) normal, sizeof(normal));
+            file.write((const char*) tangent, sizeof(tangent));
+            file.write((const char*) texCoord, sizeof(texCoord));
+            file.write((const char*) color, sizeof(color));
+        }
+    }
+}
+
+// Counts events, for the parsers that do not build anything themselves
+struct CountingHandler
+{
+    size_t events = 0;
+
+    void start_object() { events++; }
+    void key(std::string_view) { events++; }
+    void end_object() { events++; }
+    void start_array() { events++; }
+    void end_array() { events++; }
+    void string(std::string_view) { events++; }
+    void number(double) { events++; }
+    void boolean(bool) { events++; }
+    void null_value() { events++; }
+};
+
+static long peakRssKilobytes(const rusage& usage)
+{
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+static void runStage(const char* name, const std::string& text, int repeat, const std::function<void()>& stage)
+{
+    fflush(stdout);
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        double best = 1e30;
+        size_t stageAllocations = 0;
+        size_t stageBytes = 0;
+
+        for (int i = 0; i < repeat; i++)
+        {
+            size_t a = allocations;
+            size_t b = allocatedBytes;
+            auto start = std::chrono::high_resolution_clock::now();
+
+            stage();
+
+            auto end = std::chrono::high_resolution_clock::now();
+            best = std::min(best, std::chrono::duration<double>(end - start).count());
+            stageAllocations = allocations - a;
+            stageBytes = allocatedBytes - b;
+        }
+
+        printf("%-22s %9.1f MB/s %9.2f ms %10zu allocs %9.1f MB allocated", name, text.size() / 1e6 / best, best * 1000,
+               stageAllocations, stageBytes / 1e6);
+        fflush(stdout);
+        _exit(0);
+    }
+
+    int status;
+    rusage usage {};
+    wait4(pid, &status, 0, &usage);
+    printf(" %8ld KB peak RSS\n", peakRssKilobytes(usage));
+}
+
+int main(int argc, char** args)
+{
+    CorpusOptions options;
+    int repeat = 5;
+    const char* out = nullptr;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(args[i], "--nodes", 7) == 0 && i + 1 < argc)
+            options.nodes = std::stoi(args[i + 1]);
+
+        if (strncmp(args[i], "--drivers", 9) == 0 && i + 1 < argc)
+            options.drivers = std::stoi(args[i + 1]);
+
+        if (strncmp(args[i], "--keyframes", 11) == 0 && i + 1 < argc)
+            options.keyframes = std::stoi(args[i + 1]);
+
+        if (strncmp(args[i], "--string-length", 15) == 0 && i + 1 < argc)
+            options.stringLength = std::stoi(args[i + 1]);
+
+        if (strncmp(args[i], "--depth", 7) == 0 && i + 1 < argc)
+            options.depth = std::stoi(args[i + 1]);
+
+        if (strncmp(args[i], "--repeat", 8) == 0 && i + 1 < argc)
+            repeat = std::stoi(args[i + 1]);
+
+        if (strncmp(args[i], "--out", 5) == 0 && i + 1 < argc)
+            out = args[i + 1];
+    }
+
+    std::string text = generateCorpus(options);
+    printf("corpus: %d nodes, %d drivers x %d keyframes, %.1f MB\n", options.nodes, options.drivers, options.keyframes, text.size() / 1e6);
+
+    if (out != nullptr)
+    {
+        std::ofstream file(out, std::ios::binary);
+        file.write(text.data(), (long) text.size());
+
+        std::string path = out;
+        size_t slash = path.find_last_of('/');
+        writeMeshData((slash == std::string::npos ? "" : path.substr(0, slash + 1)) + "bench.b72");
+    }
+
+    printf("\n");
+
+    // Lower bound: touching every byte once, plus the RSS of the corpus itself
+    runStage("memcpy", text, repeat, [&]()
+    {
+        std::string copy = text;
+    });
+
+    runStage("jparse_array", text, repeat, [&]()
+    {
+        jdestroy(jparse_array(text));
+    });
+
+    runStage("jdocument", text, repeat, [&]()
+    {
+        jdocument document;
+        document.parse(text);
+    });
+
+    runStage("jdocument dense", text, repeat, [&]()
+    {
+        jdocument document;
+        document.denseNumbers = true;
+        document.parse(text);
+    });
+
+    runStage("jdocument atoms", text, repeat, [&]()
+    {
+        jatoms atoms;
+        jdocument document;
+        document.denseNumbers = true;
+        document.atoms = &atoms;
+        document.parse(text);
+    });
+
+    runStage("jdocument parallel", text, repeat, [&]()
+    {
+        jdocument document;
+        document.denseNumbers = true;
+        document.parse_parallel(text.data(), text.size());
+    });
+
+    runStage("jtape", text, repeat, [&]()
+    {
+        jtape tape;
+        tape.parse(text);
+    });
+
+    runStage("jsax", text, repeat, [&]()
+    {
+        CountingHandler handler;
+        jsax(text.data(), text.size(), handler);
+    });
+
+    runStage("jsax + jbuilder", text, repeat, [&]()
+    {
+        jarena arena;
+        jbuilder builder (&arena);
+        builder.denseNumbers = true;
+        jsax(text.data(), text.size(), builder);
+    });
+
+    runStage("jsax + jbuilder atoms", text, repeat, [&]()
+    {
+        jatoms atoms;
+        jarena arena;
+        jbuilder builder (&arena);
+        builder.denseNumbers = true;
+        builder.atoms = &atoms;
+        jsax(text.data(), text.size(), builder);
+    });
+
+    runStage("jstream 4 MB chunks", text, repeat, [&]()
+    {
+        CountingHandler handler;
+        jstream<CountingHandler> stream (handler);
+
+        for (size_t i = 0; i < text.size(); i += 4 << 20)
+            stream.feed(text.data() + i, std::min<size_t>(4 << 20, text.size() - i));
+
+        stream.finish();
+    });
+}
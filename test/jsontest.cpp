@@ -3,9 +3,50 @@
 //
 
 #include "../json.hpp"
+
+struct Fields
+{
+    std::string_view one;
+    int32_t two = 0;
+    bool three = true;
+    std::optional<double> nine;
+
+    static constexpr auto fields()
+    {
+        return std::make_tuple(jbind("one", &Fields::one), jbind("two", &Fields::two), jbind("three", &Fields::three),
+                               jbind("nine", &Fields::nine));
+    }
+};
+
 int main()
 {
-    jobject* j = jparse(R"({ "one" : "yes", "two" : 2, "three":false , "four":true , "five":null, "six":[2], "seven":[1, 2, 3], "eight": {} })");
+    const char* text = R"({ "one" : "yes", "two" : 2, "three":false , "four":true , "five":null, "six":[2], "seven":[1, 2, 3], "eight": {} })";
+
+    jobject* j = jparse(text);
     jnumber* s = static_cast<jnumber*>((*j)["two"]);
     printf("[%f]\n", s->value);
-}
\ No newline at end of file
+    jdestroy(j);
+
+    jdocument document;
+    jobject* d = jobject::cast(document.parse(text));
+    printf("[%zu]\n", jarray::cast((*d)["seven"])->size());
+
+    jarena arena;
+    jbuilder builder (&arena);
+    jsax(text, strlen(text), builder);
+    printf("[%s]\n", std::string(jstring::cast((*jobject::cast(builder.root))["one"])->value).c_str());
+
+    jatoms atoms;
+    jdocument interned;
+    interned.atoms = &atoms;
+    jobject* n = jobject::cast(interned.parse(text));
+    printf("[%d]\n", atoms.is(jstring::cast((*n)["one"]), atoms.find("yes")));
+
+    jtape tape;
+    tape.parse(text);
+    printf("[%zu %g]\n", tape.root()["seven"].size(), tape.root()["seven"].at(2).number());
+
+    Fields fields;
+    jdecode(d, fields);
+    printf("[%s %d %d %d]\n", std::string(fields.one).c_str(), fields.two, fields.three, fields.nine.has_value());
+}